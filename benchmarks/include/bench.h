@@ -0,0 +1,51 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include "data_types.h"
+#include <stdio.h>
+
+// Results of one benchmark scenario. Latency samples are in nanoseconds,
+// one per sampled operation.
+typedef struct
+{
+    const CHAR* name;
+    const CHAR* unit;
+    UINT64 operations;
+    UINT64 events;
+    UINT64 elapsed_ns;
+    UINT32* p_samples;
+    UINT32 sample_count;
+    UINT32 sample_max;
+} bench_result_t;
+
+UINT64 bench_now_ns(void);
+
+void bench_begin(bench_result_t* result, const CHAR* name, const CHAR* unit, UINT32 sample_max);
+void bench_end(bench_result_t* result, UINT64 elapsed_ns);
+void bench_free(bench_result_t* result);
+
+// Records the latency of one operation
+#define bench_sample(_result_, _ns_) \
+    do { UINT64 _v_ = (_ns_); \
+        if ((_result_)->sample_count < (_result_)->sample_max) \
+            (_result_)->p_samples[(_result_)->sample_count++] = (UINT32)(_v_ > 0xFFFFFFFFull ? 0xFFFFFFFFull : _v_); } while (0)
+
+// Only one operation in BENCH_SAMPLE_INTERVAL is timed on its own, so the
+// clock reads hardly weigh on the overall event rate. A power of two.
+#define BENCH_SAMPLE_INTERVAL   64
+
+#define bench_sampled(_i_) \
+    (((_i_) & (BENCH_SAMPLE_INTERVAL - 1)) == 0)
+
+// Number of samples taken over _count_ operations
+#define bench_sample_count(_count_) \
+    (((_count_) + BENCH_SAMPLE_INTERVAL - 1) / BENCH_SAMPLE_INTERVAL)
+
+// Runs operation _i_, timing it when it is sampled
+#define bench_run(_result_, _i_, _op_) \
+    do { if (bench_sampled(_i_)) { UINT64 _t0_ = bench_now_ns(); _op_; \
+        bench_sample(_result_, bench_now_ns() - _t0_); } else { _op_; } } while (0)
+
+void bench_report(FILE* out, const bench_result_t* results, UINT32 count, UINT32 threads);
+
+#endif // _BENCH_H
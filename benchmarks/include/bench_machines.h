@@ -0,0 +1,55 @@
+#ifndef _BENCH_MACHINES_H
+#define _BENCH_MACHINES_H
+
+#include "data_types.h"
+#include "state_machine.h"
+#include "sm_timer.h"
+
+// Motor machine of the centrifugue example, without console output
+typedef struct
+{
+    INT currentSpeed;
+} bm_motor_t;
+
+typedef struct
+{
+    INT speed;
+} bm_motor_data_t;
+
+EVENT_DECLARE(bm_set_speed, bm_motor_data_t)
+EVENT_DECLARE(bm_halt, no_event_data_t)
+
+// Centrifuge test machine of the centrifugue example, without console 
+// output. Polls run from a timer wheel advanced by the caller.
+SM_DECLARE(bc_centrifuge_sm)
+
+EVENT_DECLARE(bc_start, no_event_data_t)
+EVENT_DECLARE(bc_cancel, no_event_data_t)
+EVENT_DECLARE(bc_poll, no_event_data_t)
+
+void bc_init(sm_timer_wheel_t* p_wheel);
+UINT32 bc_run_test(void);
+
+// Synthetic machines of BL_STATES_MAX states. A bl_chain_start event runs
+// an internal event chain through chain_length states. bl_step moves a
+// guarded machine to the next state through guard, exit and entry actions.
+#define BL_STATES_MAX   64
+
+typedef struct
+{
+    UINT32 chain_length;
+    UINT32 visits;
+} bl_chain_t;
+
+typedef struct
+{
+    UINT32 visits;
+    UINT32 entries;
+    UINT32 exits;
+    UINT32 rejected;
+} bl_guarded_t;
+
+EVENT_DECLARE(bl_chain_start, no_event_data_t)
+EVENT_DECLARE(bl_step, no_event_data_t)
+
+#endif // _BENCH_MACHINES_H
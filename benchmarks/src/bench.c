@@ -0,0 +1,148 @@
+#include "bench.h"
+#include "fault.h"
+#include "state_machine.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static int bench_compare(const void* a, const void* b);
+static UINT32 bench_percentile(const UINT32* p_sorted, UINT32 count, UINT32 per_mille);
+
+//----------------------------------------------------------------------------
+// bench_compare
+//----------------------------------------------------------------------------
+static int bench_compare(const void* a, const void* b)
+{
+    UINT32 x = *(const UINT32*)a;
+    UINT32 y = *(const UINT32*)b;
+
+    return (x > y) - (x < y);
+}
+
+//----------------------------------------------------------------------------
+// bench_percentile
+//----------------------------------------------------------------------------
+static UINT32 bench_percentile(const UINT32* p_sorted, UINT32 count, UINT32 per_mille)
+{
+    UINT64 index;
+
+    if (!count)
+        return 0;
+
+    index = (UINT64)count * per_mille / 1000;
+    if (index >= count)
+        index = count - 1;
+
+    return p_sorted[index];
+}
+
+//----------------------------------------------------------------------------
+// bench_now_ns
+//----------------------------------------------------------------------------
+UINT64 bench_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (UINT64)now.tv_sec * 1000000000ull + (UINT64)now.tv_nsec;
+}
+
+//----------------------------------------------------------------------------
+// bench_begin
+//----------------------------------------------------------------------------
+void bench_begin(bench_result_t* result, const CHAR* name, const CHAR* unit, UINT32 sample_max)
+{
+    ASSERT_TRUE(result);
+
+    memset(result, 0, sizeof(bench_result_t));
+    result->name = name;
+    result->unit = unit;
+    result->sample_max = sample_max;
+    result->p_samples = malloc((size_t)sample_max * sizeof(UINT32));
+    ASSERT_TRUE(result->p_samples || !sample_max);
+}
+
+//----------------------------------------------------------------------------
+// bench_end
+//----------------------------------------------------------------------------
+void bench_end(bench_result_t* result, UINT64 elapsed_ns)
+{
+    ASSERT_TRUE(result);
+
+    result->elapsed_ns = elapsed_ns;
+    qsort(result->p_samples, result->sample_count, sizeof(UINT32), bench_compare);
+}
+
+//----------------------------------------------------------------------------
+// bench_free
+//----------------------------------------------------------------------------
+void bench_free(bench_result_t* result)
+{
+    ASSERT_TRUE(result);
+
+    free(result->p_samples);
+    result->p_samples = NULL;
+    result->sample_count = 0;
+}
+
+//----------------------------------------------------------------------------
+// bench_report
+//----------------------------------------------------------------------------
+void bench_report(FILE* out, const bench_result_t* results, UINT32 count, UINT32 threads)
+{
+    const bench_result_t* result;
+    double seconds;
+    UINT32 i;
+
+    // Library configuration the numbers were taken with
+    fprintf(out, "{\n  \"config\": {\n");
+#if defined(LK_BACKEND_FUTEX)
+    fprintf(out, "    \"lock_backend\": \"futex\",\n");
+#elif defined(LK_BACKEND_TICKET)
+    fprintf(out, "    \"lock_backend\": \"ticket\",\n");
+#else
+    fprintf(out, "    \"lock_backend\": \"pthread\",\n");
+#endif
+#ifdef LK_PROFILE
+    fprintf(out, "    \"lock_profile\": true,\n");
+#else
+    fprintf(out, "    \"lock_profile\": false,\n");
+#endif
+#ifdef SM_TRACE
+    fprintf(out, "    \"trace\": true,\n");
+#else
+    fprintf(out, "    \"trace\": false,\n");
+#endif
+#ifdef SM_METRICS
+    fprintf(out, "    \"metrics\": true,\n");
+#else
+    fprintf(out, "    \"metrics\": false,\n");
+#endif
+    fprintf(out, "    \"ndebug\": %s,\n", sm_debug_build() ? "false" : "true");
+    fprintf(out, "    \"internal_event_max\": %d,\n", SM_INTERNAL_EVENT_MAX);
+    fprintf(out, "    \"deferred_event_max\": %d,\n", SM_DEFERRED_EVENT_MAX);
+    fprintf(out, "    \"sample_interval\": %d,\n", BENCH_SAMPLE_INTERVAL);
+    fprintf(out, "    \"threads\": %u\n  },\n  \"results\": [\n", threads);
+
+    for (i = 0; i < count; i++)
+    {
+        result = &results[i];
+        seconds = (double)result->elapsed_ns / 1e9;
+
+        fprintf(out, "    {\n");
+        fprintf(out, "      \"name\": \"%s\",\n", result->name);
+        fprintf(out, "      \"unit\": \"%s\",\n", result->unit);
+        fprintf(out, "      \"operations\": %llu,\n", (unsigned long long)result->operations);
+        fprintf(out, "      \"events\": %llu,\n", (unsigned long long)result->events);
+        fprintf(out, "      \"seconds\": %.6f,\n", seconds);
+        fprintf(out, "      \"events_per_sec\": %.0f,\n", seconds > 0 ? (double)result->events / seconds : 0.0);
+        fprintf(out, "      \"ns_per_event\": %.2f,\n", result->events ? (double)result->elapsed_ns / (double)result->events : 0.0);
+        fprintf(out, "      \"p50_ns\": %u,\n", bench_percentile(result->p_samples, result->sample_count, 500));
+        fprintf(out, "      \"p99_ns\": %u,\n", bench_percentile(result->p_samples, result->sample_count, 990));
+        fprintf(out, "      \"p999_ns\": %u,\n", bench_percentile(result->p_samples, result->sample_count, 999));
+        fprintf(out, "      \"max_ns\": %u\n", result->sample_count ? result->p_samples[result->sample_count - 1] : 0);
+        fprintf(out, "    }%s\n", i + 1 < count ? "," : "");
+    }
+
+    fprintf(out, "  ]\n}\n");
+}
@@ -0,0 +1,204 @@
+#include "bench_machines.h"
+
+typedef struct
+{
+    INT speed;
+    BOOL pollActive;
+} bc_centrifuge_t;
+
+static bc_centrifuge_t centrifuge;
+SM_DEFINE_HSM(bc_centrifuge_sm, &centrifuge)
+
+static sm_timer_wheel_t* p_timer_wheel;
+static sm_timer_t poll_timer;
+
+// State enumeration order must match the order of state
+// method entries in the state map
+enum States
+{
+    ST_IDLE,
+    ST_COMPLETED,
+    ST_FAILED,
+    ST_START_TEST,
+    ST_ACCELERATION,
+    ST_WAIT_FOR_ACCELERATION,
+    ST_DECELERATION,
+    ST_WAIT_FOR_DECELERATION,
+    ST_MAX_STATES
+};
+
+STATE_DECLARE(Idle, no_event_data_t)
+ENTRY_DECLARE(Idle, no_event_data_t)
+STATE_DECLARE(Completed, no_event_data_t)
+STATE_DECLARE(Failed, no_event_data_t)
+STATE_DECLARE(StartTest, no_event_data_t)
+GUARD_DECLARE(StartTest, no_event_data_t)
+STATE_DECLARE(Acceleration, no_event_data_t)
+STATE_DECLARE(WaitForAcceleration, no_event_data_t)
+EXIT_DECLARE(WaitForAcceleration)
+STATE_DECLARE(Deceleration, no_event_data_t)
+STATE_DECLARE(WaitForDeceleration, no_event_data_t)
+EXIT_DECLARE(WaitForDeceleration)
+
+BEGIN_STATE_MAP_HSM(bc_centrifuge_t)
+    STATE_MAP_ENTRY_ALL_HSM(ST_Idle, SM_NO_PARENT, 0, EN_Idle, 0)
+    STATE_MAP_ENTRY_HSM(ST_Completed, SM_NO_PARENT)
+    STATE_MAP_ENTRY_HSM(ST_Failed, SM_NO_PARENT)
+    STATE_MAP_ENTRY_ALL_HSM(ST_StartTest, SM_NO_PARENT, GD_StartTest, 0, 0)
+    STATE_MAP_ENTRY_HSM(ST_Acceleration, ST_START_TEST)
+    STATE_MAP_ENTRY_ALL_HSM(ST_WaitForAcceleration, ST_START_TEST, 0, 0, EX_WaitForAcceleration)
+    STATE_MAP_ENTRY_HSM(ST_Deceleration, ST_START_TEST)
+    STATE_MAP_ENTRY_ALL_HSM(ST_WaitForDeceleration, ST_START_TEST, 0, 0, EX_WaitForDeceleration)
+END_STATE_MAP_HSM(bc_centrifuge_t)
+
+EVENT_DEFINE(bc_start, no_event_data_t)
+{
+    BEGIN_TRANSITION_MAP                                // - Current State -
+        TRANSITION_MAP_ENTRY(ST_START_TEST)             // ST_IDLE
+        TRANSITION_MAP_ENTRY(CANNOT_HAPPEN)             // ST_COMPLETED
+        TRANSITION_MAP_ENTRY(CANNOT_HAPPEN)             // ST_FAILED
+        TRANSITION_MAP_ENTRY(EVENT_IGNORED)             // ST_START_TEST
+        TRANSITION_MAP_ENTRY(EVENT_INHERITED)           // ST_ACCELERATION
+        TRANSITION_MAP_ENTRY(EVENT_INHERITED)           // ST_WAIT_FOR_ACCELERATION
+        TRANSITION_MAP_ENTRY(EVENT_INHERITED)           // ST_DECELERATION
+        TRANSITION_MAP_ENTRY(EVENT_INHERITED)           // ST_WAIT_FOR_DECELERATION
+    END_TRANSITION_MAP(bc_centrifuge_t, p_event_data)
+}
+
+EVENT_DEFINE(bc_cancel, no_event_data_t)
+{
+    BEGIN_TRANSITION_MAP                                // - Current State -
+        TRANSITION_MAP_ENTRY(EVENT_IGNORED)             // ST_IDLE
+        TRANSITION_MAP_ENTRY(CANNOT_HAPPEN)             // ST_COMPLETED
+        TRANSITION_MAP_ENTRY(CANNOT_HAPPEN)             // ST_FAILED
+        TRANSITION_MAP_ENTRY(ST_FAILED)                 // ST_START_TEST
+        TRANSITION_MAP_ENTRY(EVENT_INHERITED)           // ST_ACCELERATION
+        TRANSITION_MAP_ENTRY(EVENT_INHERITED)           // ST_WAIT_FOR_ACCELERATION
+        TRANSITION_MAP_ENTRY(EVENT_INHERITED)           // ST_DECELERATION
+        TRANSITION_MAP_ENTRY(EVENT_INHERITED)           // ST_WAIT_FOR_DECELERATION
+    END_TRANSITION_MAP(bc_centrifuge_t, p_event_data)
+}
+
+EVENT_DEFINE(bc_poll, no_event_data_t)
+{
+    BEGIN_TRANSITION_MAP                                    // - Current State -
+        TRANSITION_MAP_ENTRY(EVENT_IGNORED)                 // ST_IDLE
+        TRANSITION_MAP_ENTRY(EVENT_IGNORED)                 // ST_COMPLETED
+        TRANSITION_MAP_ENTRY(EVENT_IGNORED)                 // ST_FAILED
+        TRANSITION_MAP_ENTRY(EVENT_IGNORED)                 // ST_START_TEST
+        TRANSITION_MAP_ENTRY(ST_WAIT_FOR_ACCELERATION)      // ST_ACCELERATION
+        TRANSITION_MAP_ENTRY(ST_WAIT_FOR_ACCELERATION)      // ST_WAIT_FOR_ACCELERATION
+        TRANSITION_MAP_ENTRY(ST_WAIT_FOR_DECELERATION)      // ST_DECELERATION
+        TRANSITION_MAP_ENTRY(ST_WAIT_FOR_DECELERATION)      // ST_WAIT_FOR_DECELERATION
+    END_TRANSITION_MAP(bc_centrifuge_t, p_event_data)
+}
+
+static void StartPoll(sm_state_machine_t* self)
+{
+    centrifuge.pollActive = TRUE;
+    sm_timer_start_state(p_timer_wheel, &poll_timer, self, (sm_event_func_t)bc_poll, 1, 0);
+}
+
+static void StopPoll(void)
+{
+    centrifuge.pollActive = FALSE;
+}
+
+void bc_init(sm_timer_wheel_t* p_wheel)
+{
+    p_timer_wheel = p_wheel;
+}
+
+// Runs one complete centrifuge test, ticking the wheel until the polls
+// stop. Returns the number of external events dispatched.
+UINT32 bc_run_test(void)
+{
+    UINT32 events = 1;
+
+    sm_event(bc_centrifuge_sm, bc_start, NULL);
+    while (sm_timer_wheel_pending(p_timer_wheel))
+        events += sm_timer_wheel_advance(p_timer_wheel, 1);
+
+    return events;
+}
+
+STATE_DEFINE(Idle, no_event_data_t)
+{
+    (void)self;
+    (void)p_event_data;
+}
+
+ENTRY_DEFINE(Idle, no_event_data_t)
+{
+    (void)self;
+    (void)p_event_data;
+    centrifuge.speed = 0;
+    StopPoll();
+}
+
+STATE_DEFINE(Completed, no_event_data_t)
+{
+    (void)p_event_data;
+    sm_internal_event(ST_IDLE, NULL);
+}
+
+STATE_DEFINE(Failed, no_event_data_t)
+{
+    (void)p_event_data;
+    sm_internal_event(ST_IDLE, NULL);
+}
+
+STATE_DEFINE(StartTest, no_event_data_t)
+{
+    (void)p_event_data;
+    sm_internal_event(ST_ACCELERATION, NULL);
+}
+
+GUARD_DEFINE(StartTest, no_event_data_t)
+{
+    (void)self;
+    (void)p_event_data;
+    return centrifuge.speed == 0;
+}
+
+STATE_DEFINE(Acceleration, no_event_data_t)
+{
+    (void)p_event_data;
+    StartPoll(self);
+}
+
+STATE_DEFINE(WaitForAcceleration, no_event_data_t)
+{
+    (void)p_event_data;
+    if (++centrifuge.speed >= 5)
+        sm_internal_event(ST_DECELERATION, NULL);
+    else
+        StartPoll(self);
+}
+
+EXIT_DEFINE(WaitForAcceleration)
+{
+    (void)self;
+    StopPoll();
+}
+
+STATE_DEFINE(Deceleration, no_event_data_t)
+{
+    (void)p_event_data;
+    StartPoll(self);
+}
+
+STATE_DEFINE(WaitForDeceleration, no_event_data_t)
+{
+    (void)p_event_data;
+    if (centrifuge.speed-- == 0)
+        sm_internal_event(ST_COMPLETED, NULL);
+    else
+        StartPoll(self);
+}
+
+EXIT_DEFINE(WaitForDeceleration)
+{
+    (void)self;
+    StopPoll();
+}
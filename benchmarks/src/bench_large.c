@@ -0,0 +1,143 @@
+#include "bench_machines.h"
+
+// One entry per state, in state map order
+#define BL_STATE_LIST(X) \
+    X(0) \
+    X(1) \
+    X(2) \
+    X(3) \
+    X(4) \
+    X(5) \
+    X(6) \
+    X(7) \
+    X(8) \
+    X(9) \
+    X(10) \
+    X(11) \
+    X(12) \
+    X(13) \
+    X(14) \
+    X(15) \
+    X(16) \
+    X(17) \
+    X(18) \
+    X(19) \
+    X(20) \
+    X(21) \
+    X(22) \
+    X(23) \
+    X(24) \
+    X(25) \
+    X(26) \
+    X(27) \
+    X(28) \
+    X(29) \
+    X(30) \
+    X(31) \
+    X(32) \
+    X(33) \
+    X(34) \
+    X(35) \
+    X(36) \
+    X(37) \
+    X(38) \
+    X(39) \
+    X(40) \
+    X(41) \
+    X(42) \
+    X(43) \
+    X(44) \
+    X(45) \
+    X(46) \
+    X(47) \
+    X(48) \
+    X(49) \
+    X(50) \
+    X(51) \
+    X(52) \
+    X(53) \
+    X(54) \
+    X(55) \
+    X(56) \
+    X(57) \
+    X(58) \
+    X(59) \
+    X(60) \
+    X(61) \
+    X(62) \
+    X(63)
+
+#define BL_NEXT(_n_)    (((_n_) + 1) % BL_STATES_MAX)
+
+// Chain machine. Each state raises an internal event to the next state until
+// chain_length states were visited.
+#define BL_CHAIN_STATE(_n_) \
+    STATE_DEFINE(Chain##_n_, no_event_data_t) \
+    { \
+        bl_chain_t* p_chain = sm_get_instance(bl_chain_t); \
+        (void)p_event_data; \
+        if (++p_chain->visits < p_chain->chain_length) \
+            sm_internal_event(BL_NEXT(_n_), NULL); \
+    }
+
+BL_STATE_LIST(BL_CHAIN_STATE)
+
+#define BL_CHAIN_MAP_ENTRY(_n_)     STATE_MAP_ENTRY(ST_Chain##_n_)
+
+BEGIN_STATE_MAP(bl_chain_t)
+    BL_STATE_LIST(BL_CHAIN_MAP_ENTRY)
+END_STATE_MAP(bl_chain_t)
+
+#define BL_TO_FIRST(_n_)    TRANSITION_MAP_ENTRY(0)
+
+EVENT_DEFINE(bl_chain_start, no_event_data_t)
+{
+    BEGIN_TRANSITION_MAP
+        BL_STATE_LIST(BL_TO_FIRST)
+    END_TRANSITION_MAP(bl_chain_t, p_event_data)
+}
+
+// Guarded machine. Every state has a guard, entry and exit action; the
+// guards reject one transition in eight.
+#define BL_GUARDED_STATE(_n_) \
+    STATE_DEFINE(Guarded##_n_, no_event_data_t) \
+    { \
+        (void)p_event_data; \
+        sm_get_instance(bl_guarded_t)->visits++; \
+    } \
+    GUARD_DEFINE(Guarded##_n_, no_event_data_t) \
+    { \
+        bl_guarded_t* p_guarded = sm_get_instance(bl_guarded_t); \
+        (void)p_event_data; \
+        if (((p_guarded->visits + p_guarded->rejected + 1) & 7) != 0) \
+            return TRUE; \
+        p_guarded->rejected++; \
+        return FALSE; \
+    } \
+    ENTRY_DEFINE(Guarded##_n_, no_event_data_t) \
+    { \
+        (void)p_event_data; \
+        sm_get_instance(bl_guarded_t)->entries++; \
+    } \
+    EXIT_DEFINE(Guarded##_n_) \
+    { \
+        sm_get_instance(bl_guarded_t)->exits++; \
+    }
+
+BL_STATE_LIST(BL_GUARDED_STATE)
+
+#define BL_GUARDED_MAP_ENTRY(_n_) \
+    STATE_MAP_ENTRY_ALL_EX(ST_Guarded##_n_, GD_Guarded##_n_, EN_Guarded##_n_, EX_Guarded##_n_)
+
+BEGIN_STATE_MAP_EX(bl_guarded_t)
+    BL_STATE_LIST(BL_GUARDED_MAP_ENTRY)
+END_STATE_MAP_EX(bl_guarded_t)
+
+#define BL_TO_NEXT(_n_)     TRANSITION_MAP_ENTRY(BL_NEXT(_n_))
+
+EVENT_DEFINE(bl_step, no_event_data_t)
+{
+    BEGIN_TRANSITION_MAP
+        BL_STATE_LIST(BL_TO_NEXT)
+    END_TRANSITION_MAP(bl_guarded_t, p_event_data)
+}
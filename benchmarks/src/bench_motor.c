@@ -0,0 +1,67 @@
+#include "bench_machines.h"
+
+// State enumeration order must match the order of state
+// method entries in the state map
+enum States
+{
+    ST_IDLE,
+    ST_STOP,
+    ST_START,
+    ST_CHANGE_SPEED,
+    ST_MAX_STATES
+};
+
+STATE_DECLARE(Idle, no_event_data_t)
+STATE_DECLARE(Stop, no_event_data_t)
+STATE_DECLARE(Start, bm_motor_data_t)
+STATE_DECLARE(ChangeSpeed, bm_motor_data_t)
+
+BEGIN_STATE_MAP(bm_motor_t)
+    STATE_MAP_ENTRY(ST_Idle)
+    STATE_MAP_ENTRY(ST_Stop)
+    STATE_MAP_ENTRY(ST_Start)
+    STATE_MAP_ENTRY(ST_ChangeSpeed)
+END_STATE_MAP(bm_motor_t)
+
+EVENT_DEFINE(bm_set_speed, bm_motor_data_t)
+{
+    BEGIN_TRANSITION_MAP                        // - Current State -
+        TRANSITION_MAP_ENTRY(ST_START)          // ST_Idle       
+        TRANSITION_MAP_ENTRY(CANNOT_HAPPEN)     // ST_Stop       
+        TRANSITION_MAP_ENTRY(ST_CHANGE_SPEED)   // ST_Start      
+        TRANSITION_MAP_ENTRY(ST_CHANGE_SPEED)   // ST_ChangeSpeed
+    END_TRANSITION_MAP(bm_motor_t, p_event_data)
+}
+
+EVENT_DEFINE(bm_halt, no_event_data_t)
+{
+    BEGIN_TRANSITION_MAP                        // - Current State -
+        TRANSITION_MAP_ENTRY(EVENT_IGNORED)     // ST_Idle
+        TRANSITION_MAP_ENTRY(CANNOT_HAPPEN)     // ST_Stop
+        TRANSITION_MAP_ENTRY(ST_STOP)           // ST_Start
+        TRANSITION_MAP_ENTRY(ST_STOP)           // ST_ChangeSpeed
+    END_TRANSITION_MAP(bm_motor_t, p_event_data)
+}
+
+STATE_DEFINE(Idle, no_event_data_t)
+{
+    (void)self;
+    (void)p_event_data;
+}
+
+STATE_DEFINE(Stop, no_event_data_t)
+{
+    (void)p_event_data;
+    sm_get_instance(bm_motor_t)->currentSpeed = 0;
+    sm_internal_event(ST_IDLE, NULL);
+}
+
+STATE_DEFINE(Start, bm_motor_data_t)
+{
+    sm_get_instance(bm_motor_t)->currentSpeed = p_event_data->speed;
+}
+
+STATE_DEFINE(ChangeSpeed, bm_motor_data_t)
+{
+    sm_get_instance(bm_motor_t)->currentSpeed = p_event_data->speed;
+}
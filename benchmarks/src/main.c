@@ -0,0 +1,332 @@
+// Runs the state machine benchmarks and prints their results as JSON on
+// stdout. Every BENCH_SAMPLE_INTERVAL-th operation is timed on its own, so
+// the report carries latency percentiles next to the overall event rate
+// without a clock read around every event.
+//
+// $ machina_bench -n 1000000 -t 4 > bench.json
+//
+// -n sets the number of events per scenario, -t the number of producer
+// threads of the contended scenario.
+
+#include "bench.h"
+#include "bench_machines.h"
+#include "fb_allocator.h"
+#include "state_machine.h"
+#include "sm_timer.h"
+#include "fault.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Instances of the fan-out scenario
+#define FANOUT_INSTANCES    1024
+
+// States visited per bl_chain_start event
+#define CHAIN_LENGTH        BL_STATES_MAX
+
+// A centrifuge test sends 12 events; scale iterations to match
+#define CENTRIFUGE_DIVISOR  12
+
+#define THREADS_MAX         64
+
+typedef struct
+{
+    sm_state_machine_t* p_machine;
+    UINT32* p_samples;
+    UINT32 count;
+} producer_t;
+
+static bm_motor_t motor;
+SM_DEFINE(bm_motor_sm, &motor)
+
+static bm_motor_t fanout_motors[FANOUT_INSTANCES];
+static sm_state_machine_t fanout_objs[FANOUT_INSTANCES];
+static CHAR fanout_names[FANOUT_INSTANCES][16];
+
+static bm_motor_t shared_motor;
+SM_DEFINE(bm_shared_sm, &shared_motor)
+
+static sm_timer_wheel_t timer_wheel;
+
+//----------------------------------------------------------------------------
+// send_motor_event
+//----------------------------------------------------------------------------
+static void send_motor_event(sm_state_machine_t* p_machine, UINT32 i)
+{
+    bm_motor_data_t* data;
+
+    if (i & 1)
+    {
+        bm_halt(p_machine, NULL);
+    }
+    else
+    {
+        data = sm_xalloc(sizeof(bm_motor_data_t));
+        ASSERT_TRUE(data);
+        data->speed = (INT)(i & 0xFF) + 1;
+        bm_set_speed(p_machine, data);
+    }
+}
+
+//----------------------------------------------------------------------------
+// bench_single
+//----------------------------------------------------------------------------
+static void bench_single(bench_result_t* result, UINT32 iterations)
+{
+    UINT64 start;
+    UINT32 i;
+
+    bench_begin(result, "motor_single", "event", bench_sample_count(iterations));
+
+    start = bench_now_ns();
+    for (i = 0; i < iterations; i++)
+    {
+        bench_run(result, i, send_motor_event(&bm_motor_smobj, i));
+    }
+    bench_end(result, bench_now_ns() - start);
+
+    result->operations = iterations;
+    result->events = iterations;
+}
+
+//----------------------------------------------------------------------------
+// bench_fanout
+//----------------------------------------------------------------------------
+static void bench_fanout(bench_result_t* result, UINT32 iterations)
+{
+    UINT64 start;
+    UINT32 i;
+
+    for (i = 0; i < FANOUT_INSTANCES; i++)
+    {
+        memset(&fanout_objs[i], 0, sizeof(sm_state_machine_t));
+        snprintf(fanout_names[i], sizeof(fanout_names[i]), "bm_motor%u", i);
+        fanout_objs[i].name = fanout_names[i];
+        fanout_objs[i].p_instance = &fanout_motors[i];
+    }
+
+    bench_begin(result, "motor_fanout", "event", bench_sample_count(iterations));
+
+    // Visit every instance in turn, so each event touches a cold instance
+    start = bench_now_ns();
+    for (i = 0; i < iterations; i++)
+    {
+        bench_run(result, i, send_motor_event(&fanout_objs[i % FANOUT_INSTANCES], i / FANOUT_INSTANCES));
+    }
+    bench_end(result, bench_now_ns() - start);
+
+    result->operations = iterations;
+    result->events = iterations;
+}
+
+//----------------------------------------------------------------------------
+// bench_chain
+//----------------------------------------------------------------------------
+static void bench_chain(bench_result_t* result, UINT32 iterations)
+{
+    bl_chain_t chain = { CHAIN_LENGTH, 0 };
+    sm_state_machine_t obj;
+    UINT64 visits = 0;
+    UINT64 start;
+    UINT32 count = iterations / CHAIN_LENGTH ? iterations / CHAIN_LENGTH : 1;
+    UINT32 i;
+
+    memset(&obj, 0, sizeof(obj));
+    obj.name = "bl_chain";
+    obj.p_instance = &chain;
+
+    bench_begin(result, "internal_chain", "chain", bench_sample_count(count));
+
+    start = bench_now_ns();
+    for (i = 0; i < count; i++)
+    {
+        chain.visits = 0;
+        bench_run(result, i, bl_chain_start(&obj, NULL));
+        visits += chain.visits;
+    }
+    bench_end(result, bench_now_ns() - start);
+
+    // Checked in every build, a short count would make the figures meaningless
+    if (visits != (UINT64)count * CHAIN_LENGTH)
+    {
+        fprintf(stderr, "%s: %llu of %llu states visited\n", result->name,
+            (unsigned long long)visits, (unsigned long long)count * CHAIN_LENGTH);
+        exit(1);
+    }
+    result->operations = count;
+    result->events = visits;
+}
+
+//----------------------------------------------------------------------------
+// bench_guarded
+//----------------------------------------------------------------------------
+static void bench_guarded(bench_result_t* result, UINT32 iterations)
+{
+    bl_guarded_t guarded;
+    sm_state_machine_t obj;
+    UINT64 start;
+    UINT32 i;
+
+    memset(&guarded, 0, sizeof(guarded));
+    memset(&obj, 0, sizeof(obj));
+    obj.name = "bl_guarded";
+    obj.p_instance = &guarded;
+
+    bench_begin(result, "guarded_ex", "event", bench_sample_count(iterations));
+
+    start = bench_now_ns();
+    for (i = 0; i < iterations; i++)
+    {
+        bench_run(result, i, bl_step(&obj, NULL));
+    }
+    bench_end(result, bench_now_ns() - start);
+
+    if (guarded.visits + guarded.rejected != iterations)
+    {
+        fprintf(stderr, "%s: %llu of %llu events accounted for\n", result->name,
+            (unsigned long long)(guarded.visits + guarded.rejected), (unsigned long long)iterations);
+        exit(1);
+    }
+    result->operations = iterations;
+    result->events = iterations;
+}
+
+//----------------------------------------------------------------------------
+// producer_thread
+//----------------------------------------------------------------------------
+static void* producer_thread(void* p_arg)
+{
+    producer_t* p_producer = (producer_t*)p_arg;
+    UINT64 t0;
+    UINT32 i;
+
+    for (i = 0; i < p_producer->count; i++)
+    {
+        if (!bench_sampled(i))
+        {
+            send_motor_event(p_producer->p_machine, i);
+            continue;
+        }
+
+        t0 = bench_now_ns();
+        send_motor_event(p_producer->p_machine, i);
+        t0 = bench_now_ns() - t0;
+        p_producer->p_samples[i / BENCH_SAMPLE_INTERVAL] = (UINT32)(t0 > 0xFFFFFFFFull ? 0xFFFFFFFFull : t0);
+    }
+
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// bench_producers
+//----------------------------------------------------------------------------
+static void bench_producers(bench_result_t* result, UINT32 iterations, UINT32 threads)
+{
+    pthread_t handles[THREADS_MAX];
+    producer_t producers[THREADS_MAX];
+    UINT32 per_thread = iterations / threads;
+    UINT32 samples = bench_sample_count(per_thread);
+    UINT64 start;
+    UINT32 i;
+
+    bench_begin(result, "motor_producers", "event", samples * threads);
+
+    _sm_lock_create(&bm_shared_smobj);
+
+    // Each thread records into its own segment of the sample buffer
+    start = bench_now_ns();
+    for (i = 0; i < threads; i++)
+    {
+        producers[i].p_machine = &bm_shared_smobj;
+        producers[i].p_samples = result->p_samples + (size_t)i * samples;
+        producers[i].count = per_thread;
+        if (pthread_create(&handles[i], NULL, producer_thread, &producers[i]) != 0)
+            ASSERT();
+    }
+    for (i = 0; i < threads; i++)
+        pthread_join(handles[i], NULL);
+    result->sample_count = samples * threads;
+    bench_end(result, bench_now_ns() - start);
+
+    _sm_lock_destroy(&bm_shared_smobj);
+
+    result->operations = (UINT64)per_thread * threads;
+    result->events = result->operations;
+}
+
+//----------------------------------------------------------------------------
+// bench_centrifuge
+//----------------------------------------------------------------------------
+static void bench_centrifuge(bench_result_t* result, UINT32 iterations)
+{
+    UINT64 events = 0;
+    UINT64 start;
+    UINT32 count = iterations / CENTRIFUGE_DIVISOR ? iterations / CENTRIFUGE_DIVISOR : 1;
+    UINT32 i;
+
+    sm_timer_wheel_init(&timer_wheel, 0);
+    bc_init(&timer_wheel);
+
+    bench_begin(result, "centrifuge_test", "test", bench_sample_count(count));
+
+    start = bench_now_ns();
+    for (i = 0; i < count; i++)
+    {
+        bench_run(result, i, events += bc_run_test());
+    }
+    bench_end(result, bench_now_ns() - start);
+
+    result->operations = count;
+    result->events = events;
+}
+
+int main(int argc, char* argv[])
+{
+    bench_result_t results[6];
+    UINT32 iterations = 1000000;
+    UINT32 threads = 4;
+    UINT32 i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            iterations = (UINT32)strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            threads = (UINT32)strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n events] [-t threads]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (iterations == 0 || threads == 0 || threads > THREADS_MAX)
+    {
+        fprintf(stderr, "%s: events must be positive and threads 1 to %u\n", argv[0], THREADS_MAX);
+        return 2;
+    }
+
+    alloc_init();
+
+    bench_single(&results[0], iterations);
+    bench_fanout(&results[1], iterations);
+    bench_chain(&results[2], iterations);
+    bench_guarded(&results[3], iterations);
+    bench_producers(&results[4], iterations, threads);
+    bench_centrifuge(&results[5], iterations);
+
+    bench_report(stdout, results, 6, threads);
+
+    for (i = 0; i < 6; i++)
+        bench_free(&results[i]);
+
+    alloc_term();
+
+    return 0;
+}
@@ -3,6 +3,7 @@
 
 #include "data_types.h"
 #include "state_machine.h"
+#include "sm_timer.h"
 
 // Declare the private instance of CentrifugeTest state machine
 SM_DECLARE(centrifugue_test_state_machine)
@@ -13,5 +14,6 @@ EVENT_DECLARE(cfg_cancel, no_event_data_t)
 EVENT_DECLARE(cfg_poll, no_event_data_t)
 
 BOOL cfg_is_poll_active();
+void cfg_init(sm_timer_wheel_t* p_wheel);
 
 #endif // _CENTRIFUGE_TEST_H
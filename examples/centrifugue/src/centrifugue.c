@@ -1,5 +1,6 @@
 #include "centrifugue_test.h"
 #include "state_machine.h"
+#include "sm_timer.h"
 #include <stdio.h>
 
 // centrifugue_test_t object structure
@@ -11,7 +12,11 @@ typedef struct
 
 // Define private instance of motor state machine
 centrifugue_test_t centrifugue_test_tObj;
-SM_DEFINE(centrifugue_test_state_machine, &centrifugue_test_tObj)
+SM_DEFINE_HSM(centrifugue_test_state_machine, &centrifugue_test_tObj)
+
+// Timer wheel driving the cfg_poll event and its poll timer
+static sm_timer_wheel_t* p_timer_wheel;
+static sm_timer_t poll_timer;
 
 // State enumeration order must match the order of state
 // method entries in the state map
@@ -42,17 +47,18 @@ STATE_DECLARE(Deceleration, no_event_data_t)
 STATE_DECLARE(WaitForDeceleration, no_event_data_t)
 EXIT_DECLARE(WaitForDeceleration)
 
-// State map to define state function order
-BEGIN_STATE_MAP_EX(centrifugue_test_t)
-    STATE_MAP_ENTRY_ALL_EX(ST_Idle, 0, EN_Idle, 0)
-    STATE_MAP_ENTRY_EX(ST_Completed)
-    STATE_MAP_ENTRY_EX(ST_Failed)
-    STATE_MAP_ENTRY_ALL_EX(ST_StartTest, GD_StartTest, 0, 0)
-    STATE_MAP_ENTRY_EX(ST_Acceleration)
-    STATE_MAP_ENTRY_ALL_EX(ST_WaitForAcceleration, 0, 0, EX_WaitForAcceleration)
-    STATE_MAP_ENTRY_EX(ST_Deceleration)
-    STATE_MAP_ENTRY_ALL_EX(ST_WaitForDeceleration, 0, 0, EX_WaitForDeceleration)
-END_STATE_MAP_EX(centrifugue_test_t)
+// State map to define state function order. The test states are substates
+// of ST_StartTest and share its cfg_start and cfg_cancel handling.
+BEGIN_STATE_MAP_HSM(centrifugue_test_t)
+    STATE_MAP_ENTRY_ALL_HSM(ST_Idle, SM_NO_PARENT, 0, EN_Idle, 0)
+    STATE_MAP_ENTRY_HSM(ST_Completed, SM_NO_PARENT)
+    STATE_MAP_ENTRY_HSM(ST_Failed, SM_NO_PARENT)
+    STATE_MAP_ENTRY_ALL_HSM(ST_StartTest, SM_NO_PARENT, GD_StartTest, 0, 0)
+    STATE_MAP_ENTRY_HSM(ST_Acceleration, ST_START_TEST)
+    STATE_MAP_ENTRY_ALL_HSM(ST_WaitForAcceleration, ST_START_TEST, 0, 0, EX_WaitForAcceleration)
+    STATE_MAP_ENTRY_HSM(ST_Deceleration, ST_START_TEST)
+    STATE_MAP_ENTRY_ALL_HSM(ST_WaitForDeceleration, ST_START_TEST, 0, 0, EX_WaitForDeceleration)
+END_STATE_MAP_HSM(centrifugue_test_t)
 
 EVENT_DEFINE(cfg_start, no_event_data_t)
 {
@@ -61,10 +67,10 @@ EVENT_DEFINE(cfg_start, no_event_data_t)
         TRANSITION_MAP_ENTRY(CANNOT_HAPPEN)             // ST_COMPLETED
         TRANSITION_MAP_ENTRY(CANNOT_HAPPEN)             // ST_FAILED
         TRANSITION_MAP_ENTRY(EVENT_IGNORED)             // ST_START_TEST
-        TRANSITION_MAP_ENTRY(EVENT_IGNORED)             // ST_ACCELERATION
-        TRANSITION_MAP_ENTRY(EVENT_IGNORED)             // ST_WAIT_FOR_ACCELERATION
-        TRANSITION_MAP_ENTRY(EVENT_IGNORED)             // ST_DECELERATION
-        TRANSITION_MAP_ENTRY(EVENT_IGNORED)             // ST_WAIT_FOR_DECELERATION
+        TRANSITION_MAP_ENTRY(EVENT_INHERITED)           // ST_ACCELERATION
+        TRANSITION_MAP_ENTRY(EVENT_INHERITED)           // ST_WAIT_FOR_ACCELERATION
+        TRANSITION_MAP_ENTRY(EVENT_INHERITED)           // ST_DECELERATION
+        TRANSITION_MAP_ENTRY(EVENT_INHERITED)           // ST_WAIT_FOR_DECELERATION
     END_TRANSITION_MAP(centrifugue_test_t, p_event_data)
 }
 
@@ -75,10 +81,10 @@ EVENT_DEFINE(cfg_cancel, no_event_data_t)
         TRANSITION_MAP_ENTRY(CANNOT_HAPPEN)             // ST_COMPLETED
         TRANSITION_MAP_ENTRY(CANNOT_HAPPEN)             // ST_FAILED
         TRANSITION_MAP_ENTRY(ST_FAILED)                 // ST_START_TEST
-        TRANSITION_MAP_ENTRY(ST_FAILED)                 // ST_ACCELERATION
-        TRANSITION_MAP_ENTRY(ST_FAILED)                 // ST_WAIT_FOR_ACCELERATION
-        TRANSITION_MAP_ENTRY(ST_FAILED)                 // ST_DECELERATION
-        TRANSITION_MAP_ENTRY(ST_FAILED)                 // ST_WAIT_FOR_DECELERATION
+        TRANSITION_MAP_ENTRY(EVENT_INHERITED)           // ST_ACCELERATION
+        TRANSITION_MAP_ENTRY(EVENT_INHERITED)           // ST_WAIT_FOR_ACCELERATION
+        TRANSITION_MAP_ENTRY(EVENT_INHERITED)           // ST_DECELERATION
+        TRANSITION_MAP_ENTRY(EVENT_INHERITED)           // ST_WAIT_FOR_DECELERATION
     END_TRANSITION_MAP(centrifugue_test_t, p_event_data)
 }
 
@@ -96,9 +102,13 @@ EVENT_DEFINE(cfg_poll, no_event_data_t)
     END_TRANSITION_MAP(centrifugue_test_t, p_event_data)
 }
 
-static void StartPoll(void)
+static void StartPoll(sm_state_machine_t* self)
 {
     centrifugue_test_tObj.pollActive = TRUE;
+
+    // Post cfg_poll on the next tick. The timer is bound to the current
+    // state, so leaving the state cancels any poll still pending.
+    sm_timer_start_state(p_timer_wheel, &poll_timer, self, (sm_event_func_t)cfg_poll, 1, 0);
 }
 
 static void StopPoll(void)
@@ -111,6 +121,11 @@ BOOL cfg_is_poll_active(void)
     return centrifugue_test_tObj.pollActive;
 }
 
+void cfg_init(sm_timer_wheel_t* p_wheel)
+{
+    p_timer_wheel = p_wheel;
+}
+
 STATE_DEFINE(Idle, no_event_data_t)
 {
     printf("%s ST_Idle\n", self->name);
@@ -158,7 +173,7 @@ STATE_DEFINE(Acceleration, no_event_data_t)
     printf("%s ST_Acceleration\n", self->name);
 
     // Start polling while waiting for centrifuge to ramp up to speed
-    StartPoll();
+    StartPoll(self);
 }
 
 // Wait in this state until target centrifuge speed is reached.
@@ -167,6 +182,8 @@ STATE_DEFINE(WaitForAcceleration, no_event_data_t)
     printf("%s ST_WaitForAcceleration : Speed is %d\n", self->name, centrifugue_test_tObj.speed);
     if (++centrifugue_test_tObj.speed >= 5)
         sm_internal_event(ST_DECELERATION, NULL);
+    else
+        StartPoll(self);
 }
 
 // Exit action when WaitForAcceleration state exits.
@@ -184,7 +201,7 @@ STATE_DEFINE(Deceleration, no_event_data_t)
     printf("%s ST_Deceleration\n", self->name);
 
     // Start polling while waiting for centrifuge to ramp down to 0
-    StartPoll();
+    StartPoll(self);
 }
 
 // Wait in this state until centrifuge speed is 0.
@@ -193,6 +210,8 @@ STATE_DEFINE(WaitForDeceleration, no_event_data_t)
     printf("%s ST_WaitForDeceleration : Speed is %d\n", self->name, centrifugue_test_tObj.speed);
     if (centrifugue_test_tObj.speed-- == 0)
         sm_internal_event(ST_COMPLETED, NULL);
+    else
+        StartPoll(self);
 }
 
 // Exit action when WaitForDeceleration state exits.
@@ -2,6 +2,8 @@
 #include "state_machine.h"
 #include "motor.h"
 #include "centrifugue_test.h"
+#include "sm_timer.h"
+#include <time.h>
 
 // Define motor objects
 static Motor motorObj1;
@@ -11,6 +13,9 @@ static Motor motorObj2;
 SM_DEFINE(Motor1SM, &motorObj1)
 SM_DEFINE(Motor2SM, &motorObj2)
 
+// Timer wheel with a 1 ms tick
+static sm_timer_wheel_t timer_wheel;
+
 int main(void)
 {
     alloc_init();
@@ -42,10 +47,19 @@ int main(void)
     sm_event(Motor2SM, mtr_halt, NULL);
 
     // centrifugue_test_state_machine example
+    sm_timer_wheel_init(&timer_wheel, 0);
+    cfg_init(&timer_wheel);
+
     sm_event(centrifugue_test_state_machine, cfg_cancel, NULL);
     sm_event(centrifugue_test_state_machine, cfg_start, NULL);
-    while (cfg_is_poll_active())
-        sm_event(centrifugue_test_state_machine, cfg_poll, NULL);
+
+    // Sleep between ticks instead of spinning on cfg_poll
+    while (sm_timer_wheel_pending(&timer_wheel))
+    {
+        struct timespec tick = { 0, 1000000 };
+        nanosleep(&tick, NULL);
+        sm_timer_wheel_advance(&timer_wheel, 1);
+    }
 
     alloc_term();
 
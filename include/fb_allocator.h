@@ -17,6 +17,28 @@
 //      block = alloc_alloc(myAllocator, 32);
 //      alloc_free(myAllocator, block);
 // }
+//
+// An allocator defined with ALLOC_DEFINE_MAPPED keeps its pool in a file
+// mapped by alloc_map() instead of static memory. The free list links blocks
+// by index and the pool index and counters live in a header at the start of
+// the file, so the pool is reattached as it was left after a restart, at
+// whatever address the file is mapped. alloc_set_root() records one block
+// the application finds its data from on the next run. Data stored in the
+// blocks must not hold raw pointers to other blocks; alloc_offset() and
+// alloc_pointer() convert between pointers and stable offsets.
+//
+// ALLOC_DEFINE_MAPPED(myPersistent, 64, 1024)
+//
+// void main()
+// {
+//      BOOL restored;
+//      alloc_init();
+//      alloc_map(myPersistent, "/var/lib/app/pool", &restored);
+//      if (!restored)
+//          alloc_set_root(myPersistent, alloc_calloc(myPersistent, 1, 64));
+//      state = alloc_root(myPersistent);
+//      alloc_unmap(myPersistent);
+// }
 
 #ifndef _FB_ALLOCATOR_H
 #define _FB_ALLOCATOR_H
@@ -35,6 +57,26 @@ typedef struct
     void* p_next;
 } allock_block;
 
+// Header at the start of the file behind a mapped pool. Blocks are numbered
+// from 1 so that 0 ends the free list.
+typedef struct
+{
+    UINT32 magic;
+    UINT32 version;
+    UINT32 block_size;
+    UINT32 blocks_max;
+    UINT32 pool_index;
+    UINT32 head;
+    UINT32 root;
+    UINT32 blocks_in_use;
+    UINT32 max_blocks_in_use;
+    UINT32 allocations;
+    UINT32 deallocations;
+} alloc_map_header_t;
+
+// Offset of the first block of a mapped pool within its file
+#define ALLOC_MAP_POOL_OFFSET   64
+
 // Use ALLOC_DEFINE to declare an alloc_allocator_t object
 typedef struct
 {
@@ -49,6 +91,7 @@ typedef struct
     UINT16 max_blocks_in_use;
     UINT16 allocations;
     UINT16 deallocations;
+    alloc_map_header_t* p_map;
 } alloc_allocator_t;
 
 // Align fixed blocks on X-byte boundary based on CPU architecture.
@@ -76,7 +119,14 @@ typedef struct
 #define ALLOC_DEFINE(_name_, _size_, _objects_) \
     static char _name_##Memory[ALLOC_BLOCK_SIZE(_size_) * (_objects_)] = { 0 }; \
     static alloc_allocator_t _name_##Obj = { #_name_, _name_##Memory, _size_, \
-        ALLOC_BLOCK_SIZE(_size_), _objects_, NULL, 0, 0, 0, 0, 0 }; \
+        ALLOC_BLOCK_SIZE(_size_), _objects_, NULL, 0, 0, 0, 0, 0, NULL }; \
+    static ALLOC_HANDLE _name_ = &_name_##Obj;
+
+// Defines an allocator instance and a handle like ALLOC_DEFINE, with the
+// pool left to be mapped from a file by alloc_map()
+#define ALLOC_DEFINE_MAPPED(_name_, _size_, _objects_) \
+    static alloc_allocator_t _name_##Obj = { #_name_, NULL, _size_, \
+        ALLOC_BLOCK_SIZE(_size_), _objects_, NULL, 0, 0, 0, 0, 0, NULL }; \
     static ALLOC_HANDLE _name_ = &_name_##Obj;
 
 void alloc_init(void);
@@ -85,6 +135,14 @@ void* alloc_alloc(ALLOC_HANDLE hAlloc, size_t size);
 void* alloc_calloc(ALLOC_HANDLE hAlloc, size_t num, size_t size);
 void alloc_free(ALLOC_HANDLE hAlloc, void* pBlock);
 
+BOOL alloc_map(ALLOC_HANDLE hAlloc, const char* path, BOOL* p_restored);
+void alloc_unmap(ALLOC_HANDLE hAlloc);
+void alloc_sync(ALLOC_HANDLE hAlloc);
+void alloc_set_root(ALLOC_HANDLE hAlloc, void* pBlock);
+void* alloc_root(ALLOC_HANDLE hAlloc);
+size_t alloc_offset(ALLOC_HANDLE hAlloc, const void* p);
+void* alloc_pointer(ALLOC_HANDLE hAlloc, size_t offset);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,14 +1,133 @@
+// The lock_guard module is the software lock used by the allocators and
+// the state machine modules.
+//
+// The backend is selected at build time with the machina_LOCK_BACKEND
+// CMake option:
+//
+// pthread - a pthread mutex, adaptive where the C library supports it
+// futex   - a Linux futex lock that spins for a while, adapting the spin
+//           to how long the lock was recently held, before sleeping in the
+//           kernel
+// ticket  - a ticket lock granting the lock in arrival order, for short
+//           critical sections that must not starve a thread. With more
+//           waiting threads than cores the lock is handed to threads that
+//           are not running, so it suits threads pinned to their own cores.
+//
+// Locks are created on the heap with lk_create(), or live inside another
+// object or in static storage as an lk_lock_t set up with lk_init() or
+// LK_LOCK_INITIALIZER, in which case no memory is allocated. Either way the
+// lock is used through its LOCK_HANDLE.
+//
+// Built with LK_PROFILE (the machina_LOCK_PROFILE CMake option) every lock
+// counts its acquisitions, the acquisitions that had to wait, the total
+// time spent waiting and the longest time it was held. Counters are updated
+// by the thread holding the lock, so profiling adds two clock reads to an
+// acquisition and no atomic operations. lk_stats() lists every lock used so
+// far under the name given with lk_name(). Without LK_PROFILE lk_name() does
+// nothing and lk_stats() finds no locks.
+//
+// #include "lock_guard.h"
+//
+// static lk_lock_t lock = LK_LOCK_INITIALIZER;
+//
+// LK_LOCK(&lock);
+// ...
+// LK_UNLOCK(&lock);
+
 #ifndef _LOCK_GUARD_H
 #define _LOCK_GUARD_H
 
 #include "data_types.h"
 
+#if !defined(LK_BACKEND_FUTEX) && !defined(LK_BACKEND_TICKET)
+    #include <pthread.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef void* LOCK_HANDLE;
 
+// Counters of one lock, as listed by lk_stats()
+typedef struct
+{
+    LOCK_HANDLE handle;
+    const CHAR* name;
+    UINT64 acquisitions;
+    UINT64 contended;
+    UINT64 wait_ns;
+    UINT64 max_hold_ns;
+} lk_stats_t;
+
+#ifdef LK_PROFILE
+    typedef struct lk_profile_t
+    {
+        const CHAR* name;
+        UINT64 acquisitions;
+        UINT64 contended;
+        UINT64 wait_ns;
+        UINT64 max_hold_ns;
+        UINT64 hold_start;
+        BOOL registered;
+        struct lk_profile_t* p_next;
+    } lk_profile_t;
+    #define LK_PROFILE_FIELD        lk_profile_t profile;
+    #define LK_PROFILE_INITIALIZER  , { 0 }
+#else
+    #define LK_PROFILE_FIELD
+    #define LK_PROFILE_INITIALIZER
+#endif
+
+#if defined(LK_BACKEND_FUTEX)
+    // 0 unlocked, 1 locked, 2 locked with sleeping waiters
+    typedef struct
+    {
+        UINT32 state;
+        UINT32 spins;
+        LK_PROFILE_FIELD
+    } lk_lock_t;
+    #define LK_LOCK_INITIALIZER     { 0, 0 LK_PROFILE_INITIALIZER }
+#elif defined(LK_BACKEND_TICKET)
+    typedef struct
+    {
+        UINT32 next;
+        UINT32 owner;
+        LK_PROFILE_FIELD
+    } lk_lock_t;
+    #define LK_LOCK_INITIALIZER     { 0, 0 LK_PROFILE_INITIALIZER }
+#else
+    typedef struct
+    {
+        pthread_mutex_t mutex;
+        LK_PROFILE_FIELD
+    } lk_lock_t;
+    #if defined(PTHREAD_ADAPTIVE_MUTEX_INITIALIZER_NP)
+        #define LK_LOCK_INITIALIZER { PTHREAD_ADAPTIVE_MUTEX_INITIALIZER_NP LK_PROFILE_INITIALIZER }
+    #else
+        #define LK_LOCK_INITIALIZER { PTHREAD_MUTEX_INITIALIZER LK_PROFILE_INITIALIZER }
+    #endif
+#endif
+
+// Upper bound of the spin phase of the futex lock
+#ifndef LK_SPIN_MAX
+#define LK_SPIN_MAX     200
+#endif
+
+// Spin rounds of the next ticket lock waiter between yields of the CPU
+#ifndef LK_TICKET_SPINS
+#define LK_TICKET_SPINS 16
+#endif
+
+// Tells the CPU a spin-wait loop is running
+#if defined(__x86_64__) || defined(__i386__)
+    #define LK_CPU_RELAX()  __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+    #define LK_CPU_RELAX()  __asm__ __volatile__("yield" ::: "memory")
+#else
+    #define LK_CPU_RELAX()  do { } while (0)
+#endif
+
 #define LK_CREATE()     lk_create()
 #define LK_DESTROY(h)   lk_destroy(h)
 #define LK_LOCK(h)      lk_lock(h)
@@ -16,11 +135,24 @@ typedef void* LOCK_HANDLE;
 
 LOCK_HANDLE lk_create(void);
 void lk_destroy(LOCK_HANDLE hLock);
+LOCK_HANDLE lk_init(lk_lock_t* p_lock);
+void lk_deinit(LOCK_HANDLE hLock);
 void lk_lock(LOCK_HANDLE hLock);
 void lk_unlock(LOCK_HANDLE hLock);
+void lk_name(LOCK_HANDLE hLock, const CHAR* name);
+UINT32 lk_stats(lk_stats_t* p_stats, UINT32 max);
+void lk_stats_reset(void);
+
+// Private functions
+#ifdef LK_PROFILE
+UINT64 _lk_profile_now(void);
+void _lk_profile_acquired(lk_lock_t* p_lock, BOOL contended, UINT64 wait_start);
+void _lk_profile_released(lk_lock_t* p_lock);
+void _lk_profile_remove(lk_lock_t* p_lock);
+#endif
 
 #ifdef __cplusplus
 }
 #endif
 
-#endif 
+#endif
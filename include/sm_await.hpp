@@ -0,0 +1,142 @@
+// The sm_await header lets C++20 coroutines wait for state machine
+// transitions with co_await instead of blocking a thread on a condition
+// variable.
+//
+// Each awaiter holds an sm_watch_t, so it lives in the coroutine frame and
+// waiting allocates nothing. The coroutine resumes on the thread that sent
+// the event causing the transition, right after that event returns and the
+// instance lock is released. co_await yields the transition that fired.
+//
+// post_and_wait() registers the watch before sending the event, so a
+// transition caused by the event itself is never missed. wait_state()
+// completes at once if the instance is already in the state, read without
+// the lock. wait_transition() always waits for the next matching transition.
+//
+// A coroutine must not be destroyed while suspended on an awaiter whose
+// instance may still fire it from another thread.
+//
+// #include "sm_await.hpp"
+//
+// task run_test(void)
+// {
+//      machina::transition t = co_await machina::post_and_wait(CentrifugeTestSMobj,
+//          cfg_start, nullptr, ST_IDLE);
+//      co_await machina::wait_transition(CentrifugeTestSMobj, ST_IDLE, ST_START_TEST);
+// }
+
+#ifndef _SM_AWAIT_HPP
+#define _SM_AWAIT_HPP
+
+#include <atomic>
+#include <coroutine>
+#include <type_traits>
+#include "sm_watch.h"
+
+namespace machina
+{
+
+// Transition reported to an awaiting coroutine
+struct transition
+{
+    BYTE from;
+    BYTE to;
+};
+
+class transition_awaiter
+{
+public:
+    transition_awaiter(sm_state_machine_t& machine, BYTE from, BYTE to, bool ready_if_current,
+        sm_event_func_t event = nullptr, void* p_event_data = nullptr) noexcept
+        : machine_(machine), event_(event), p_event_data_(p_event_data),
+          ready_if_current_(ready_if_current)
+    {
+        sm_watch_t watch = SM_WATCH_INITIALIZER(from, to, on_fire, this);
+        watch_ = watch;
+    }
+
+    transition_awaiter(const transition_awaiter&) = delete;
+    transition_awaiter& operator=(const transition_awaiter&) = delete;
+
+    ~transition_awaiter()
+    {
+        // Destroyed while suspended, take the watch back
+        if (registered_ && !fired_)
+            _sm_watch_cancel(&machine_, &watch_);
+    }
+
+    bool await_ready() noexcept
+    {
+        if (!ready_if_current_ || machine_.current_state != watch_.to)
+            return false;
+
+        watch_.fired_from = watch_.to;
+        watch_.fired_to = watch_.to;
+        return true;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) noexcept
+    {
+        handle_ = handle;
+        registered_ = true;
+        _sm_watch(&machine_, &watch_);
+
+        if (event_)
+            event_(&machine_, p_event_data_);
+
+        // The later of this function and the watch callback resumes the
+        // coroutine; a watch fired by the event above skips the suspension
+        return !done_.exchange(true, std::memory_order_acq_rel);
+    }
+
+    transition await_resume() const noexcept
+    {
+        return { watch_.fired_from, watch_.fired_to };
+    }
+
+private:
+    static void on_fire(sm_watch_t* watch, BYTE, BYTE)
+    {
+        transition_awaiter* self = static_cast<transition_awaiter*>(watch->p_context);
+
+        // The awaiter may be gone once done_ is set and the coroutine runs on
+        self->fired_ = true;
+        if (self->done_.exchange(true, std::memory_order_acq_rel))
+            self->handle_.resume();
+    }
+
+    sm_state_machine_t& machine_;
+    sm_watch_t watch_;
+    sm_event_func_t event_;
+    void* p_event_data_;
+    std::coroutine_handle<> handle_;
+    std::atomic<bool> done_{ false };
+    bool fired_ = false;
+    bool registered_ = false;
+    bool ready_if_current_;
+};
+
+// Waits until the instance is in the given state
+inline transition_awaiter wait_state(sm_state_machine_t& machine, BYTE state) noexcept
+{
+    return transition_awaiter(machine, SM_WATCH_ANY, state, true);
+}
+
+// Waits for the next transition from one state to another, either of which
+// may be SM_WATCH_ANY
+inline transition_awaiter wait_transition(sm_state_machine_t& machine, BYTE from, BYTE to) noexcept
+{
+    return transition_awaiter(machine, from, to, false);
+}
+
+// Sends an event, then waits for the next transition into the given state
+template <class Data>
+inline transition_awaiter post_and_wait(sm_state_machine_t& machine,
+    void (*event)(sm_state_machine_t*, Data*), std::type_identity_t<Data>* p_event_data, BYTE state) noexcept
+{
+    return transition_awaiter(machine, SM_WATCH_ANY, state, false,
+        reinterpret_cast<sm_event_func_t>(event), p_event_data);
+}
+
+} // namespace machina
+
+#endif // _SM_AWAIT_HPP
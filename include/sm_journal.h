@@ -0,0 +1,146 @@
+// The sm_journal module keeps an append-only log of external events so the
+// state of instances can be recovered after a crash.
+//
+// sm_journal_event() appends a record holding the instance id, the event
+// id and the event data bytes to the log, then dispatches the event under
+// the journal lock, so instances see events in log order. An event whose
+// record could not be appended is not dispatched; sm_journal_event()
+// returns FALSE and the caller keeps ownership of the event data. The
+// log is a series of fixed size segment files mapped into memory; a new
+// segment is started when the current one is full. Appending copies into
+// the mapping; records reach the disk on a group commit, one msync for all
+// records appended since the last one, every group_size records or on
+// sm_journal_sync().
+//
+// Instances and events are identified by small ids handed out in
+// registration order, so a process must register the same instances and
+// events in the same order before replaying. Events are registered by their
+// sm_event_desc_t, see sm_queue.h.
+//
+// sm_journal_replay() feeds the records after a given sequence number back
+// through the dispatch path. Consecutive records of one instance run as one
+// burst, like sm_event_batch(), with event data frees batched and tracing
+// paused. It returns the number of records applied, and stops early if
+// sm_xalloc() cannot copy a record's event data. Saving the sequence number
+// with every snapshot and trimming the segments before it keeps recovery
+// proportional to the log tail.
+//
+// #include "sm_journal.h"
+//
+// static sm_journal_t journal;
+//
+// sm_journal_open(&journal, "/var/lib/motors/events", 16 << 20, 64);
+// sm_journal_register(&journal, Motor1SM);
+// sm_journal_register_event(&journal, mtr_set_speed);
+// sm_journal_replay(&journal, snapshot_sequence);
+//
+// motor_data_t* data = sm_xalloc(sizeof(motor_data_t));
+// data->speed = 100;
+// sm_journal_event(&journal, Motor1SM, mtr_set_speed, data, sizeof(motor_data_t));
+
+#ifndef _SM_JOURNAL_H
+#define _SM_JOURNAL_H
+
+#include <stddef.h>
+#include "data_types.h"
+#include "state_machine.h"
+#include "sm_queue.h"
+#include "lock_guard.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Registration table sizes
+#ifndef SM_JOURNAL_MACHINES_MAX
+#define SM_JOURNAL_MACHINES_MAX     1024
+#endif
+#ifndef SM_JOURNAL_EVENTS_MAX
+#define SM_JOURNAL_EVENTS_MAX       256
+#endif
+
+#define SM_JOURNAL_PATH_MAX         256
+
+// Returned by registration when a table is full
+#define SM_JOURNAL_INVALID_ID       0xFFFF
+
+// Number of records of one instance replayed as one burst
+#define SM_JOURNAL_REPLAY_BURST     64
+
+#define SM_JOURNAL_MAGIC            0x4C4A4D53  // "SMJL"
+#define SM_JOURNAL_VERSION          1
+
+// Start of every segment file
+typedef struct
+{
+    UINT32 magic;
+    UINT32 version;
+    UINT64 first_sequence;
+} sm_journal_segment_t;
+
+// Followed by length bytes of event data, padded to 8 bytes. A record with
+// a zero sequence ends the segment.
+typedef struct
+{
+    UINT32 length;
+    UINT32 checksum;
+    UINT64 sequence;
+    UINT16 machine;
+    UINT16 event;
+    UINT32 reserved;
+} sm_journal_record_t;
+
+typedef struct
+{
+    char path[SM_JOURNAL_PATH_MAX];
+    size_t segment_size;
+    UINT32 group_size;
+    LOCK_HANDLE lock;
+
+    // Segment being appended to
+    UINT32 first_segment;
+    UINT32 segment;
+    BYTE* p_segment;
+    size_t mapped_size;
+    size_t offset;
+    size_t synced_offset;
+
+    UINT64 sequence;
+    UINT64 synced_sequence;
+    UINT32 pending;
+
+    // Registered instances and events, looked up by pointer through the
+    // open addressed slots holding id + 1
+    sm_state_machine_t* machines[SM_JOURNAL_MACHINES_MAX];
+    UINT32 machine_count;
+    UINT16 machine_slots[SM_JOURNAL_MACHINES_MAX * 2];
+    const sm_event_desc_t* events[SM_JOURNAL_EVENTS_MAX];
+    UINT32 event_count;
+    UINT16 event_slots[SM_JOURNAL_EVENTS_MAX * 2];
+} sm_journal_t;
+
+// Public functions
+#define sm_journal_register(_journal_, _sm_name_) \
+    _sm_journal_register(_journal_, &_sm_name_##obj)
+#define sm_journal_register_event(_journal_, _event_func_) \
+    _sm_journal_register_event(_journal_, &_event_func_##_desc)
+#define sm_journal_event(_journal_, _sm_name_, _event_func_, _event_data_, _size_) \
+    _sm_journal_event(_journal_, &_sm_name_##obj, &_event_func_##_desc, _event_data_, _size_)
+
+BOOL sm_journal_open(sm_journal_t* journal, const char* path, size_t segment_size, UINT32 group_size);
+void sm_journal_close(sm_journal_t* journal);
+UINT64 sm_journal_sync(sm_journal_t* journal);
+UINT64 sm_journal_sequence(sm_journal_t* journal);
+UINT64 sm_journal_replay(sm_journal_t* journal, UINT64 after_sequence);
+UINT32 sm_journal_trim(sm_journal_t* journal, UINT64 sequence);
+
+// Private functions
+UINT16 _sm_journal_register(sm_journal_t* journal, sm_state_machine_t* self);
+UINT16 _sm_journal_register_event(sm_journal_t* journal, const sm_event_desc_t* desc);
+BOOL _sm_journal_event(sm_journal_t* journal, sm_state_machine_t* self, const sm_event_desc_t* desc, void* p_event_data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SM_JOURNAL_H
@@ -0,0 +1,196 @@
+// The sm_machine header is a C++ layer over the C state machine and
+// allocator APIs. It adds no state to the C structures, so C and C++ code
+// can share instances.
+//
+// event_ptr<T> owns a T constructed in place in a block from sm_xalloc().
+// Sending it releases the block to the engine, which frees it as usual, so
+// the payload is neither copied nor allocated twice. The engine frees
+// blocks without running destructors, so T must be trivially destructible.
+//
+// machine_ref<Instance> wraps an existing instance, such as one defined by
+// SM_DEFINE. machine<Instance> owns its sm_state_machine_t, creates the
+// instance lock on request and releases lock, state timers and deferred
+// events on destruction. Events are the C event functions; the transition
+// maps inside them select the state map, so any instance of the machine
+// type accepts them. Payload types are checked against the event function.
+//
+// #include "sm_machine.hpp"
+//
+// machina::machine<Motor> motor("Motor3", motorObj3, true);
+// motor.send(MTR_SetSpeed, MotorData{ 100 });
+// motor.send(MTR_Halt);
+//
+// machina::event_ptr<MotorData> data = machina::make_event<MotorData>(200);
+// data->speed += 50;
+// motor.send(MTR_SetSpeed, std::move(data));
+
+#ifndef _SM_MACHINE_HPP
+#define _SM_MACHINE_HPP
+
+#include <array>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "state_machine.h"
+#include "sm_timer.h"
+#include "fault.h"
+
+namespace machina
+{
+
+// Unique owner of event data in an sm_xalloc() block
+template <class T>
+class event_ptr
+{
+    static_assert(std::is_trivially_destructible_v<T>,
+        "the engine frees event data without running destructors");
+    static_assert(alignof(T) <= alignof(void*),
+        "sm_xalloc() blocks are aligned for pointers only");
+
+public:
+    event_ptr() noexcept = default;
+    explicit event_ptr(T* p) noexcept : p_(p) {}
+
+    event_ptr(event_ptr&& other) noexcept : p_(other.release()) {}
+    event_ptr& operator=(event_ptr&& other) noexcept
+    {
+        reset(other.release());
+        return *this;
+    }
+
+    event_ptr(const event_ptr&) = delete;
+    event_ptr& operator=(const event_ptr&) = delete;
+
+    ~event_ptr() { reset(); }
+
+    T* get() const noexcept { return p_; }
+    T& operator*() const noexcept { return *p_; }
+    T* operator->() const noexcept { return p_; }
+    explicit operator bool() const noexcept { return p_ != nullptr; }
+
+    // Gives up ownership, typically to the engine
+    T* release() noexcept
+    {
+        T* p = p_;
+        p_ = nullptr;
+        return p;
+    }
+
+    void reset(T* p = nullptr) noexcept
+    {
+        if (p_)
+            sm_xfree(p_);
+        p_ = p;
+    }
+
+private:
+    T* p_ = nullptr;
+};
+
+// Constructs event data in place in an sm_xalloc() block. Returns an empty
+// event_ptr when the allocator is out of blocks.
+template <class T, class... Args>
+event_ptr<T> make_event(Args&&... args)
+{
+    void* p = sm_xalloc(sizeof(T));
+    if (!p)
+    {
+        ASSERT();
+        return event_ptr<T>();
+    }
+    return event_ptr<T>(::new (p) T{ std::forward<Args>(args)... });
+}
+
+// Event function taking Data as event data
+template <class Data>
+using event_func = void (*)(sm_state_machine_t*, Data*);
+
+// Typed access to an instance defined elsewhere
+template <class Instance>
+class machine_ref
+{
+public:
+    explicit machine_ref(sm_state_machine_t& obj) noexcept : p_obj_(&obj) {}
+
+    sm_state_machine_t* get() const noexcept { return p_obj_; }
+    const CHAR* name() const noexcept { return p_obj_->name; }
+    BYTE current_state() const noexcept { return p_obj_->current_state; }
+    Instance& instance() const noexcept { return *static_cast<Instance*>(p_obj_->p_instance); }
+
+    // Sends an event without event data
+    void send(event_func<no_event_data_t> event) const
+    {
+        event(p_obj_, nullptr);
+    }
+
+    // Sends event data owned by the caller, handing it to the engine
+    template <class Data>
+    void send(event_func<Data> event, event_ptr<std::type_identity_t<Data>> data) const
+    {
+        event(p_obj_, data.release());
+    }
+
+    // Moves a payload into an sm_xalloc() block and sends it. The event is
+    // dropped when no block is left, rather than sent without its data.
+    template <class Data>
+    void send(event_func<Data> event, std::type_identity_t<Data>&& value) const
+    {
+        event_ptr<Data> data = make_event<Data>(std::move(value));
+        if (data)
+            send(event, std::move(data));
+    }
+
+    // Sends a burst under one lock acquisition and one engine run
+    void send_batch(const sm_batch_event_t* events, UINT count) const
+    {
+        _sm_event_batch(p_obj_, events, count);
+    }
+
+protected:
+    sm_state_machine_t* p_obj_;
+};
+
+// Instance owned by the C++ object. Set Hierarchical for instances of a
+// machine defined with END_STATE_MAP_HSM, which keep state history.
+template <class Instance, bool Hierarchical = false>
+class machine : public machine_ref<Instance>
+{
+public:
+    machine(const CHAR* name, Instance& instance, bool locked = false)
+        : machine_ref<Instance>(obj_)
+    {
+        std::memset(&obj_, 0, sizeof(obj_));
+        obj_.name = name;
+        obj_.p_instance = &instance;
+        if constexpr (Hierarchical)
+            obj_.p_history = history_.data();
+        if (locked)
+            _sm_lock_create(&obj_);
+    }
+
+    machine(const machine&) = delete;
+    machine& operator=(const machine&) = delete;
+
+    ~machine()
+    {
+        if (obj_.p_state_timers)
+            _sm_timer_cancel_state(&obj_);
+        while (obj_.deferred_count)
+        {
+            void* p_event_data = obj_.deferred[--obj_.deferred_count].p_event_data;
+            if (p_event_data)
+                sm_xfree(p_event_data);
+        }
+        if (obj_.lock)
+            _sm_lock_destroy(&obj_);
+    }
+
+private:
+    sm_state_machine_t obj_;
+    std::array<BYTE, Hierarchical ? SM_HSM_STATES_MAX : 0> history_{};
+};
+
+} // namespace machina
+
+#endif // _SM_MACHINE_HPP
@@ -0,0 +1,92 @@
+// The sm_metrics module measures the time spent in state machine functions
+// and keeps it in log-bucketed latency histograms per state machine type.
+//
+// Metrics are compiled in with SM_METRICS (the machina_METRICS CMake
+// option). Without it the hooks in the state engine expand to nothing.
+// Every state of a type has one histogram for each of its state action,
+// guard, entry and exit functions, and one for the end-to-end latency of
+// external events whose transition leads to it. The event latency runs
+// from the event function call to its return, lock wait included; events
+// raised within a burst are not measured on their own.
+//
+// Histograms use 8 buckets per power of two from 1 ns up to 2^40 ns,
+// giving values within 12.5%. They are allocated on the first recording
+// of a type and updated with relaxed atomic adds, so any thread can record
+// without locks. sm_metrics_export() renders every type recorded so far as
+// JSON or as Prometheus text exposition summaries.
+//
+// #include "sm_metrics.h"
+//
+// char buffer[65536];
+// size_t len = sm_metrics_export(buffer, sizeof(buffer), SM_METRICS_PROMETHEUS);
+// if (len < sizeof(buffer))
+//      send_response(buffer, len);
+
+#ifndef _SM_METRICS_H
+#define _SM_METRICS_H
+
+#include <stddef.h>
+#include "data_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Histogram kinds kept per state
+enum { SM_METRICS_ACTION = 0, SM_METRICS_GUARD, SM_METRICS_ENTRY, SM_METRICS_EXIT, SM_METRICS_EVENT, SM_METRICS_KINDS };
+
+// Export formats
+enum { SM_METRICS_JSON = 0, SM_METRICS_PROMETHEUS = 1 };
+
+// Linear buckets below 8 ns, then 8 buckets per power of two up to 2^40 ns
+#define SM_METRICS_SUB_BUCKETS  8
+#define SM_METRICS_BUCKETS      304
+
+// A latency histogram. count is only set on copies made by
+// sm_metrics_histogram(), recording updates the buckets alone.
+typedef struct
+{
+    UINT64 count;
+    UINT64 sum_ns;
+    UINT64 max_ns;
+    UINT64 buckets[SM_METRICS_BUCKETS];
+} sm_histogram_t;
+
+// Metrics of one state machine type, defined by END_STATE_MAP
+typedef struct sm_metrics_type_t
+{
+    const CHAR* name;
+    BYTE states_max;
+    sm_histogram_t* p_histograms;
+    struct sm_metrics_type_t* p_next;
+} sm_metrics_type_t;
+
+#ifdef SM_METRICS
+    #define SM_METRICS_TYPE_DEFINE(_sm_name_, _states_max_) \
+        static sm_metrics_type_t _sm_name_##metrics = { #_sm_name_, _states_max_, NULL, NULL };
+    #define SM_METRICS_TYPE(_sm_name_)  (&_sm_name_##metrics)
+    #define SM_METRICS_START(_start_) \
+        UINT64 _start_ = _sm_metrics_now()
+    #define SM_METRICS_RECORD(_type_, _kind_, _state_, _start_) \
+        _sm_metrics_record(_type_, _kind_, _state_, _sm_metrics_now() - (_start_))
+#else
+    #define SM_METRICS_TYPE_DEFINE(_sm_name_, _states_max_)
+    #define SM_METRICS_TYPE(_sm_name_)  NULL
+    #define SM_METRICS_START(_start_)
+    #define SM_METRICS_RECORD(_type_, _kind_, _state_, _start_)
+#endif
+
+// Public functions
+size_t sm_metrics_export(char* buffer, size_t size, BYTE format);
+BOOL sm_metrics_histogram(const sm_metrics_type_t* type, BYTE kind, BYTE state, sm_histogram_t* p_histogram);
+UINT64 sm_metrics_percentile(const sm_histogram_t* histogram, double percentile);
+
+// Private functions
+UINT64 _sm_metrics_now(void);
+void _sm_metrics_record(sm_metrics_type_t* type, BYTE kind, BYTE state, UINT64 elapsed_ns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SM_METRICS_H
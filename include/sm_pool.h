@@ -0,0 +1,120 @@
+// The sm_pool module stores many instances of one state machine type as
+// parallel arrays instead of one sm_state_machine_t per instance.
+//
+// A pool keeps the current state of every instance in a dense byte array
+// and the instance data in a parallel array of fixed size slots. Instances
+// are created and destroyed by handle, and events are dispatched by handle
+// through the regular event functions. The per-instance overhead is the
+// state byte; free slots keep their free-list link inside the unused
+// instance data, the same way fb_allocator does.
+//
+// sm_pool_event_bulk() applies one event to many instances at once. The
+// next state of every instance is looked up from the event's transition
+// map in one pass over the state array, 16 instances per instruction on
+// x86 CPUs with SSSE3 when the machine has at most 16 states. Instances are
+// then grouped by next state and the state actions run group by group.
+// Instances whose transition is EVENT_IGNORED are skipped without touching
+// their instance data. Bulk events are defined with BEGIN_EVENT_MAP, so
+// their transition maps are known without calling the event function.
+//
+// Dispatch runs the event function on a short-lived sm_state_machine_t
+// built on the stack, so pool instances cannot use per-state timers, event
+// queues or locks, and events they defer are dropped like ignored events.
+// The pool itself is not thread-safe.
+//
+// #include "sm_pool.h"
+// SM_POOL_DEFINE(motorPool, Motor, 2000000)
+//
+// void main()
+// {
+//      sm_handle_t motor = sm_pool_create(motorPool);
+//      sm_pool_event(motorPool, motor, mtr_set_speed, data);
+//      sm_pool_broadcast(motorPool, mtr_halt);
+//      printf("%u stopped\n", sm_pool_count_in_state(motorPool, ST_IDLE));
+//      sm_pool_destroy(motorPool, motor);
+// }
+
+#ifndef _SM_POOL_H
+#define _SM_POOL_H
+
+#include <stddef.h>
+#include "data_types.h"
+#include "state_machine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef UINT32 sm_handle_t;
+
+#define SM_INVALID_HANDLE   ((sm_handle_t)0xFFFFFFFF)
+
+// State byte of a slot that holds no instance
+#define SM_POOL_SLOT_FREE   CANNOT_HAPPEN
+
+// Instance slots are large enough to hold the free-list link
+#define SM_POOL_SLOT_SIZE(_size_) \
+    (((_size_) > sizeof(UINT32)) ? (_size_) : sizeof(UINT32))
+
+// Number of instances translated and grouped per pass of a bulk event
+#define SM_POOL_BULK_CHUNK  256
+
+// Use SM_POOL_DEFINE to declare an sm_pool_t object
+typedef struct
+{
+    const CHAR* name;
+    BYTE* const p_states;
+    char* const p_instances;
+    const size_t slot_size;
+    const UINT32 capacity;
+    UINT32 free_head;
+    UINT32 pool_index;
+    UINT32 in_use;
+} sm_pool_t;
+
+// Defines the pool arrays, the sm_pool_t instance and a pointer to it. On
+// the example below, the sm_pool_t instance is motorPoolObj and the pointer
+// is motorPool.
+// _name_ - the pool name
+// _instance_ - instance data type of every machine in the pool
+// _capacity_ - maximum number of instances
+#define SM_POOL_DEFINE(_name_, _instance_, _capacity_) \
+    static BYTE _name_##States[_capacity_]; \
+    static char _name_##Instances[SM_POOL_SLOT_SIZE(sizeof(_instance_)) * (_capacity_)]; \
+    static sm_pool_t _name_##Obj = { #_name_, _name_##States, _name_##Instances, \
+        SM_POOL_SLOT_SIZE(sizeof(_instance_)), _capacity_, SM_INVALID_HANDLE, 0, 0 }; \
+    static sm_pool_t* const _name_ = &_name_##Obj;
+
+// Public functions
+#define sm_pool_event(_pool_, _handle_, _event_func_, _event_data_) \
+    _sm_pool_event(_pool_, _handle_, (sm_event_func_t)_event_func_, _event_data_)
+// Applies an event to count distinct instances, or to every instance when
+// _handles_ is NULL. _event_data_ holds one event data per handle, or is 
+// NULL. Returns the number of instances that transitioned.
+#define sm_pool_event_bulk(_pool_, _handles_, _count_, _event_func_, _event_data_) \
+    _sm_pool_event_bulk(_pool_, _handles_, _count_, &_event_func_##_map, _event_data_)
+#define sm_pool_broadcast(_pool_, _event_func_) \
+    _sm_pool_event_bulk(_pool_, NULL, 0, &_event_func_##_map, NULL)
+#define sm_pool_state(_pool_, _handle_) \
+    ((_pool_)->p_states[_handle_])
+#define sm_pool_instance(_pool_, _handle_) \
+    ((void*)((_pool_)->p_instances + (size_t)(_handle_) * (_pool_)->slot_size))
+
+// Protected functions
+#define sm_pool_handle(_pool_) \
+    ((sm_handle_t)(((char*)self->p_instance - (_pool_)->p_instances) / (_pool_)->slot_size))
+
+sm_handle_t sm_pool_create(sm_pool_t* self);
+void sm_pool_destroy(sm_pool_t* self, sm_handle_t handle);
+UINT32 sm_pool_count_in_state(const sm_pool_t* self, BYTE state);
+
+// Private functions
+void _sm_pool_event(sm_pool_t* self, sm_handle_t handle, sm_event_func_t event_func, void* p_event_data);
+UINT32 _sm_pool_event_bulk(sm_pool_t* self, const sm_handle_t* handles, UINT32 count, const sm_event_map_t* map, void* const* p_event_data);
+void _sm_pool_bind(const sm_pool_t* self, sm_handle_t handle, sm_state_machine_t* machine);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SM_POOL_H
@@ -0,0 +1,147 @@
+// The sm_queue module adds queued event delivery to a state machine instance.
+//
+// sm_post() stores an event in a fixed-capacity ring owned by the instance
+// and returns without running the state engine. sm_dispatch() later drains
+// the ring in a single engine run under the instance lock, the same way
+// sm_event_batch() does.
+//
+// Queued events are identified by an event descriptor declared next to the
+// event function. Events declared with SM_EVENT_COALESCE keep at most one
+// pending entry per instance: posting again while an entry is pending
+// replaces its event data, or merges both payloads with the merge function
+// given in the descriptor.
+//
+// The queue has SM_QUEUE_LEVELS priority levels, each a ring of the depth
+// given to SM_DEFINE_QUEUED. A descriptor selects its level with 
+// SM_EVENT_PRIORITY(). The engine always pulls from the highest non-empty
+// level, found in O(1) from a bitmap, so a halt or fault event waits for
+// at most the internal event chain currently running.
+//
+// #include "sm_queue.h"
+//
+// // motor.h
+// EVENT_DECLARE(mtr_poll, no_event_data_t)
+// EVENT_DESC_DECLARE(mtr_poll)
+//
+// // motor.c
+// EVENT_DESC_DEFINE(mtr_poll, SM_EVENT_COALESCE, NULL)
+// EVENT_DESC_DEFINE(mtr_halt, SM_EVENT_PRIORITY(SM_PRIORITY_CRITICAL), NULL)
+// SM_DEFINE_QUEUED(Motor1SM, &motorObj1, 64)
+//
+// sm_post(Motor1SM, mtr_poll, NULL);
+// sm_post(Motor1SM, mtr_poll, NULL);      // coalesced with the first
+// sm_dispatch(Motor1SM);                  // runs mtr_poll once
+
+#ifndef _SM_QUEUE_H
+#define _SM_QUEUE_H
+
+#include "data_types.h"
+#include "state_machine.h"
+#include "lock_guard.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Event descriptor flags
+#define SM_EVENT_COALESCE       0x01
+
+// Number of priority levels and the level encoded in descriptor flags
+#define SM_QUEUE_LEVELS         4
+#define SM_EVENT_PRIORITY(_level_) \
+    (((_level_) & 0x03) << 4)
+#define SM_EVENT_PRIORITY_OF(_flags_) \
+    (((_flags_) >> 4) & 0x03)
+
+enum { SM_PRIORITY_NORMAL = 0, SM_PRIORITY_HIGH = 1, SM_PRIORITY_URGENT = 2, SM_PRIORITY_CRITICAL = 3 };
+
+// Number of pending coalescable events tracked for a direct lookup. Any
+// more are found by scanning their priority level.
+#define SM_QUEUE_COALESCE_MAX   8
+
+// Merges the payload of a new event into a pending one. Returns the event
+// data to keep; the queue frees the other one.
+typedef void* (*sm_merge_func_t)(void* p_pending_data, void* p_event_data);
+
+// Event descriptor, defined once per event function
+typedef struct
+{
+    const CHAR* name;
+    sm_event_func_t p_event_func;
+    BYTE flags;
+    sm_merge_func_t p_merge_func;
+} sm_event_desc_t;
+
+typedef struct
+{
+    const sm_event_desc_t* p_desc;
+    void* p_event_data;
+} sm_queue_entry_t;
+
+// One priority level of an event queue
+typedef struct
+{
+    UINT32 head;
+    UINT32 count;
+
+    // Usage statistics
+    UINT32 posted;
+    UINT32 coalesced;
+    UINT32 dropped;
+    UINT32 max_count;
+} sm_queue_level_t;
+
+// Use SM_DEFINE_QUEUED to declare a queued state machine instance
+typedef struct sm_event_queue_t
+{
+    // SM_QUEUE_LEVELS rings of capacity entries each
+    sm_queue_entry_t* p_entries;
+    UINT32 capacity;
+
+    // Bit N set while level N holds events
+    UINT32 ready;
+    LOCK_HANDLE lock;
+
+    // Entry index of the pending entry of each coalescable event, and the
+    // number of pending coalescable entries left out for lack of room
+    const sm_event_desc_t* coalesce_desc[SM_QUEUE_COALESCE_MAX];
+    UINT32 coalesce_slot[SM_QUEUE_COALESCE_MAX];
+    UINT32 coalesce_untracked;
+
+    sm_queue_level_t levels[SM_QUEUE_LEVELS];
+} sm_event_queue_t;
+
+#define EVENT_DESC_DECLARE(_event_func_) \
+    extern const sm_event_desc_t _event_func_##_desc;
+
+#define EVENT_DESC_DEFINE(_event_func_, _flags_, _merge_func_) \
+    const sm_event_desc_t _event_func_##_desc = { #_event_func_, \
+        (sm_event_func_t)_event_func_, _flags_, (sm_merge_func_t)_merge_func_ };
+
+// Defines a state machine instance with an event queue of _depth_ entries
+// per priority level
+#define SM_DEFINE_QUEUED(_sm_name_, _instance_, _depth_) \
+    static sm_queue_entry_t _sm_name_##queue_entries[SM_QUEUE_LEVELS * (_depth_)]; \
+    static sm_event_queue_t _sm_name_##queue = { _sm_name_##queue_entries, _depth_, \
+        0, NULL, { NULL }, { 0 }, 0, { { 0, 0, 0, 0, 0, 0 } } }; \
+    sm_state_machine_t _sm_name_##obj = SM_INSTANCE_INITIALIZER(#_sm_name_, _instance_, &_sm_name_##queue, NULL);
+
+// Public functions
+#define sm_post(_sm_name_, _event_func_, _event_data_) \
+    _sm_post(&_sm_name_##obj, &_event_func_##_desc, _event_data_)
+#define sm_dispatch(_sm_name_) \
+    _sm_dispatch(&_sm_name_##obj)
+#define sm_queue_stats(_sm_name_, _level_, _p_stats_) \
+    _sm_queue_stats(&_sm_name_##obj, _level_, _p_stats_)
+
+// Private functions
+BOOL _sm_post(sm_state_machine_t* self, const sm_event_desc_t* desc, void* p_event_data);
+UINT _sm_dispatch(sm_state_machine_t* self);
+BOOL _sm_queue_pop(sm_event_queue_t* queue, sm_batch_event_t* event);
+void _sm_queue_stats(sm_state_machine_t* self, UINT level, sm_queue_level_t* p_stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SM_QUEUE_H
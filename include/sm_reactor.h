@@ -0,0 +1,84 @@
+// The sm_reactor module is an epoll based event loop that drives state
+// machine instances from a single thread.
+//
+// File descriptors (sockets, timerfd, eventfd, ...) are registered with an
+// sm_reactor_fd_t owned by the caller. When a descriptor becomes ready the
+// loop calls the registered event function with a sm_reactor_fd_data_t
+// allocated by sm_xalloc(), so the state engine frees it as usual. While
+// sm_xalloc() has no block left, ready descriptors are skipped; a level
+// triggered descriptor is reported again by the next wait.
+//
+// Other threads must not call sm_event() on machines owned by a reactor.
+// They call sm_reactor_post() instead, which queues the event in a bounded
+// ring and wakes the loop through an eventfd. Posted events are drained in
+// bursts after each epoll_wait(), so a busy loop pays one wakeup for many
+// events.
+//
+// An optional sm_timer_wheel_t can be attached. The loop then sleeps until
+// the next timer expires and advances the wheel from CLOCK_MONOTONIC.
+//
+// #include "sm_reactor.h"
+// static sm_reactor_fd_t sock_reg;
+//
+// void main()
+// {
+//      REACTOR_HANDLE reactor = sm_reactor_create(256);
+//      sm_reactor_add_fd(reactor, &sock_reg, sock, EPOLLIN, &MySMobj,
+//          (sm_event_func_t)my_readable_event);
+//      sm_reactor_run(reactor);
+//      sm_reactor_destroy(reactor);
+// }
+
+#ifndef _SM_REACTOR_H
+#define _SM_REACTOR_H
+
+#include "data_types.h"
+#include "state_machine.h"
+#include "sm_timer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void* REACTOR_HANDLE;
+
+// Maximum number of readiness notifications or posted events handled per burst
+#define SM_REACTOR_BURST_MAX    64
+
+// Event data passed to the event function of a ready descriptor
+typedef struct
+{
+    INT fd;
+    UINT32 events;
+} sm_reactor_fd_data_t;
+
+// Descriptor registration, owned by the caller while registered
+typedef struct
+{
+    INT fd;
+    sm_state_machine_t* p_machine;
+    sm_event_func_t p_event_func;
+} sm_reactor_fd_t;
+
+REACTOR_HANDLE sm_reactor_create(UINT32 post_capacity);
+void sm_reactor_destroy(REACTOR_HANDLE hReactor);
+
+BOOL sm_reactor_add_fd(REACTOR_HANDLE hReactor, sm_reactor_fd_t* reg, INT fd, UINT32 events,
+    sm_state_machine_t* machine, sm_event_func_t event_func);
+BOOL sm_reactor_modify_fd(REACTOR_HANDLE hReactor, sm_reactor_fd_t* reg, UINT32 events);
+BOOL sm_reactor_remove_fd(REACTOR_HANDLE hReactor, sm_reactor_fd_t* reg);
+
+void sm_reactor_set_timer_wheel(REACTOR_HANDLE hReactor, sm_timer_wheel_t* wheel, UINT32 tick_ms);
+
+BOOL sm_reactor_post(REACTOR_HANDLE hReactor, sm_state_machine_t* machine,
+    sm_event_func_t event_func, void* p_event_data);
+
+INT sm_reactor_run_once(REACTOR_HANDLE hReactor, INT timeout_ms);
+void sm_reactor_run(REACTOR_HANDLE hReactor);
+void sm_reactor_stop(REACTOR_HANDLE hReactor);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SM_REACTOR_H
@@ -0,0 +1,124 @@
+// The sm_regions module runs several state machines as orthogonal regions
+// of one controller.
+//
+// Each region is a regular instance defined with SM_DEFINE, usually sharing
+// its instance data with the other regions, and keeps its own current
+// state. A region event names the event function each region handles it
+// with. sm_regions_event() dispatches it to every region under the one lock
+// of the set, one region after the other, and all regions see the same
+// event data, which is freed once they are done. A region whose current
+// state defers the event parks its own copy of the event data, so
+// sm_regions_event() takes the size of the data.
+//
+// Region event functions are defined with BEGIN_EVENT_MAP. The regions
+// whose transition maps ignore the event in every state are left out of a
+// mask built on the first dispatch of the event, so they cost nothing. The
+// other regions are dispatched straight from their transition maps.
+//
+// Region instances are dispatched through the set. They must not have locks
+// of their own; use sm_regions_lock_create() instead.
+//
+// #include "sm_regions.h"
+//
+// enum { RG_MOTION, RG_THERMAL, RG_COMMS };
+//
+// SM_DEFINE(Motion, &ctrlObj)
+// SM_DEFINE(Thermal, &ctrlObj)
+// SM_DEFINE(Comms, &ctrlObj)
+// SM_REGIONS_DEFINE(Controller, SM_REGION(Motion), SM_REGION(Thermal), SM_REGION(Comms))
+//
+// BEGIN_REGION_EVENT(ctl_halt)
+//     REGION_EVENT_ENTRY(RG_MOTION, mtn_halt)
+//     REGION_EVENT_ENTRY(RG_THERMAL, thm_halt)
+// END_REGION_EVENT(ctl_halt)
+//
+// sm_regions_lock_create(Controller);
+// sm_regions_event(Controller, ctl_halt, NULL, 0);
+
+#ifndef _SM_REGIONS_H
+#define _SM_REGIONS_H
+
+#include <stddef.h>
+#include "data_types.h"
+#include "state_machine.h"
+#include "lock_guard.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Maximum number of regions in a set, one bit each in the region masks
+#define SM_REGIONS_MAX      32
+
+// Use SM_REGIONS_DEFINE to declare a set of regions
+typedef struct
+{
+    const CHAR* name;
+    sm_state_machine_t* const* p_regions;
+    UINT32 count;
+    LOCK_HANDLE lock;
+} sm_regions_t;
+
+// How one region handles a region event
+typedef struct
+{
+    UINT32 region;
+    const sm_event_map_t* p_map;
+} sm_region_handler_t;
+
+// Use BEGIN_REGION_EVENT to declare a region event
+typedef struct
+{
+    const CHAR* name;
+    const sm_region_handler_t* p_handlers;
+    UINT32 count;
+    UINT32 mask;
+    BOOL ready;
+} sm_region_event_t;
+
+#define SM_REGION(_sm_name_)    (&_sm_name_##obj)
+
+// Defines the region list and the sm_regions_t instance. Regions are
+// numbered in the order listed.
+#define SM_REGIONS_DEFINE(_name_, ...) \
+    static sm_state_machine_t* const _name_##region_list[] = { __VA_ARGS__ }; \
+    sm_regions_t _name_##obj = { #_name_, _name_##region_list, \
+        (sizeof(_name_##region_list)/sizeof(_name_##region_list[0])), NULL };
+
+#define SM_REGIONS_DECLARE(_name_) \
+    extern sm_regions_t _name_##obj;
+
+#define BEGIN_REGION_EVENT(_event_name_) \
+    static const sm_region_handler_t _event_name_##handlers[] = {
+
+#define REGION_EVENT_ENTRY(_region_, _event_func_) \
+    { _region_, &_event_func_##_map },
+
+#define END_REGION_EVENT(_event_name_) \
+    }; \
+    sm_region_event_t _event_name_##region_event = { #_event_name_, _event_name_##handlers, \
+        (sizeof(_event_name_##handlers)/sizeof(_event_name_##handlers[0])), 0, FALSE };
+
+#define REGION_EVENT_DECLARE(_event_name_) \
+    extern sm_region_event_t _event_name_##region_event;
+
+// Public functions
+#define sm_regions_event(_name_, _event_name_, _event_data_, _size_) \
+    _sm_regions_event(&_name_##obj, &_event_name_##region_event, _event_data_, _size_)
+#define sm_regions_lock_create(_name_) \
+    _sm_regions_lock_create(&_name_##obj)
+#define sm_regions_lock_destroy(_name_) \
+    _sm_regions_lock_destroy(&_name_##obj)
+#define sm_regions_state(_name_, _region_) \
+    ((_name_##obj).p_regions[_region_]->current_state)
+
+// Private functions
+UINT32 _sm_regions_event(sm_regions_t* self, sm_region_event_t* event, void* p_event_data, size_t size);
+void _sm_regions_lock_create(sm_regions_t* self);
+void _sm_regions_lock_destroy(sm_regions_t* self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SM_REGIONS_H
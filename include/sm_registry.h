@@ -0,0 +1,107 @@
+// The sm_registry module maps small numeric ids and names to state machine
+// instances and events at run time, so events can be sent to instances not
+// named in the source, such as the targets of messages read off the wire.
+//
+// Instances and events get ids in registration order, so every process
+// registering the same instances and events in the same order agrees on
+// the ids. An instance is registered together with one of its events
+// defined with BEGIN_EVENT_MAP, whose sm_event_map_t names the state map of
+// its type. Events are registered by their sm_event_desc_t, see sm_queue.h,
+// and their sm_event_map_t. Hand-coded events without a transition map are
+// registered with sm_registry_add_event_any() and go to instances of any
+// type.
+//
+// An id resolves to its entry by indexing an array. Names resolve through
+// open addressed hash slots filled at registration. sm_registry_dispatch()
+// therefore sends an event to an instance in two array lookups, after
+// checking that the event belongs to the state map of the instance. Ids
+// out of range or of a mismatched event make it return FALSE, and the
+// caller keeps ownership of the event data.
+//
+// Register everything at startup. Lookups and dispatch take no lock and
+// must not run concurrently with registration.
+//
+// #include "sm_registry.h"
+//
+// static sm_registry_t registry;
+//
+// sm_registry_init(&registry);
+// sm_registry_add(&registry, Motor1SM, mtr_halt);
+// sm_registry_add_event(&registry, mtr_set_speed);
+//
+// UINT16 motor = sm_registry_find(&registry, "Motor1SM");
+// UINT16 event = sm_registry_find_event(&registry, "mtr_set_speed");
+// sm_registry_dispatch(&registry, motor, event, data);
+
+#ifndef _SM_REGISTRY_H
+#define _SM_REGISTRY_H
+
+#include "data_types.h"
+#include "state_machine.h"
+#include "sm_queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Registration table sizes
+#ifndef SM_REGISTRY_MACHINES_MAX
+#define SM_REGISTRY_MACHINES_MAX    1024
+#endif
+#ifndef SM_REGISTRY_EVENTS_MAX
+#define SM_REGISTRY_EVENTS_MAX      256
+#endif
+
+// Returned by registration when a table is full and by lookups that fail
+#define SM_REGISTRY_INVALID_ID      0xFFFF
+
+typedef struct
+{
+    sm_state_machine_t* p_machine;
+    const sm_state_machine_const_t* p_const;
+    UINT32 hash;
+} sm_registry_machine_t;
+
+typedef struct
+{
+    const sm_event_desc_t* p_desc;
+    const sm_state_machine_const_t* p_const;
+    UINT32 hash;
+} sm_registry_event_t;
+
+typedef struct
+{
+    // Entries indexed by id, and the open addressed name slots holding
+    // id + 1
+    sm_registry_machine_t machines[SM_REGISTRY_MACHINES_MAX];
+    UINT32 machine_count;
+    UINT16 machine_slots[SM_REGISTRY_MACHINES_MAX * 2];
+    sm_registry_event_t events[SM_REGISTRY_EVENTS_MAX];
+    UINT32 event_count;
+    UINT16 event_slots[SM_REGISTRY_EVENTS_MAX * 2];
+} sm_registry_t;
+
+// Public functions
+#define sm_registry_add(_registry_, _sm_name_, _event_func_) \
+    _sm_registry_add(_registry_, &_sm_name_##obj, &_event_func_##_map)
+#define sm_registry_add_event(_registry_, _event_func_) \
+    _sm_registry_add_event(_registry_, &_event_func_##_desc, &_event_func_##_map)
+#define sm_registry_add_event_any(_registry_, _event_func_) \
+    _sm_registry_add_event(_registry_, &_event_func_##_desc, NULL)
+
+void sm_registry_init(sm_registry_t* registry);
+UINT16 sm_registry_find(const sm_registry_t* registry, const CHAR* name);
+UINT16 sm_registry_find_event(const sm_registry_t* registry, const CHAR* name);
+sm_state_machine_t* sm_registry_machine(const sm_registry_t* registry, UINT16 machine);
+BOOL sm_registry_dispatch(const sm_registry_t* registry, UINT16 machine, UINT16 event, void* p_event_data);
+BOOL sm_registry_post(const sm_registry_t* registry, UINT16 machine, UINT16 event, void* p_event_data);
+
+// Private functions
+UINT16 _sm_registry_add(sm_registry_t* registry, sm_state_machine_t* self, const sm_event_map_t* type_map);
+UINT16 _sm_registry_add_event(sm_registry_t* registry, const sm_event_desc_t* desc, const sm_event_map_t* map);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SM_REGISTRY_H
@@ -0,0 +1,93 @@
+// The sm_shm module carries events between processes on the same host
+// through a shared memory channel.
+//
+// A channel is a memfd or POSIX shared memory region holding a ring of
+// posted events and a pool of fixed size event data blocks. The pool works
+// like fb_allocator, but its free list links blocks by their offset from the
+// start of the region, as every process maps the region at its own address.
+// Producers post lock free; any number of processes may post into a channel
+// and one consumer thread dispatches it.
+//
+// Event functions have no address that holds in another process, so the
+// consumer binds small event ids to an instance and an event function with
+// sm_shm_bind(). A producer allocates a block with sm_shm_alloc(), fills it
+// in place and posts it with sm_shm_post(). sm_shm_dispatch() hands the
+// block to the event function as its event data without copying, then
+// returns it to the pool. The event data is only valid during the event, so
+// states receiving these events must not defer them.
+//
+// sm_shm_create() fails with errno EEXIST while a channel of the same name
+// exists. A channel left behind by a crashed run is removed with
+// shm_unlink() before creating it again. sm_shm_attach() checks the layout
+// in the channel header against the size of the region and fails on a
+// header it cannot trust. Likewise sm_shm_dispatch() drops a posted event
+// whose block offset does not name a pool block, counting it as invalid.
+//
+// The consumer sleeps on a futex in the region with sm_shm_wait(). A post
+// only enters the kernel when the consumer is asleep.
+//
+// #include "sm_shm.h"
+//
+// // controller process
+// SHM_HANDLE chan = sm_shm_create("/motor", 256, sizeof(MotorData), 64);
+// sm_shm_bind(chan, MTR_SET_SPEED, &Motor1SMobj, (sm_event_func_t)MTR_SetSpeed);
+// while (sm_shm_wait(chan, -1))
+//      sm_shm_dispatch(chan);
+//
+// // client process
+// SHM_HANDLE chan = sm_shm_open("/motor");
+// MotorData* data = sm_shm_alloc(chan, sizeof(MotorData));
+// data->speed = 100;
+// sm_shm_post(chan, MTR_SET_SPEED, data);
+
+#ifndef _SM_SHM_H
+#define _SM_SHM_H
+
+#include "data_types.h"
+#include "state_machine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void* SHM_HANDLE;
+
+// Number of event ids a consumer can bind
+#define SM_SHM_EVENTS_MAX   64
+
+// Maximum number of events handled per sm_shm_dispatch() call
+#define SM_SHM_BURST_MAX    64
+
+// Channel counters, shared by every process mapping the channel
+typedef struct
+{
+    UINT32 posted;
+    UINT32 dropped;
+    UINT32 dispatched;
+    UINT32 unbound;
+    UINT32 invalid;
+    UINT32 wakeups;
+    UINT32 blocks_used;
+} sm_shm_stats_t;
+
+SHM_HANDLE sm_shm_create(const CHAR* name, UINT32 capacity, UINT32 block_size, UINT32 block_count);
+SHM_HANDLE sm_shm_open(const CHAR* name);
+SHM_HANDLE sm_shm_attach(INT fd);
+void sm_shm_close(SHM_HANDLE hShm);
+INT sm_shm_fd(SHM_HANDLE hShm);
+
+void* sm_shm_alloc(SHM_HANDLE hShm, size_t size);
+void sm_shm_free(SHM_HANDLE hShm, void* p_block);
+BOOL sm_shm_post(SHM_HANDLE hShm, UINT32 event_id, void* p_event_data);
+
+BOOL sm_shm_bind(SHM_HANDLE hShm, UINT32 event_id, sm_state_machine_t* machine, sm_event_func_t event_func);
+UINT32 sm_shm_dispatch(SHM_HANDLE hShm);
+BOOL sm_shm_wait(SHM_HANDLE hShm, INT timeout_ms);
+
+void sm_shm_stats(SHM_HANDLE hShm, sm_shm_stats_t* p_stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SM_SHM_H
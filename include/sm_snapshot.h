@@ -0,0 +1,135 @@
+// The sm_snapshot module saves the runtime state of state machine instances
+// into a compact binary snapshot and restores it without replaying events.
+//
+// A snapshot holds one record per instance: its name, current state and
+// instance data. Instance data is copied as is, or written and read by the
+// functions of an sm_serializer_t when it holds pointers or only part of
+// it needs saving. A pool is saved as a single record holding its state
+// array and the data of its live slots, and is restored in one pass.
+//
+// Snapshots are written into any buffer, including a file mapped with
+// sm_snapshot_file_create(), so saving costs no copies and the file is the
+// snapshot. The header, with a checksum of the records, is written last by
+// sm_snapshot_end(); a snapshot that was cut short or only partly reached
+// the disk is rejected on restore. Snapshots use the byte order of the
+// host that wrote them.
+//
+// Restoring sets the current state and instance data only. Pending internal
+// events and state timers are dropped, deferred events are freed, the
+// history of a hierarchical instance is cleared, and no entry or state
+// actions run. Each binding names one event of its instance defined with
+// BEGIN_EVENT_MAP, whose state map bounds the states a record may restore;
+// records holding a state out of that range are skipped.
+//
+// #include "sm_snapshot.h"
+//
+// // Save
+// sm_snapshot_writer_t writer;
+// size_t size = 1 << 20;
+// BYTE* p_file = sm_snapshot_file_create("motors.snap", size);
+// sm_snapshot_begin(&writer, p_file, size);
+// sm_snapshot_save(&writer, &Motor1SMobj, &motorSerializer);
+// sm_snapshot_save_pool(&writer, motorPool, NULL);
+// sm_snapshot_end(&writer);
+// sm_snapshot_file_close(p_file, size);
+//
+// // Restore on restart
+// const BYTE* p_snap = sm_snapshot_file_open("motors.snap", &size);
+// sm_snapshot_binding_t bindings[] = { SM_SNAPSHOT_BINDING(Motor1SM, &motorSerializer, mtr_halt) };
+// sm_snapshot_restore(p_snap, size, bindings, 1);
+// sm_snapshot_restore_pool(p_snap, size, motorPool, NULL);
+// sm_snapshot_file_close(p_snap, size);
+
+#ifndef _SM_SNAPSHOT_H
+#define _SM_SNAPSHOT_H
+
+#include <stddef.h>
+#include "data_types.h"
+#include "state_machine.h"
+#include "sm_pool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SM_SNAPSHOT_MAGIC       0x4E534D53  // "SMSN"
+#define SM_SNAPSHOT_VERSION     1
+
+// Record kinds
+enum { SM_SNAPSHOT_INSTANCE = 0, SM_SNAPSHOT_POOL = 1 };
+
+// Writes the instance data to p_buffer and returns the bytes written, at
+// most max_size
+typedef size_t (*sm_save_func_t)(const void* p_instance, BYTE* p_buffer);
+
+// Reads size bytes written by the save function back into the instance
+typedef BOOL (*sm_load_func_t)(void* p_instance, const BYTE* p_buffer, size_t size);
+
+// Describes how instance data is saved. Without save and load functions
+// max_size bytes are copied as is.
+typedef struct
+{
+    size_t max_size;
+    sm_save_func_t p_save_func;
+    sm_load_func_t p_load_func;
+} sm_serializer_t;
+
+typedef struct
+{
+    UINT32 magic;
+    UINT16 version;
+    UINT16 reserved;
+    UINT32 count;
+    UINT32 size;
+    UINT32 checksum;
+} sm_snapshot_header_t;
+
+// Followed by name_len bytes of name and data_len bytes of data
+typedef struct
+{
+    UINT32 data_len;
+    UINT16 name_len;
+    BYTE kind;
+    BYTE state;
+} sm_snapshot_record_t;
+
+typedef struct
+{
+    BYTE* p_buffer;
+    size_t size;
+    size_t len;
+    UINT32 count;
+    BOOL overflow;
+} sm_snapshot_writer_t;
+
+// An instance to restore, the serializer its data was saved with and one
+// of its events, leading to its state map
+typedef struct
+{
+    sm_state_machine_t* p_machine;
+    const sm_serializer_t* p_serializer;
+    const sm_event_map_t* p_type_map;
+} sm_snapshot_binding_t;
+
+#define SM_SNAPSHOT_BINDING(_sm_name_, _serializer_, _event_func_) \
+    { &_sm_name_##obj, _serializer_, &_event_func_##_map }
+
+// Public functions
+void sm_snapshot_begin(sm_snapshot_writer_t* writer, BYTE* p_buffer, size_t size);
+BOOL sm_snapshot_save(sm_snapshot_writer_t* writer, sm_state_machine_t* machine, const sm_serializer_t* serializer);
+BOOL sm_snapshot_save_pool(sm_snapshot_writer_t* writer, const sm_pool_t* pool, const sm_serializer_t* serializer);
+size_t sm_snapshot_end(sm_snapshot_writer_t* writer);
+
+BOOL sm_snapshot_valid(const BYTE* p_snapshot, size_t size);
+UINT32 sm_snapshot_restore(const BYTE* p_snapshot, size_t size, const sm_snapshot_binding_t* bindings, UINT32 count);
+UINT32 sm_snapshot_restore_pool(const BYTE* p_snapshot, size_t size, sm_pool_t* pool, const sm_serializer_t* serializer);
+
+BYTE* sm_snapshot_file_create(const char* path, size_t size);
+const BYTE* sm_snapshot_file_open(const char* path, size_t* p_size);
+void sm_snapshot_file_close(const BYTE* p_map, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SM_SNAPSHOT_H
@@ -0,0 +1,110 @@
+// The sm_timer module is a hierarchical timer wheel that posts events to
+// state machine instances after a delay or periodically.
+//
+// Timers are intrusive sm_timer_t objects owned by the caller, so starting
+// and cancelling a timer is O(1) and never allocates. The wheel keeps no
+// notion of wall clock time; the owner advances it by a number of ticks
+// (e.g. one tick per millisecond) and expired timers call their event
+// function with NULL event data, exactly like sm_event() would.
+//
+// A timer started with sm_timer_start_state() is bound to the current state
+// of the target state machine and is cancelled automatically by the state
+// engine when that state exits.
+//
+// Timers must start zeroed, either from static storage or sm_timer_init().
+//
+// The wheel is not thread-safe. Start, cancel and advance a wheel from the
+// thread that owns it. The state engine cancels state timers on the thread
+// dispatching the event, so an instance with timers bound to its states
+// may only receive events on the thread owning the wheel, even when the
+// instance has a lock.
+//
+// #include "sm_timer.h"
+// static sm_timer_wheel_t wheel;
+// static sm_timer_t timeout;
+//
+// void main()
+// {
+//      sm_timer_wheel_init(&wheel, 0);
+//      sm_timer_start(&wheel, &timeout, &MySMobj,
+//          (sm_event_func_t)my_timeout_event, 100, 0);
+//      while (sm_timer_wheel_pending(&wheel))
+//          sm_timer_wheel_advance(&wheel, 1);
+// }
+
+#ifndef _SM_TIMER_H
+#define _SM_TIMER_H
+
+#include "data_types.h"
+#include "state_machine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Root level resolution is one tick, each upper level covers 64 slots of
+// the level below. Root + 4 levels span the whole 32-bit tick range.
+// Expiry is compared modulo 2^32, so delays and periods are limited to
+// half of it.
+#define SM_TIMER_ROOT_BITS      8
+#define SM_TIMER_LEVEL_BITS     6
+#define SM_TIMER_LEVELS         4
+#define SM_TIMER_ROOT_SLOTS     (1 << SM_TIMER_ROOT_BITS)
+#define SM_TIMER_LEVEL_SLOTS    (1 << SM_TIMER_LEVEL_BITS)
+#define SM_TIMER_ROOT_MASK      (SM_TIMER_ROOT_SLOTS - 1)
+#define SM_TIMER_LEVEL_MASK     (SM_TIMER_LEVEL_SLOTS - 1)
+#define SM_TIMER_DELAY_MAX      0x7FFFFFFFUL
+
+struct sm_timer_wheel_t;
+
+typedef struct sm_timer_t
+{
+    // Wheel slot links
+    struct sm_timer_t* p_next;
+    struct sm_timer_t** pp_prev;
+
+    // Per-state links, used only by timers bound to a state
+    struct sm_timer_t* p_state_next;
+    struct sm_timer_t** pp_state_prev;
+
+    struct sm_timer_wheel_t* p_wheel;
+    sm_state_machine_t* p_machine;
+    sm_event_func_t p_event_func;
+    UINT32 expires;
+    UINT32 period;
+} sm_timer_t;
+
+typedef struct sm_timer_wheel_t
+{
+    UINT32 current_tick;
+    UINT32 pending;
+    sm_timer_t* root[SM_TIMER_ROOT_SLOTS];
+    sm_timer_t* levels[SM_TIMER_LEVELS][SM_TIMER_LEVEL_SLOTS];
+} sm_timer_wheel_t;
+
+// TRUE while the timer is scheduled on a wheel
+#define sm_timer_is_active(_timer_) \
+    ((_timer_)->pp_prev != NULL)
+
+#define sm_timer_wheel_pending(_wheel_) \
+    ((_wheel_)->pending)
+
+void sm_timer_wheel_init(sm_timer_wheel_t* self, UINT32 now_tick);
+UINT32 sm_timer_wheel_advance(sm_timer_wheel_t* self, UINT32 ticks);
+BOOL sm_timer_wheel_next_expiry(const sm_timer_wheel_t* self, UINT32* p_ticks);
+
+void sm_timer_init(sm_timer_t* timer);
+void sm_timer_start(sm_timer_wheel_t* self, sm_timer_t* timer, sm_state_machine_t* machine,
+    sm_event_func_t event_func, UINT32 delay, UINT32 period);
+void sm_timer_start_state(sm_timer_wheel_t* self, sm_timer_t* timer, sm_state_machine_t* machine,
+    sm_event_func_t event_func, UINT32 delay, UINT32 period);
+void sm_timer_cancel(sm_timer_t* timer);
+
+// Private functions
+void _sm_timer_cancel_state(sm_state_machine_t* machine);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SM_TIMER_H
@@ -0,0 +1,105 @@
+// The sm_trace module records state transitions into per-thread ring
+// buffers for post-mortem debugging.
+//
+// Tracing is compiled in with SM_TRACE (the machina_TRACE CMake option).
+// Without it the hooks in the state engine expand to nothing. Each thread
+// writes to its own ring of SM_TRACE_DEPTH records without locks or atomic
+// read-modify-write operations; the oldest records are overwritten once the
+// ring is full. A ring outlives its thread so the last transitions of a
+// thread that died are still in the dump, and is reused by the next thread
+// that starts tracing.
+//
+// Two kinds of records are written. An event record is written when an
+// external event is looked up, with the state it was raised in and the
+// transition map result, which can be EVENT_IGNORED or CANNOT_HAPPEN. A
+// state record is written for every state the engine executes, including
+// states reached through internal events, with the guard result. Both carry
+// the name of the last event raised on the thread, taken from the event
+// function name by END_TRANSITION_MAP.
+//
+// sm_trace_thread_enable() pauses recording on the calling thread, for
+// instance while replaying a journal.
+//
+// sm_trace_dump() writes all rings to a file in a compact binary format
+// that tools/sm_trace_decode turns back into a time ordered listing.
+//
+// #include "sm_trace.h"
+//
+// void on_fault()
+// {
+//      FILE* fp = fopen("machina.trace", "wb");
+//      sm_trace_dump(fp);
+//      fclose(fp);
+// }
+//
+// $ sm_trace_decode machina.trace
+
+#ifndef _SM_TRACE_H
+#define _SM_TRACE_H
+
+#include <stdio.h>
+#include "data_types.h"
+#include "state_machine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Number of records kept per thread, must be a power of two
+#ifndef SM_TRACE_DEPTH
+#define SM_TRACE_DEPTH      4096
+#endif
+
+// Record kinds
+enum { SM_TRACE_KIND_EVENT = 0, SM_TRACE_KIND_STATE = 1 };
+
+// Guard result of records without a guard evaluation
+#define SM_TRACE_NO_GUARD   0xFF
+
+// Dump file layout: one sm_trace_file_header_t followed by records up to
+// the end of the file. Each record is an sm_trace_file_record_t followed
+// by machine_len bytes of machine name and event_len bytes of event name,
+// without terminators. All fields are in the byte order of the host that
+// wrote the dump.
+#define SM_TRACE_FILE_MAGIC     "SMTR"
+#define SM_TRACE_FILE_VERSION   1
+
+typedef struct
+{
+    char magic[4];
+    UINT16 version;
+    UINT16 thread_count;
+} sm_trace_file_header_t;
+
+typedef struct
+{
+    UINT64 timestamp_ns;
+    UINT32 thread;
+    BYTE kind;
+    BYTE from_state;
+    BYTE to_state;
+    BYTE guard;
+    BYTE machine_len;
+    BYTE event_len;
+    UINT16 reserved;
+} sm_trace_file_record_t;
+
+#ifdef SM_TRACE
+    #define SM_TRACE_RECORD(_self_, _kind_, _from_, _to_, _guard_) \
+        _sm_trace_record(_self_, _kind_, _from_, _to_, _guard_)
+#else
+    #define SM_TRACE_RECORD(_self_, _kind_, _from_, _to_, _guard_)
+#endif
+
+// Public functions
+UINT32 sm_trace_dump(FILE* fp);
+BOOL sm_trace_thread_enable(BOOL enable);
+
+// Private functions
+void _sm_trace_record(const sm_state_machine_t* self, BYTE kind, BYTE from_state, BYTE to_state, BYTE guard);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SM_TRACE_H
@@ -0,0 +1,89 @@
+// The sm_view module lets other threads read the current state and a chosen
+// part of the instance data of a state machine instance without taking its
+// lock or slowing down event dispatch.
+//
+// A view holds a copy of the current state and of a view data structure
+// declared by the caller, filled from the instance data by a view function.
+// Once a view is attached, the engine publishes to it after every state
+// action. The copy is guarded by a sequence counter (a seqlock): the
+// counter is odd while the engine writes, so a reader retries until it
+// copied the view between two publishes. Readers never block the engine,
+// and publishing costs two counter stores plus the view function.
+//
+// sm_view_read() returns the number of publishes so far. A poller can skip
+// the rest of its work when the number did not change since its last read.
+//
+// Keep the view data small and free of pointers; readers copy it out while
+// the engine may be rewriting it and only keep copies that were not torn.
+//
+// #include "sm_view.h"
+//
+// typedef struct { INT speed; } MotorView;
+//
+// static void motor_view(const Motor* p_motor, MotorView* p_view)
+// {
+//      p_view->speed = p_motor->currentSpeed;
+// }
+//
+// SM_DEFINE_VIEW(Motor1SM, MotorView, motor_view)
+// sm_view_attach(Motor1SM);
+//
+// // monitoring thread
+// MotorView view;
+// BYTE state;
+// sm_view_read(Motor1SM, &state, &view);
+
+#ifndef _SM_VIEW_H
+#define _SM_VIEW_H
+
+#include "data_types.h"
+#include "state_machine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Fills the view data from the instance data
+typedef void (*sm_view_func_t)(const void* p_instance, void* p_data);
+
+typedef struct sm_view_t
+{
+    // Odd while the engine publishes
+    UINT32 sequence;
+    BYTE state;
+    UINT32 size;
+    sm_view_func_t p_func;
+    void* p_data;
+} sm_view_t;
+
+#define SM_VIEW_INITIALIZER(_data_, _size_, _func_) \
+    { 0, 0, _size_, (sm_view_func_t)_func_, _data_ }
+
+// Defines the view of an instance, holding a _data_type_ filled by _func_
+#define SM_DEFINE_VIEW(_sm_name_, _data_type_, _func_) \
+    static _data_type_ _sm_name_##view_data; \
+    sm_view_t _sm_name_##view = SM_VIEW_INITIALIZER(&_sm_name_##view_data, sizeof(_data_type_), _func_);
+
+#define SM_DECLARE_VIEW(_sm_name_) \
+    extern sm_view_t _sm_name_##view;
+
+// Public functions
+#define sm_view_attach(_sm_name_) \
+    _sm_view_attach(&_sm_name_##obj, &_sm_name_##view)
+#define sm_view_detach(_sm_name_) \
+    _sm_view_detach(&_sm_name_##obj)
+#define sm_view_read(_sm_name_, _state_, _data_) \
+    _sm_view_read(&_sm_name_##view, _state_, _data_)
+
+void sm_view_init(sm_view_t* view, void* p_data, UINT32 size, sm_view_func_t func);
+
+// Private functions
+void _sm_view_attach(sm_state_machine_t* self, sm_view_t* view);
+void _sm_view_detach(sm_state_machine_t* self);
+UINT32 _sm_view_read(const sm_view_t* view, BYTE* p_state, void* p_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SM_VIEW_H
@@ -0,0 +1,75 @@
+// The sm_watch module tells callers when a state machine instance takes a
+// transition, without polling the instance.
+//
+// A watch is a node owned by the caller and registered on an instance with
+// sm_watch(). It matches transitions from one state to another, either of
+// which may be SM_WATCH_ANY. Once the state action of a matching transition
+// has run, the engine takes the watch off the instance. Its callback runs
+// when the event that caused the transition returns, after the instance
+// lock is released, on the thread that sent the event. Callbacks may
+// therefore send events to the same instance.
+//
+// A watch fires once. Register it again to wait for the next transition.
+// sm_watch_cancel() takes back a watch that has not fired. It returns FALSE
+// if the watch was already taken off the instance, and the callback is then
+// about to run or has run.
+//
+// #include "sm_watch.h"
+//
+// static void on_idle(sm_watch_t* watch, BYTE from, BYTE to)
+// {
+//      printf("idle\n");
+// }
+//
+// static sm_watch_t idle_watch = SM_WATCH_INITIALIZER(SM_WATCH_ANY, ST_IDLE, on_idle, NULL);
+// sm_watch(MotorSM, &idle_watch);
+// sm_event(MotorSM, MTR_Halt, NULL);      // prints "idle" before returning
+
+#ifndef _SM_WATCH_H
+#define _SM_WATCH_H
+
+#include "data_types.h"
+#include "state_machine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Matches any state in a watch
+#define SM_WATCH_ANY    0xFF
+
+struct sm_watch_t;
+
+typedef void (*sm_watch_func_t)(struct sm_watch_t* watch, BYTE from, BYTE to);
+
+typedef struct sm_watch_t
+{
+    struct sm_watch_t* p_next;
+    sm_watch_func_t p_func;
+    void* p_context;
+    BYTE from;
+    BYTE to;
+
+    // Transition that fired the watch
+    BYTE fired_from;
+    BYTE fired_to;
+} sm_watch_t;
+
+#define SM_WATCH_INITIALIZER(_from_, _to_, _func_, _context_) \
+    { NULL, _func_, _context_, _from_, _to_, 0, 0 }
+
+// Public functions
+#define sm_watch(_sm_name_, _watch_) \
+    _sm_watch(&_sm_name_##obj, _watch_)
+#define sm_watch_cancel(_sm_name_, _watch_) \
+    _sm_watch_cancel(&_sm_name_##obj, _watch_)
+
+// Private functions
+void _sm_watch(sm_state_machine_t* self, sm_watch_t* watch);
+BOOL _sm_watch_cancel(sm_state_machine_t* self, sm_watch_t* watch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SM_WATCH_H
@@ -10,6 +10,21 @@
 // extended version (EX) supports the additional guard, entry and exit state
 // machine features. 
 //
+// The hierarchical version (HSM) builds on the extended state map and gives
+// each state a parent. A transition map entry of EVENT_INHERITED takes the
+// entry of the nearest ancestor instead, so events shared by all substates
+// are written once on the parent. A transition exits the states up to the
+// least common ancestor of the current and new state, innermost first, then
+// enters the states down to the new state, outermost first. A target of
+// SM_HISTORY(state) enters the substate last active under state. The exit
+// and entry chains of every pair of states are built on the first event, so
+// dispatch never walks the tree.
+//
+// A transition map entry of EVENT_DEFERRED parks the event, data included,
+// on the instance instead of dropping it. Parked events are looked up again
+// after every transition, oldest first, and dispatched once the new state
+// no longer defers them. Only transition map events can be deferred.
+//
 // Macros are used to assist in creating the state machine machinery. 
 
 #ifndef _STATE_MACHINE_H
@@ -17,6 +32,8 @@
 
 #include "data_types.h"
 #include "fault.h"
+#include "lock_guard.h"
+#include "sm_metrics.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -34,10 +51,57 @@ extern "C" {
     #define sm_xfree(ptr)      free(ptr)
 #endif
 
-enum { EVENT_IGNORED = 0xFE, CANNOT_HAPPEN = 0xFF };
+enum { EVENT_DEFERRED = 0xFC, EVENT_INHERITED = 0xFD, EVENT_IGNORED = 0xFE, CANNOT_HAPPEN = 0xFF };
+
+// Hierarchical state limits. States of an HSM are numbered below
+// SM_HSM_STATES_MAX so history targets fit in a transition map byte.
+#define SM_HSM_STATES_MAX   124
+#ifndef SM_HSM_DEPTH_MAX
+#define SM_HSM_DEPTH_MAX    8
+#endif
+#define SM_HSM_HISTORY      0x80
+#define SM_NO_PARENT        0xFF
+
+// Enter the substate last active under _state_, or _state_ itself if none
+#define SM_HISTORY(_state_) (SM_HSM_HISTORY | (_state_))
+
+#if defined(_MSC_VER)
+    #define SM_THREAD_LOCAL __declspec(thread)
+#else
+    #define SM_THREAD_LOCAL __thread
+#endif
+
+// Names the event being raised for transition tracing, see sm_trace.h
+#ifdef SM_TRACE
+    #define SM_TRACE_EVENT(_event_name_)    _sm_trace_event(_event_name_)
+#else
+    #define SM_TRACE_EVENT(_event_name_)
+#endif
 
 typedef void no_event_data_t;
 
+// Exit and entry chains of a hierarchical state machine type, defined by
+// END_STATE_MAP_HSM with tables sized for its state map. The chain between
+// two states is the tail of each state path below their least common
+// ancestor, so one table of paths and one of ancestor depths cover every
+// pair. The first event of the type fills the tables.
+typedef struct sm_hsm_t
+{
+    // Number of states from the root down to and including each state
+    BYTE* p_depth;
+
+    // The states from the root down to each state, SM_HSM_DEPTH_MAX per state
+    BYTE* p_paths;
+
+    // Depth of the least common ancestor of each pair of states
+    BYTE* p_lca;
+
+    // SM_HSM_EMPTY, SM_HSM_FILLING or SM_HSM_READY
+    UINT32 fill_state;
+} sm_hsm_t;
+
+enum { SM_HSM_EMPTY, SM_HSM_FILLING, SM_HSM_READY };
+
 // State machine constant data
 typedef struct
 {
@@ -45,8 +109,53 @@ typedef struct
     const BYTE states_max;
     const struct sm_state_t* state_map;
     const struct sm_state_ex_t* state_map_ex;
+    sm_metrics_type_t* p_metrics;
+    sm_hsm_t* p_hsm;
+
+    // Set once the first engine run validated the state map
+    BOOL* p_checked;
 } sm_state_machine_const_t;
 
+// Depth of the internal event ring of each instance. Must be the same for
+// the library and all code including this header.
+#ifndef SM_INTERNAL_EVENT_MAX
+#define SM_INTERNAL_EVENT_MAX   4
+#endif
+
+// Number of deferred events each instance can hold. Must be the same for
+// the library and all code including this header.
+#ifndef SM_DEFERRED_EVENT_MAX
+#define SM_DEFERRED_EVENT_MAX   4
+#endif
+
+// Both lists are indexed and counted in bytes
+#if SM_INTERNAL_EVENT_MAX < 1 || SM_INTERNAL_EVENT_MAX > 255
+#error "SM_INTERNAL_EVENT_MAX must be between 1 and 255"
+#endif
+#if SM_DEFERRED_EVENT_MAX < 1 || SM_DEFERRED_EVENT_MAX > 255
+#error "SM_DEFERRED_EVENT_MAX must be between 1 and 255"
+#endif
+
+struct sm_timer_t;
+struct sm_event_queue_t;
+struct sm_watch_t;
+struct sm_view_t;
+
+// An internal event waiting for the state engine
+typedef struct
+{
+    BYTE new_state;
+    void* p_event_data;
+} sm_internal_event_t;
+
+// An event parked until the instance leaves the state that deferred it
+typedef struct
+{
+    const BYTE* p_transitions;
+    void* p_event_data;
+    BYTE state;
+} sm_deferred_event_t;
+
 // State machine instance data
 typedef struct 
 {
@@ -54,8 +163,19 @@ typedef struct
     void* p_instance;
     BYTE new_state;
     BYTE current_state;
-    BOOL event_generated;
-    void* p_event_data;
+    BYTE event_head;
+    BYTE event_count;
+    UINT16 event_overflows;
+    struct sm_timer_t* p_state_timers;
+    LOCK_HANDLE lock;
+    struct sm_event_queue_t* p_queue;
+    BYTE* p_history;
+    struct sm_watch_t* p_watches;
+    struct sm_watch_t* p_fired;
+    struct sm_view_t* p_view;
+    sm_internal_event_t events[SM_INTERNAL_EVENT_MAX];
+    BYTE deferred_count;
+    sm_deferred_event_t deferred[SM_DEFERRED_EVENT_MAX];
 } sm_state_machine_t;
 
 // Generic state function signatures
@@ -63,6 +183,27 @@ typedef void (*sm_state_func_t)(sm_state_machine_t* self, void* p_event_data);
 typedef BOOL (*sm_guard_func_t)(sm_state_machine_t* self, void* p_event_data);
 typedef void (*sm_entry_func_t)(sm_state_machine_t* self, void* p_event_data);
 typedef void (*sm_exit_func_t)(sm_state_machine_t* self);
+typedef void (*sm_event_func_t)(sm_state_machine_t* self, void* p_event_data);
+
+// One event of a burst passed to sm_event_batch()
+typedef struct
+{
+    sm_event_func_t p_event_func;
+    void* p_event_data;
+} sm_batch_event_t;
+
+// Transition map of an event function defined with BEGIN_EVENT_MAP, for
+// code that applies the map without calling the function
+typedef struct
+{
+    const CHAR* name;
+    sm_event_func_t p_event_func;
+    const BYTE* p_transitions;
+    const sm_state_machine_const_t* p_const;
+} sm_event_map_t;
+
+// Maximum number of event data blocks held back before a batch frees them
+#define SM_BATCH_FREE_MAX   64
 
 typedef struct sm_state_t
 {
@@ -75,32 +216,72 @@ typedef struct sm_state_ex_t
     sm_guard_func_t p_guard_func;
     sm_entry_func_t p_entry_func;
     sm_exit_func_t p_exit_func;
+    BYTE parent;
 } sm_state_ex_t;
 
 // Public functions
 #define sm_event(_sm_name_, _event_func_, _event_data_) \
     _event_func_(&_sm_name_##obj, _event_data_)
+#define sm_event_batch(_sm_name_, _events_, _count_) \
+    _sm_event_batch(&_sm_name_##obj, _events_, _count_)
 #define SM_Get(_sm_name_, _get_func_) \
     _get_func_(&_sm_name_##obj)
 
+// TRUE when the library was built without NDEBUG, so its asserts and
+// per-transition checks run whatever the caller was built with
+BOOL sm_debug_build(void);
+
+// Serialize event dispatch on an instance with a software lock. A state
+// action sending an event to its own instance does not take the lock again;
+// the event is queued and runs once the action returns.
+#define sm_lock_create(_sm_name_) \
+    _sm_lock_create(&_sm_name_##obj)
+#define sm_lock_destroy(_sm_name_) \
+    _sm_lock_destroy(&_sm_name_##obj)
+
 // Protected functions
 #define sm_internal_event(_newState_, _event_data_) \
     _sm_internal_event(self, _newState_, _event_data_)
 #define SM_GetInstance(_instance_) \
     (_instance_*)(self->p_instance);
+#define sm_get_instance(_instance_) \
+    ((_instance_*)(self->p_instance))
 
 // Private functions
 void _sm_external_event(sm_state_machine_t* self, const sm_state_machine_const_t* selfconst, BYTE new_state, void* p_event_data);
+void _sm_transition_event(sm_state_machine_t* self, const sm_state_machine_const_t* selfconst, const BYTE* transitions, void* p_event_data);
+void _sm_event_batch(sm_state_machine_t* self, const sm_batch_event_t* events, UINT count);
+void* _sm_share_event_data(void* p_event_data);
+void _sm_lock_create(sm_state_machine_t* self);
+void _sm_lock_destroy(sm_state_machine_t* self);
 void _sm_internal_event(sm_state_machine_t* self, BYTE new_state, void* p_event_data);
 void _sm_state_engine(sm_state_machine_t* self, const sm_state_machine_const_t* selfconst);
 void _sm_state_engine_ex(sm_state_machine_t* self, const sm_state_machine_const_t* selfconst);
+void _sm_trace_event(const CHAR* event_name);
+BYTE _sm_hsm_lookup(const sm_state_machine_const_t* self_const, const BYTE* transitions, BYTE state);
+BYTE _sm_hsm_target(const sm_state_machine_t* self, BYTE new_state);
+void _sm_hsm_transition(sm_state_machine_t* self, const sm_state_machine_const_t* self_const, void* p_event_data);
+void _sm_watch_match(sm_state_machine_t* self, BYTE from, BYTE to);
+void _sm_watch_fire(struct sm_watch_t* p_fired);
+void _sm_view_publish(sm_state_machine_t* self);
 
 #define SM_DECLARE(_sm_name_) \
     extern sm_state_machine_t _sm_name_##obj; 
 
+// Initializes every field of an instance, so definitions stay clean under
+// -Wmissing-field-initializers
+#define SM_INSTANCE_INITIALIZER(_name_, _instance_, _queue_, _history_) \
+    { _name_, _instance_, 0, 0, 0, 0, 0, NULL, NULL, _queue_, _history_, \
+        NULL, NULL, NULL, { { 0, NULL } }, 0, { { NULL, NULL, 0 } } }
+
 #define SM_DEFINE(_sm_name_, _instance_) \
-    sm_state_machine_t _sm_name_##obj = { #_sm_name_, _instance_, \
-        0, 0, 0, 0 }; 
+    sm_state_machine_t _sm_name_##obj = SM_INSTANCE_INITIALIZER(#_sm_name_, _instance_, NULL, NULL);
+
+// Defines an instance of a hierarchical state machine, which keeps the
+// history of its parent states
+#define SM_DEFINE_HSM(_sm_name_, _instance_) \
+    static BYTE _sm_name_##history[SM_HSM_STATES_MAX]; \
+    sm_state_machine_t _sm_name_##obj = SM_INSTANCE_INITIALIZER(#_sm_name_, _instance_, NULL, _sm_name_##history);
 
 #define EVENT_DECLARE(_event_func_, _event_data_) \
     void _event_func_(sm_state_machine_t* self, _event_data_* p_event_data);
@@ -146,24 +327,51 @@ void _sm_state_engine_ex(sm_state_machine_t* self, const sm_state_machine_const_
 
 #define END_STATE_MAP(_sm_name_) \
     }; \
+    SM_METRICS_TYPE_DEFINE(_sm_name_, (sizeof(_sm_name_##state_map)/sizeof(_sm_name_##state_map[0]))) \
+    static BOOL _sm_name_##checked; \
     static const sm_state_machine_const_t _sm_name_##const = { #_sm_name_, \
         (sizeof(_sm_name_##state_map)/sizeof(_sm_name_##state_map[0])), \
-        _sm_name_##state_map, NULL };
+        _sm_name_##state_map, NULL, SM_METRICS_TYPE(_sm_name_), NULL, &_sm_name_##checked };
 
 #define BEGIN_STATE_MAP_EX(_sm_name_) \
     static const sm_state_ex_t _sm_name_##state_map[] = { 
 
 #define STATE_MAP_ENTRY_EX(_state_func_) \
-    { (sm_state_func_t)_state_func_, NULL, NULL, NULL },
+    { (sm_state_func_t)_state_func_, NULL, NULL, NULL, SM_NO_PARENT },
 
 #define STATE_MAP_ENTRY_ALL_EX(_state_func_, _guard_func_, _entry_func_, _exit_func_) \
-    { (sm_state_func_t)_state_func_, (sm_guard_func_t)_guard_func_, (sm_entry_func_t)_entry_func_, (sm_exit_func_t)_exit_func_ },
+    { (sm_state_func_t)_state_func_, (sm_guard_func_t)_guard_func_, (sm_entry_func_t)_entry_func_, (sm_exit_func_t)_exit_func_, SM_NO_PARENT },
 
 #define END_STATE_MAP_EX(_sm_name_) \
     }; \
+    SM_METRICS_TYPE_DEFINE(_sm_name_, (sizeof(_sm_name_##state_map)/sizeof(_sm_name_##state_map[0]))) \
+    static BOOL _sm_name_##checked; \
     static const sm_state_machine_const_t _sm_name_##const = { #_sm_name_, \
         (sizeof(_sm_name_##state_map)/sizeof(_sm_name_##state_map[0])), \
-        NULL, _sm_name_##state_map };
+        NULL, _sm_name_##state_map, SM_METRICS_TYPE(_sm_name_), NULL, &_sm_name_##checked };
+
+#define BEGIN_STATE_MAP_HSM(_sm_name_) \
+    static const sm_state_ex_t _sm_name_##state_map[] = { 
+
+#define STATE_MAP_ENTRY_HSM(_state_func_, _parent_) \
+    { (sm_state_func_t)_state_func_, NULL, NULL, NULL, _parent_ },
+
+#define STATE_MAP_ENTRY_ALL_HSM(_state_func_, _parent_, _guard_func_, _entry_func_, _exit_func_) \
+    { (sm_state_func_t)_state_func_, (sm_guard_func_t)_guard_func_, (sm_entry_func_t)_entry_func_, (sm_exit_func_t)_exit_func_, _parent_ },
+
+#define END_STATE_MAP_HSM(_sm_name_) \
+    }; \
+    SM_METRICS_TYPE_DEFINE(_sm_name_, (sizeof(_sm_name_##state_map)/sizeof(_sm_name_##state_map[0]))) \
+    static BOOL _sm_name_##checked; \
+    typedef char _sm_name_##hsm_size_check[(sizeof(_sm_name_##state_map)/sizeof(_sm_name_##state_map[0])) <= SM_HSM_STATES_MAX ? 1 : -1]; \
+    static BYTE _sm_name_##hsm_depth[sizeof(_sm_name_##state_map)/sizeof(_sm_name_##state_map[0])]; \
+    static BYTE _sm_name_##hsm_paths[(sizeof(_sm_name_##state_map)/sizeof(_sm_name_##state_map[0])) * SM_HSM_DEPTH_MAX]; \
+    static BYTE _sm_name_##hsm_lca[(sizeof(_sm_name_##state_map)/sizeof(_sm_name_##state_map[0])) * \
+        (sizeof(_sm_name_##state_map)/sizeof(_sm_name_##state_map[0]))]; \
+    static sm_hsm_t _sm_name_##hsm = { _sm_name_##hsm_depth, _sm_name_##hsm_paths, _sm_name_##hsm_lca, SM_HSM_EMPTY }; \
+    static const sm_state_machine_const_t _sm_name_##const = { #_sm_name_, \
+        (sizeof(_sm_name_##state_map)/sizeof(_sm_name_##state_map[0])), \
+        NULL, _sm_name_##state_map, SM_METRICS_TYPE(_sm_name_), &_sm_name_##hsm, &_sm_name_##checked };
 
 #define BEGIN_TRANSITION_MAP \
     static const BYTE TRANSITIONS[] = { \
@@ -173,9 +381,31 @@ void _sm_state_engine_ex(sm_state_machine_t* self, const sm_state_machine_const_
 
 #define END_TRANSITION_MAP(_sm_name_, _event_data_) \
     }; \
-    _sm_external_event(self, &_sm_name_##const, TRANSITIONS[self->current_state], _event_data_); \
+    SM_TRACE_EVENT(__func__); \
+    _sm_transition_event(self, &_sm_name_##const, TRANSITIONS, _event_data_); \
     C_ASSERT((sizeof(TRANSITIONS)/sizeof(BYTE)) == (sizeof(_sm_name_##state_map)/sizeof(_sm_name_##state_map[0])));
 
+// Defines an event function together with its transition map at file
+// scope. The map is published as the sm_event_map_t _event_func_##_map,
+// used by bulk pool events, regions and the registry.
+#define BEGIN_EVENT_MAP(_event_func_) \
+    static const BYTE _event_func_##_transitions[] = { \
+
+#define END_EVENT_MAP(_event_func_, _sm_name_, _event_data_) \
+    }; \
+    EVENT_DECLARE(_event_func_, _event_data_) \
+    const sm_event_map_t _event_func_##_map = { #_event_func_, (sm_event_func_t)_event_func_, \
+        _event_func_##_transitions, &_sm_name_##const }; \
+    EVENT_DEFINE(_event_func_, _event_data_) \
+    { \
+        C_ASSERT((sizeof(_event_func_##_transitions)/sizeof(BYTE)) == (sizeof(_sm_name_##state_map)/sizeof(_sm_name_##state_map[0]))); \
+        SM_TRACE_EVENT(#_event_func_); \
+        _sm_transition_event(self, &_sm_name_##const, _event_func_##_transitions, p_event_data); \
+    }
+
+#define EVENT_MAP_DECLARE(_event_func_) \
+    extern const sm_event_map_t _event_func_##_map;
+
 #ifdef __cplusplus
 }
 #endif
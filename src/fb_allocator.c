@@ -7,14 +7,15 @@
 #define USE_LOCKS
 #ifdef USE_LOCKS
     #include "lock_guard.h"
-    static LOCK_HANDLE _lock_handle;
+    static lk_lock_t _lock = LK_LOCK_INITIALIZER;
+    static LOCK_HANDLE _lock_handle = &_lock;
 #else
     #pragma message("WARNING: Define software lock.")
     typedef int LOCK_HANDLE;
     static LOCK_HANDLE _lock_handle;
 
-    #define lk_create()     (1)
-    #define lk_destry(h)  
+    #define lk_init(p)      (1)
+    #define lk_deinit(h)  
     #define lk_lock(h)    
     #define lk_unlock(h)  
 #endif
@@ -27,9 +28,16 @@
 #define GET_BLOCK_PTR(_client_ptr_) \
     (_client_ptr_ ? ((void*)((char*)_client_ptr_)) : NULL)
 
+// Convert between a block of a mapped pool and its number, counted from 1
+#define ALLOC_MAP_BLOCK(_self_, _index_) \
+    ((void*)((_self_)->p_pool + ((_index_) - 1) * (_self_)->block_size))
+#define ALLOC_MAP_INDEX(_self_, _block_ptr_) \
+    ((UINT32)(((const char*)(_block_ptr_) - (_self_)->p_pool) / (_self_)->block_size) + 1)
+
 static void* alloc_new_block(alloc_allocator_t* alloc);
 static void alloc_push(alloc_allocator_t* alloc, void* p_block);
 static void* alloc_pop(alloc_allocator_t* alloc);
+static void alloc_map_count(alloc_allocator_t* alloc, BOOL allocated);
 
 //----------------------------------------------------------------------------
 // alloc_new_block
@@ -40,8 +48,14 @@ static void* alloc_new_block(alloc_allocator_t* self)
 
     lk_lock(_lock_handle);
 
+    // A mapped pool keeps its index in the file
+    if (self->p_map)
+    {
+        if (self->p_map->pool_index < self->blocks_max)
+            p_block = ALLOC_MAP_BLOCK(self, ++self->p_map->pool_index);
+    }
     // If we have not exceeded the pool maximum
-    if (self->pool_index < self->blocks_max)
+    else if (self->pool_index < self->blocks_max)
     {
         // Get pointer to a new fixed memory block within the pool
         p_block = (void*)(self->p_pool + (self->pool_index++ * self->block_size));
@@ -71,6 +85,15 @@ static void alloc_push(alloc_allocator_t* self, void* p_block)
 
     lk_lock(_lock_handle);
 
+    // A mapped pool links blocks by number
+    if (self->p_map)
+    {
+        *(UINT32*)pClient = self->p_map->head;
+        self->p_map->head = ALLOC_MAP_INDEX(self, pClient);
+        LK_UNLOCK(_lock_handle);
+        return;
+    }
+
     // Point client block's next pointer to head
     pClient->p_next = self->p_head;
 
@@ -89,8 +112,17 @@ static void* alloc_pop(alloc_allocator_t* self)
 
     lk_lock(_lock_handle);
 
+    // A mapped pool links blocks by number
+    if (self->p_map)
+    {
+        if (self->p_map->head)
+        {
+            p_block = ALLOC_MAP_BLOCK(self, self->p_map->head);
+            self->p_map->head = *(UINT32*)p_block;
+        }
+    }
     // Is the free-list empty?
-    if (self->p_head)
+    else if (self->p_head)
     {
         // Remove the head block
         p_block = self->p_head;
@@ -103,12 +135,35 @@ static void* alloc_pop(alloc_allocator_t* self)
     return GET_BLOCK_PTR(p_block);
 } 
 
+//----------------------------------------------------------------------------
+// alloc_map_count
+//----------------------------------------------------------------------------
+static void alloc_map_count(alloc_allocator_t* self, BOOL allocated)
+{
+    alloc_map_header_t* p_map = self->p_map;
+
+    // Counters of a mapped pool carry over to the next run
+    if (allocated)
+    {
+        p_map->allocations++;
+        p_map->blocks_in_use++;
+        if (p_map->blocks_in_use > p_map->max_blocks_in_use)
+            p_map->max_blocks_in_use = p_map->blocks_in_use;
+    }
+    else
+    {
+        p_map->deallocations++;
+        p_map->blocks_in_use--;
+    }
+}
+
 //----------------------------------------------------------------------------
 // alloc_init
 //----------------------------------------------------------------------------
 void alloc_init()
 {
-    _lock_handle = lk_create();
+    _lock_handle = lk_init(&_lock);
+    lk_name(_lock_handle, "fb_allocator");
 } 
 
 //----------------------------------------------------------------------------
@@ -116,7 +171,7 @@ void alloc_init()
 //----------------------------------------------------------------------------
 void alloc_term()
 {
-    lk_destroy(_lock_handle);
+    lk_deinit(_lock_handle);
 }
 
 //----------------------------------------------------------------------------
@@ -135,6 +190,9 @@ void* alloc_alloc(ALLOC_HANDLE hAlloc, size_t size)
     // Ensure requested size fits within memory block 
     ASSERT_TRUE(size <= self->block_size);
 
+    // A mapped pool must be mapped first
+    ASSERT_TRUE(self->p_pool);
+
     // Get a block from the free-list
     p_block = alloc_pop(self);
 
@@ -154,6 +212,9 @@ void* alloc_alloc(ALLOC_HANDLE hAlloc, size_t size)
         {
             self->max_blocks_in_use = self->blocks_in_use;
         }
+
+        if (self->p_map)
+            alloc_map_count(self, TRUE);
     }
 
     return GET_CLIENT_PTR(p_block);
@@ -208,6 +269,9 @@ void alloc_free(ALLOC_HANDLE hAlloc, void* p_block)
     // Keep track of usage statistics
     self->deallocations++;
     self->blocks_in_use--;
+
+    if (self->p_map)
+        alloc_map_count(self, FALSE);
 } 
 
 
@@ -0,0 +1,200 @@
+#include "fb_allocator.h"
+#include "data_types.h"
+#include "fault.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ALLOC_MAP_MAGIC     0x70616D66
+#define ALLOC_MAP_VERSION   1
+
+// Bytes of the file behind a mapped pool
+#define ALLOC_MAP_SIZE(_self_) \
+    (ALLOC_MAP_POOL_OFFSET + (_self_)->block_size * (_self_)->blocks_max)
+
+//----------------------------------------------------------------------------
+// alloc_map
+//----------------------------------------------------------------------------
+BOOL alloc_map(ALLOC_HANDLE hAlloc, const char* path, BOOL* p_restored)
+{
+    alloc_allocator_t* self = (alloc_allocator_t*)hAlloc;
+    alloc_map_header_t* p_map;
+    struct stat st;
+    size_t size;
+    void* p_base;
+    BOOL restored;
+    int fd;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(path);
+    ASSERT_TRUE(self->p_pool == NULL);
+    ASSERT_TRUE(sizeof(alloc_map_header_t) <= ALLOC_MAP_POOL_OFFSET);
+
+    size = ALLOC_MAP_SIZE(self);
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return FALSE;
+
+    // A file of another size belongs to a pool of another geometry
+    if (fstat(fd, &st) < 0 || (st.st_size && (size_t)st.st_size != size) ||
+        (!st.st_size && ftruncate(fd, (off_t)size) < 0))
+    {
+        close(fd);
+        return FALSE;
+    }
+
+    // The mapping stays valid once the descriptor is closed
+    p_base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p_base == MAP_FAILED)
+        return FALSE;
+
+    p_map = (alloc_map_header_t*)p_base;
+    restored = p_map->magic != 0;
+
+    if (restored)
+    {
+        if (p_map->magic != ALLOC_MAP_MAGIC || p_map->version != ALLOC_MAP_VERSION ||
+            p_map->block_size != self->block_size || p_map->blocks_max != self->blocks_max)
+        {
+            munmap(p_base, size);
+            return FALSE;
+        }
+    }
+    else
+    {
+        // New file, or one that was never completely set up
+        memset(p_map, 0, sizeof(alloc_map_header_t));
+        p_map->version = ALLOC_MAP_VERSION;
+        p_map->block_size = (UINT32)self->block_size;
+        p_map->blocks_max = self->blocks_max;
+        p_map->magic = ALLOC_MAP_MAGIC;
+    }
+
+    self->p_pool = (const char*)p_base + ALLOC_MAP_POOL_OFFSET;
+    self->p_head = NULL;
+    self->p_map = p_map;
+
+    // Pick up the counters left by the previous run
+    self->blocks_in_use = (UINT16)p_map->blocks_in_use;
+    self->max_blocks_in_use = (UINT16)p_map->max_blocks_in_use;
+    self->allocations = (UINT16)p_map->allocations;
+    self->deallocations = (UINT16)p_map->deallocations;
+
+    if (p_restored)
+        *p_restored = restored;
+
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// alloc_unmap
+//----------------------------------------------------------------------------
+void alloc_unmap(ALLOC_HANDLE hAlloc)
+{
+    alloc_allocator_t* self = (alloc_allocator_t*)hAlloc;
+
+    ASSERT_TRUE(self);
+
+    if (!self->p_map)
+        return;
+
+    alloc_sync(self);
+    munmap(self->p_map, ALLOC_MAP_SIZE(self));
+
+    self->p_pool = NULL;
+    self->p_map = NULL;
+}
+
+//----------------------------------------------------------------------------
+// alloc_sync
+//----------------------------------------------------------------------------
+void alloc_sync(ALLOC_HANDLE hAlloc)
+{
+    alloc_allocator_t* self = (alloc_allocator_t*)hAlloc;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(self->p_map);
+
+    // Write the pool back to the file before returning
+    msync(self->p_map, ALLOC_MAP_SIZE(self), MS_SYNC);
+}
+
+//----------------------------------------------------------------------------
+// alloc_set_root
+//----------------------------------------------------------------------------
+void alloc_set_root(ALLOC_HANDLE hAlloc, void* p_block)
+{
+    alloc_allocator_t* self = (alloc_allocator_t*)hAlloc;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(self->p_map);
+
+    if (!p_block)
+    {
+        self->p_map->root = 0;
+        return;
+    }
+
+    ASSERT_TRUE((const char*)p_block >= self->p_pool);
+    ASSERT_TRUE((size_t)((const char*)p_block - self->p_pool) < self->block_size * self->blocks_max);
+
+    self->p_map->root = (UINT32)(((const char*)p_block - self->p_pool) / self->block_size) + 1;
+}
+
+//----------------------------------------------------------------------------
+// alloc_root
+//----------------------------------------------------------------------------
+void* alloc_root(ALLOC_HANDLE hAlloc)
+{
+    alloc_allocator_t* self = (alloc_allocator_t*)hAlloc;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(self->p_map);
+
+    if (!self->p_map->root)
+        return NULL;
+
+    return (void*)(self->p_pool + (self->p_map->root - 1) * self->block_size);
+}
+
+//----------------------------------------------------------------------------
+// alloc_offset
+//----------------------------------------------------------------------------
+size_t alloc_offset(ALLOC_HANDLE hAlloc, const void* p)
+{
+    alloc_allocator_t* self = (alloc_allocator_t*)hAlloc;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(self->p_map);
+
+    // Offsets count from the start of the file, so 0 stands for NULL
+    if (!p)
+        return 0;
+
+    ASSERT_TRUE((const char*)p >= self->p_pool);
+    ASSERT_TRUE((size_t)((const char*)p - self->p_pool) < self->block_size * self->blocks_max);
+
+    return (size_t)((const char*)p - (const char*)self->p_map);
+}
+
+//----------------------------------------------------------------------------
+// alloc_pointer
+//----------------------------------------------------------------------------
+void* alloc_pointer(ALLOC_HANDLE hAlloc, size_t offset)
+{
+    alloc_allocator_t* self = (alloc_allocator_t*)hAlloc;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(self->p_map);
+
+    if (!offset)
+        return NULL;
+
+    ASSERT_TRUE(offset >= ALLOC_MAP_POOL_OFFSET && offset < ALLOC_MAP_SIZE(self));
+    return (char*)self->p_map + offset;
+}
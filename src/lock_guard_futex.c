@@ -0,0 +1,173 @@
+#include "lock_guard.h"
+#include "fault.h"
+
+#if defined(LK_BACKEND_FUTEX)
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+// Lock word states
+#define LK_UNLOCKED     0
+#define LK_LOCKED       1
+#define LK_CONTENDED    2
+
+static void lk_futex_wait(UINT32* p_word, UINT32 value)
+{
+    syscall(SYS_futex, p_word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void lk_futex_wake(UINT32* p_word)
+{
+    syscall(SYS_futex, p_word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/**
+ * @brief Create Locking Object
+ *
+ * @return LOCK_HANDLE
+ */
+LOCK_HANDLE lk_create(void)
+{
+    lk_lock_t* lock = malloc(sizeof(lk_lock_t));
+    ASSERT_TRUE(lock);
+    return lk_init(lock);
+}
+
+/**
+ * @brief Destroy Locking Object
+ *
+ * @param hLock
+ */
+void lk_destroy(LOCK_HANDLE hLock)
+{
+    ASSERT_TRUE(hLock);
+    lk_deinit(hLock);
+    free(hLock);
+}
+
+/**
+ * @brief Initialize Locking Object in caller storage
+ *
+ * @param p_lock
+ * @return LOCK_HANDLE
+ */
+LOCK_HANDLE lk_init(lk_lock_t* p_lock)
+{
+    ASSERT_TRUE(p_lock);
+    p_lock->state = LK_UNLOCKED;
+    p_lock->spins = 0;
+#ifdef LK_PROFILE
+    _lk_profile_remove(p_lock);
+#endif
+    return p_lock;
+}
+
+/**
+ * @brief Release Locking Object in caller storage
+ *
+ * @param hLock
+ */
+void lk_deinit(LOCK_HANDLE hLock)
+{
+    ASSERT_TRUE(hLock);
+    ASSERT_TRUE(((lk_lock_t*)hLock)->state == LK_UNLOCKED);
+#ifdef LK_PROFILE
+    _lk_profile_remove(hLock);
+#endif
+}
+
+/**
+ * @brief Assign Lock to Locking Object
+ *
+ * A contended lock is spun on for about as long as it recently took to get
+ * it, up to LK_SPIN_MAX rounds, before the thread sleeps on the futex.
+ *
+ * @param hLock
+ */
+void lk_lock(LOCK_HANDLE hLock)
+{
+    lk_lock_t* lock = (lk_lock_t*)hLock;
+    UINT32 expected = LK_UNLOCKED;
+    UINT32 spins, max_spins, count;
+    UINT32 state;
+#ifdef LK_PROFILE
+    UINT64 wait_start;
+#endif
+
+    ASSERT_TRUE(hLock);
+
+    if (__atomic_compare_exchange_n(&lock->state, &expected, LK_LOCKED, FALSE,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+#ifdef LK_PROFILE
+        _lk_profile_acquired(lock, FALSE, 0);
+#endif
+        return;
+    }
+
+#ifdef LK_PROFILE
+    wait_start = _lk_profile_now();
+#endif
+
+    // Spin phase, watching the word without writing to it
+    spins = __atomic_load_n(&lock->spins, __ATOMIC_RELAXED);
+    max_spins = spins * 2 + 10;
+    if (max_spins > LK_SPIN_MAX)
+        max_spins = LK_SPIN_MAX;
+
+    for (count = 0; count < max_spins; count++)
+    {
+        LK_CPU_RELAX();
+        if (__atomic_load_n(&lock->state, __ATOMIC_RELAXED) != LK_UNLOCKED)
+            continue;
+
+        expected = LK_UNLOCKED;
+        if (__atomic_compare_exchange_n(&lock->state, &expected, LK_LOCKED, FALSE,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    // Move the spin estimate an eighth of the way towards this wait
+    __atomic_store_n(&lock->spins, spins + ((INT32)(count - spins)) / 8, __ATOMIC_RELAXED);
+    if (count < max_spins)
+    {
+#ifdef LK_PROFILE
+        _lk_profile_acquired(lock, TRUE, wait_start);
+#endif
+        return;
+    }
+
+    // Sleep phase. Mark the lock contended so the owner wakes a waiter.
+    state = __atomic_exchange_n(&lock->state, LK_CONTENDED, __ATOMIC_ACQUIRE);
+    while (state != LK_UNLOCKED)
+    {
+        lk_futex_wait(&lock->state, LK_CONTENDED);
+        state = __atomic_exchange_n(&lock->state, LK_CONTENDED, __ATOMIC_ACQUIRE);
+    }
+#ifdef LK_PROFILE
+    _lk_profile_acquired(lock, TRUE, wait_start);
+#endif
+}
+
+/**
+ * @brief Unlock Locking Object
+ *
+ * @param hLock
+ */
+void lk_unlock(LOCK_HANDLE hLock)
+{
+    lk_lock_t* lock = (lk_lock_t*)hLock;
+
+    ASSERT_TRUE(hLock);
+#ifdef LK_PROFILE
+    _lk_profile_released(lock);
+#endif
+
+    // Only enter the kernel when a waiter may be sleeping
+    if (__atomic_exchange_n(&lock->state, LK_UNLOCKED, __ATOMIC_RELEASE) == LK_CONTENDED)
+        lk_futex_wake(&lock->state);
+}
+
+#endif
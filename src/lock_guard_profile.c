@@ -0,0 +1,174 @@
+#include "lock_guard.h"
+#include "fault.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef LK_PROFILE
+
+// Every lock acquired so far, guarded by a mutex of its own so listing
+// does not show up in the profile
+static lk_profile_t* _lk_profiles;
+static pthread_mutex_t _lk_profiles_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Monotonic time in nanoseconds
+ *
+ * @return UINT64
+ */
+UINT64 _lk_profile_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (UINT64)ts.tv_sec * 1000000000ull + (UINT64)ts.tv_nsec;
+}
+
+/**
+ * @brief Count an acquisition. Called by the thread now holding the lock.
+ *
+ * @param p_lock
+ * @param contended - TRUE if the thread had to wait
+ * @param wait_start - time the wait started
+ */
+void _lk_profile_acquired(lk_lock_t* p_lock, BOOL contended, UINT64 wait_start)
+{
+    lk_profile_t* profile = &p_lock->profile;
+    UINT64 now = _lk_profile_now();
+
+    // Statically initialized locks join the list on first use
+    if (!profile->registered)
+    {
+        pthread_mutex_lock(&_lk_profiles_mutex);
+        profile->p_next = _lk_profiles;
+        _lk_profiles = profile;
+        profile->registered = TRUE;
+        pthread_mutex_unlock(&_lk_profiles_mutex);
+    }
+
+    __atomic_store_n(&profile->acquisitions, profile->acquisitions + 1, __ATOMIC_RELAXED);
+    if (contended)
+    {
+        __atomic_store_n(&profile->contended, profile->contended + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&profile->wait_ns, profile->wait_ns + (now - wait_start), __ATOMIC_RELAXED);
+    }
+    profile->hold_start = now;
+}
+
+/**
+ * @brief Account the hold time. Called by the thread about to release.
+ *
+ * @param p_lock
+ */
+void _lk_profile_released(lk_lock_t* p_lock)
+{
+    lk_profile_t* profile = &p_lock->profile;
+    UINT64 held = _lk_profile_now() - profile->hold_start;
+
+    if (held > profile->max_hold_ns)
+        __atomic_store_n(&profile->max_hold_ns, held, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Take a lock off the list and clear its counters
+ *
+ * Called when a lock is set up or released. A lock being set up may hold
+ * garbage and is simply not found.
+ *
+ * @param p_lock
+ */
+void _lk_profile_remove(lk_lock_t* p_lock)
+{
+    lk_profile_t** pp_profile;
+
+    pthread_mutex_lock(&_lk_profiles_mutex);
+    for (pp_profile = &_lk_profiles; *pp_profile; pp_profile = &(*pp_profile)->p_next)
+    {
+        if (*pp_profile == &p_lock->profile)
+        {
+            *pp_profile = p_lock->profile.p_next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_lk_profiles_mutex);
+
+    memset(&p_lock->profile, 0, sizeof(lk_profile_t));
+}
+
+#endif
+
+/**
+ * @brief Name a lock in the profile
+ *
+ * @param hLock
+ * @param name - kept by pointer, must outlive the lock
+ */
+void lk_name(LOCK_HANDLE hLock, const CHAR* name)
+{
+    ASSERT_TRUE(hLock);
+#ifdef LK_PROFILE
+    ((lk_lock_t*)hLock)->profile.name = name;
+#else
+    (void)name;
+#endif
+}
+
+/**
+ * @brief List the counters of every lock acquired so far
+ *
+ * Counters of a lock in use may be a few acquisitions apart from each other.
+ *
+ * @param p_stats - array receiving up to max entries, may be NULL
+ * @param max
+ * @return UINT32 - number of locks, which may be more than max
+ */
+UINT32 lk_stats(lk_stats_t* p_stats, UINT32 max)
+{
+    UINT32 count = 0;
+#ifdef LK_PROFILE
+    lk_profile_t* profile;
+    lk_stats_t* entry;
+
+    pthread_mutex_lock(&_lk_profiles_mutex);
+    for (profile = _lk_profiles; profile; profile = profile->p_next, count++)
+    {
+        if (!p_stats || count >= max)
+            continue;
+
+        entry = &p_stats[count];
+        entry->handle = (char*)profile - offsetof(lk_lock_t, profile);
+        entry->name = profile->name;
+        entry->acquisitions = __atomic_load_n(&profile->acquisitions, __ATOMIC_RELAXED);
+        entry->contended = __atomic_load_n(&profile->contended, __ATOMIC_RELAXED);
+        entry->wait_ns = __atomic_load_n(&profile->wait_ns, __ATOMIC_RELAXED);
+        entry->max_hold_ns = __atomic_load_n(&profile->max_hold_ns, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&_lk_profiles_mutex);
+#else
+    (void)p_stats;
+    (void)max;
+#endif
+    return count;
+}
+
+/**
+ * @brief Zero the counters of every lock, keeping names
+ */
+void lk_stats_reset(void)
+{
+#ifdef LK_PROFILE
+    lk_profile_t* profile;
+
+    pthread_mutex_lock(&_lk_profiles_mutex);
+    for (profile = _lk_profiles; profile; profile = profile->p_next)
+    {
+        __atomic_store_n(&profile->acquisitions, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&profile->contended, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&profile->wait_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&profile->max_hold_ns, 0, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&_lk_profiles_mutex);
+#endif
+}
@@ -1,51 +1,113 @@
 #include "lock_guard.h"
 #include "fault.h"
 
+#if !defined(LK_BACKEND_FUTEX) && !defined(LK_BACKEND_TICKET)
+
 #include <pthread.h>
 #include <stdlib.h>
 
 /**
  * @brief Create Locking Object
- * 
- * @return LOCK_HANDLE 
+ *
+ * @return LOCK_HANDLE
  */
 LOCK_HANDLE lk_create(void)
 {
-    pthread_mutex_t * lock = malloc(sizeof(pthread_mutex_t));
-    pthread_mutex_init(lock, NULL);
-    return lock;
+    lk_lock_t* lock = malloc(sizeof(lk_lock_t));
+    ASSERT_TRUE(lock);
+    return lk_init(lock);
 }
 
 /**
  * @brief Destroy Locking Object
- * 
- * @param hLock 
+ *
+ * @param hLock
  */
 void lk_destroy(LOCK_HANDLE hLock)
 {
     ASSERT_TRUE(hLock);
+    lk_deinit(hLock);
     free(hLock);
 }
 
+/**
+ * @brief Initialize Locking Object in caller storage
+ *
+ * Short critical sections spin briefly before sleeping where the C library
+ * has adaptive mutexes.
+ *
+ * @param p_lock
+ * @return LOCK_HANDLE
+ */
+LOCK_HANDLE lk_init(lk_lock_t* p_lock)
+{
+    pthread_mutexattr_t attr;
+
+    ASSERT_TRUE(p_lock);
+    pthread_mutexattr_init(&attr);
+#if defined(PTHREAD_ADAPTIVE_MUTEX_INITIALIZER_NP)
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+#endif
+    pthread_mutex_init(&p_lock->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+#ifdef LK_PROFILE
+    _lk_profile_remove(p_lock);
+#endif
+    return p_lock;
+}
+
+/**
+ * @brief Release Locking Object in caller storage
+ *
+ * @param hLock
+ */
+void lk_deinit(LOCK_HANDLE hLock)
+{
+    ASSERT_TRUE(hLock);
+#ifdef LK_PROFILE
+    _lk_profile_remove(hLock);
+#endif
+    pthread_mutex_destroy(&((lk_lock_t*)hLock)->mutex);
+}
+
 /**
  * @brief Assign Lock to Locking Object
- * 
- * @param hLock 
+ *
+ * @param hLock
  */
 void lk_lock(LOCK_HANDLE hLock)
 {
+#ifdef LK_PROFILE
+    UINT64 wait_start;
+
+    ASSERT_TRUE(hLock);
+    if (pthread_mutex_trylock(&((lk_lock_t*)hLock)->mutex) == 0)
+    {
+        _lk_profile_acquired(hLock, FALSE, 0);
+        return;
+    }
+
+    wait_start = _lk_profile_now();
+    pthread_mutex_lock(&((lk_lock_t*)hLock)->mutex);
+    _lk_profile_acquired(hLock, TRUE, wait_start);
+#else
     ASSERT_TRUE(hLock);
-    pthread_mutex_lock(hLock);
+    pthread_mutex_lock(&((lk_lock_t*)hLock)->mutex);
+#endif
 }
 
 /**
  * @brief Unlock Locking Object
- * 
- * @param hLock 
+ *
+ * @param hLock
  */
 void lk_unlock(LOCK_HANDLE hLock)
 {
     ASSERT_TRUE(hLock);
-    pthread_mutex_unlock(hLock);
+#ifdef LK_PROFILE
+    _lk_profile_released(hLock);
+#endif
+    pthread_mutex_unlock(&((lk_lock_t*)hLock)->mutex);
 }
 
+#endif
@@ -0,0 +1,129 @@
+#include "lock_guard.h"
+#include "fault.h"
+
+#if defined(LK_BACKEND_TICKET)
+
+#include <sched.h>
+#include <stdlib.h>
+
+/**
+ * @brief Create Locking Object
+ *
+ * @return LOCK_HANDLE
+ */
+LOCK_HANDLE lk_create(void)
+{
+    lk_lock_t* lock = malloc(sizeof(lk_lock_t));
+    ASSERT_TRUE(lock);
+    return lk_init(lock);
+}
+
+/**
+ * @brief Destroy Locking Object
+ *
+ * @param hLock
+ */
+void lk_destroy(LOCK_HANDLE hLock)
+{
+    ASSERT_TRUE(hLock);
+    lk_deinit(hLock);
+    free(hLock);
+}
+
+/**
+ * @brief Initialize Locking Object in caller storage
+ *
+ * @param p_lock
+ * @return LOCK_HANDLE
+ */
+LOCK_HANDLE lk_init(lk_lock_t* p_lock)
+{
+    ASSERT_TRUE(p_lock);
+    p_lock->next = 0;
+    p_lock->owner = 0;
+#ifdef LK_PROFILE
+    _lk_profile_remove(p_lock);
+#endif
+    return p_lock;
+}
+
+/**
+ * @brief Release Locking Object in caller storage
+ *
+ * @param hLock
+ */
+void lk_deinit(LOCK_HANDLE hLock)
+{
+    ASSERT_TRUE(hLock);
+    ASSERT_TRUE(((lk_lock_t*)hLock)->next == ((lk_lock_t*)hLock)->owner);
+#ifdef LK_PROFILE
+    _lk_profile_remove(hLock);
+#endif
+}
+
+/**
+ * @brief Assign Lock to Locking Object
+ *
+ * Threads take a ticket and are served in order. The next thread in line
+ * spins LK_TICKET_SPINS rounds at a time between yields of the CPU, so an
+ * owner that was preempted can run. Threads further back yield right away,
+ * as they cannot get the lock before the ones ahead of them.
+ *
+ * @param hLock
+ */
+void lk_lock(LOCK_HANDLE hLock)
+{
+    lk_lock_t* lock = (lk_lock_t*)hLock;
+    UINT32 ticket, owner, spins;
+#ifdef LK_PROFILE
+    UINT64 wait_start = 0;
+    BOOL contended = FALSE;
+#endif
+
+    ASSERT_TRUE(hLock);
+
+    ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    spins = 0;
+
+#ifdef LK_PROFILE
+    if (__atomic_load_n(&lock->owner, __ATOMIC_RELAXED) != ticket)
+    {
+        wait_start = _lk_profile_now();
+        contended = TRUE;
+    }
+#endif
+
+    while ((owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE)) != ticket)
+    {
+        if (ticket - owner > 1 || ++spins >= LK_TICKET_SPINS)
+        {
+            sched_yield();
+            spins = 0;
+        }
+        else
+        {
+            LK_CPU_RELAX();
+        }
+    }
+#ifdef LK_PROFILE
+    _lk_profile_acquired(lock, contended, wait_start);
+#endif
+}
+
+/**
+ * @brief Unlock Locking Object
+ *
+ * @param hLock
+ */
+void lk_unlock(LOCK_HANDLE hLock)
+{
+    lk_lock_t* lock = (lk_lock_t*)hLock;
+
+    ASSERT_TRUE(hLock);
+#ifdef LK_PROFILE
+    _lk_profile_released(lock);
+#endif
+    __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+#endif
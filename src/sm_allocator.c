@@ -4,9 +4,14 @@
 #include "sm_allocator.h"
 #include "x_allocator.h"
 
-// Maximum number of blocks for each size
+// Maximum number of blocks for each size. Event bursts keep one block per
+// queued event alive, so size the pools for the largest burst expected.
+#ifndef MAX_32_BLOCKS
 #define MAX_32_BLOCKS   10
+#endif
+#ifndef MAX_128_BLOCKS
 #define MAX_128_BLOCKS	5
+#endif
 
 // Define size of each block including meta data overhead
 #define BLOCK_32_SIZE     32 + XALLOC_BLOCK_META_DATA_SIZE
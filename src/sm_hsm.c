@@ -0,0 +1,187 @@
+#include "state_machine.h"
+#include "sm_timer.h"
+#include "sm_metrics.h"
+#include "fault.h"
+
+static void hsm_fill(const sm_state_machine_const_t* self_const, sm_hsm_t* hsm);
+static const sm_hsm_t* hsm_tables(const sm_state_machine_const_t* self_const);
+
+//----------------------------------------------------------------------------
+// hsm_fill
+//----------------------------------------------------------------------------
+static void hsm_fill(const sm_state_machine_const_t* self_const, sm_hsm_t* hsm)
+{
+    const sm_state_ex_t* state_map = self_const->state_map_ex;
+    UINT32 states_max = self_const->states_max;
+    BYTE chain[SM_HSM_DEPTH_MAX];
+    BYTE* path;
+    UINT32 s, a, b, d, depth;
+    BYTE parent;
+
+    ASSERT_TRUE(state_map);
+
+    // Collect each state and its ancestors, then store them root first
+    for (s = 0; s < states_max; s++)
+    {
+        depth = 0;
+        parent = (BYTE)s;
+        while (parent != SM_NO_PARENT)
+        {
+            // A parent out of range or a cycle is a broken state map
+            ASSERT_TRUE(parent < states_max);
+            ASSERT_TRUE(depth < SM_HSM_DEPTH_MAX);
+            if (parent >= states_max || depth == SM_HSM_DEPTH_MAX)
+                break;
+
+            chain[depth++] = parent;
+            parent = state_map[parent].parent;
+        }
+
+        path = hsm->p_paths + s * SM_HSM_DEPTH_MAX;
+        for (d = 0; d < depth; d++)
+            path[d] = chain[depth - 1 - d];
+        hsm->p_depth[s] = (BYTE)depth;
+    }
+
+    // The common ancestors of two states are the common start of their paths
+    for (a = 0; a < states_max; a++)
+    {
+        for (b = 0; b < states_max; b++)
+        {
+            const BYTE* path_a = hsm->p_paths + a * SM_HSM_DEPTH_MAX;
+            const BYTE* path_b = hsm->p_paths + b * SM_HSM_DEPTH_MAX;
+
+            d = 0;
+            while (d < hsm->p_depth[a] && d < hsm->p_depth[b] && path_a[d] == path_b[d])
+                d++;
+            hsm->p_lca[a * states_max + b] = (BYTE)d;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// hsm_tables
+//----------------------------------------------------------------------------
+static const sm_hsm_t* hsm_tables(const sm_state_machine_const_t* self_const)
+{
+    sm_hsm_t* hsm = self_const->p_hsm;
+    UINT32 expected = SM_HSM_EMPTY;
+
+    if (__atomic_load_n(&hsm->fill_state, __ATOMIC_ACQUIRE) == SM_HSM_READY)
+        return hsm;
+
+    // The first event of the type fills the tables defined with the state
+    // map. Threads racing on it wait the few microseconds it takes.
+    if (__atomic_compare_exchange_n(&hsm->fill_state, &expected, SM_HSM_FILLING, FALSE,
+        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+    {
+        hsm_fill(self_const, hsm);
+        __atomic_store_n(&hsm->fill_state, SM_HSM_READY, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        while (__atomic_load_n(&hsm->fill_state, __ATOMIC_ACQUIRE) != SM_HSM_READY)
+            LK_CPU_RELAX();
+    }
+
+    return hsm;
+}
+
+//----------------------------------------------------------------------------
+// _sm_hsm_lookup
+//----------------------------------------------------------------------------
+BYTE _sm_hsm_lookup(const sm_state_machine_const_t* self_const, const BYTE* transitions, BYTE state)
+{
+    const sm_hsm_t* tables;
+    const BYTE* path;
+    BYTE new_state = transitions[state];
+    UINT32 d;
+
+    if (new_state != EVENT_INHERITED)
+        return new_state;
+
+    // Only a hierarchical state map has ancestors to inherit from
+    ASSERT_TRUE(self_const->p_hsm);
+    if (!self_const->p_hsm)
+        return EVENT_IGNORED;
+
+    tables = hsm_tables(self_const);
+    path = tables->p_paths + state * SM_HSM_DEPTH_MAX;
+
+    // Take the entry of the nearest ancestor that has one of its own
+    for (d = tables->p_depth[state] - 1; d-- > 0; )
+    {
+        new_state = transitions[path[d]];
+        if (new_state != EVENT_INHERITED)
+            return new_state;
+    }
+
+    return EVENT_IGNORED;
+}
+
+//----------------------------------------------------------------------------
+// _sm_hsm_target
+//----------------------------------------------------------------------------
+BYTE _sm_hsm_target(const sm_state_machine_t* self, BYTE new_state)
+{
+    BYTE state;
+
+    if (new_state < SM_HSM_HISTORY || new_state >= SM_HSM_HISTORY + SM_HSM_STATES_MAX)
+        return new_state;
+
+    // History is kept as the last active substate plus one, zero if none
+    state = new_state & ~SM_HSM_HISTORY;
+    if (self->p_history && self->p_history[state])
+        return self->p_history[state] - 1;
+
+    return state;
+}
+
+//----------------------------------------------------------------------------
+// _sm_hsm_transition
+//----------------------------------------------------------------------------
+void _sm_hsm_transition(sm_state_machine_t* self, const sm_state_machine_const_t* self_const, void* p_event_data)
+{
+    const sm_hsm_t* tables = hsm_tables(self_const);
+    const sm_state_ex_t* state_map = self_const->state_map_ex;
+    BYTE from = self->current_state;
+    BYTE to = self->new_state;
+    const BYTE* path_from = tables->p_paths + from * SM_HSM_DEPTH_MAX;
+    const BYTE* path_to = tables->p_paths + to * SM_HSM_DEPTH_MAX;
+    UINT32 lca = tables->p_lca[from * self_const->states_max + to];
+    UINT32 d;
+    BYTE state;
+
+    // Exit the current state and its ancestors below the common ancestor,
+    // innermost first, noting where each ancestor was left for history
+    for (d = tables->p_depth[from]; d-- > lca; )
+    {
+        state = path_from[d];
+        if (state_map[state].p_exit_func != NULL)
+        {
+            SM_METRICS_START(exit_start);
+            state_map[state].p_exit_func(self);
+            SM_METRICS_RECORD(self_const->p_metrics, SM_METRICS_EXIT, state, exit_start);
+        }
+
+        if (self->p_history)
+            self->p_history[state] = from + 1;
+    }
+
+    // Cancel the timers bound to the state being exited
+    if (self->p_state_timers)
+        _sm_timer_cancel_state(self);
+
+    // Enter the ancestors of the new state below the common ancestor and
+    // the new state itself, outermost first
+    for (d = lca; d < tables->p_depth[to]; d++)
+    {
+        state = path_to[d];
+        if (state_map[state].p_entry_func != NULL)
+        {
+            SM_METRICS_START(entry_start);
+            state_map[state].p_entry_func(self, p_event_data);
+            SM_METRICS_RECORD(self_const->p_metrics, SM_METRICS_ENTRY, state, entry_start);
+        }
+    }
+}
@@ -0,0 +1,687 @@
+#include "sm_journal.h"
+#include "sm_trace.h"
+#include "fault.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Records start on 8 byte boundaries
+#define RECORD_ALIGN(_len_)     (((_len_) + 7) & ~(size_t)7)
+
+// A burst of replayed events for one instance
+typedef struct
+{
+    sm_state_machine_t* p_machine;
+    sm_batch_event_t events[SM_JOURNAL_REPLAY_BURST];
+    UINT count;
+} journal_burst_t;
+
+// The journal whose lock the calling thread holds while dispatching an
+// event, so state actions journaling further events do not take it again
+static SM_THREAD_LOCAL sm_journal_t* _sm_journal_dispatching;
+
+static void journal_segment_path(const sm_journal_t* journal, UINT32 segment, char* p_path);
+static BOOL journal_find_segments(const sm_journal_t* journal, UINT32* p_first, UINT32* p_last);
+static BYTE* journal_map(const char* path, size_t* p_size, BOOL writable);
+static BOOL journal_start_segment(sm_journal_t* journal, UINT32 segment, UINT64 first_sequence);
+static void journal_commit(sm_journal_t* journal);
+static UINT32 journal_checksum(const sm_journal_record_t* record, const BYTE* p_data);
+static BOOL journal_next(const BYTE* p_segment, size_t end, size_t* p_offset, sm_journal_record_t* record, const BYTE** pp_data);
+static size_t journal_scan(const BYTE* p_segment, size_t size, UINT64* p_sequence);
+static UINT16 journal_lookup(const UINT16* slots, UINT32 slot_count, const void* const* table, const void* key);
+static UINT16 journal_insert(UINT16* slots, UINT32 slot_count, const void** table, UINT32* p_count, UINT32 max, const void* key);
+static void journal_burst_flush(journal_burst_t* burst);
+static BOOL journal_lock(sm_journal_t* journal);
+static void journal_unlock(sm_journal_t* journal, BOOL locked);
+
+//----------------------------------------------------------------------------
+// journal_segment_path
+//----------------------------------------------------------------------------
+static void journal_segment_path(const sm_journal_t* journal, UINT32 segment, char* p_path)
+{
+    snprintf(p_path, SM_JOURNAL_PATH_MAX + 16, "%s.%08u.log", journal->path, segment);
+}
+
+//----------------------------------------------------------------------------
+// journal_find_segments
+//----------------------------------------------------------------------------
+static BOOL journal_find_segments(const sm_journal_t* journal, UINT32* p_first, UINT32* p_last)
+{
+    char directory[SM_JOURNAL_PATH_MAX];
+    const char* base;
+    const char* slash;
+    struct dirent* p_entry;
+    size_t base_len;
+    BOOL found = FALSE;
+    unsigned segment;
+    char tail[8];
+    DIR* p_dir;
+
+    // Split the path into the directory and the segment file prefix
+    slash = strrchr(journal->path, '/');
+    if (slash)
+    {
+        memcpy(directory, journal->path, (size_t)(slash - journal->path));
+        directory[slash - journal->path] = '\0';
+        if (!directory[0])
+            strcpy(directory, "/");
+        base = slash + 1;
+    }
+    else
+    {
+        strcpy(directory, ".");
+        base = journal->path;
+    }
+    base_len = strlen(base);
+
+    p_dir = opendir(directory);
+    if (!p_dir)
+        return FALSE;
+
+    while ((p_entry = readdir(p_dir)) != NULL)
+    {
+        if (strncmp(p_entry->d_name, base, base_len) != 0 || p_entry->d_name[base_len] != '.')
+            continue;
+        if (sscanf(p_entry->d_name + base_len, ".%8u.%7s", &segment, tail) != 2 || strcmp(tail, "log") != 0)
+            continue;
+
+        if (!found || segment < *p_first)
+            *p_first = segment;
+        if (!found || segment > *p_last)
+            *p_last = segment;
+        found = TRUE;
+    }
+
+    closedir(p_dir);
+    return found;
+}
+
+//----------------------------------------------------------------------------
+// journal_map
+//----------------------------------------------------------------------------
+static BYTE* journal_map(const char* path, size_t* p_size, BOOL writable)
+{
+    struct stat info;
+    void* p_map;
+    int fd;
+
+    fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(sm_journal_segment_t))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    p_map = mmap(NULL, (size_t)info.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+        writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p_map == MAP_FAILED)
+        return NULL;
+
+    *p_size = (size_t)info.st_size;
+    return (BYTE*)p_map;
+}
+
+//----------------------------------------------------------------------------
+// journal_start_segment
+//----------------------------------------------------------------------------
+static BOOL journal_start_segment(sm_journal_t* journal, UINT32 segment, UINT64 first_sequence)
+{
+    char path[SM_JOURNAL_PATH_MAX + 16];
+    sm_journal_segment_t header;
+    void* p_map;
+    int fd;
+
+    journal_segment_path(journal, segment, path);
+
+    // A new file reads as zeroes, which ends the segment
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return FALSE;
+    if (ftruncate(fd, (off_t)journal->segment_size) != 0)
+    {
+        close(fd);
+        return FALSE;
+    }
+    p_map = mmap(NULL, journal->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p_map == MAP_FAILED)
+        return FALSE;
+
+    header.magic = SM_JOURNAL_MAGIC;
+    header.version = SM_JOURNAL_VERSION;
+    header.first_sequence = first_sequence;
+    memcpy(p_map, &header, sizeof(header));
+
+    journal->segment = segment;
+    journal->p_segment = (BYTE*)p_map;
+    journal->mapped_size = journal->segment_size;
+    journal->offset = sizeof(header);
+    journal->synced_offset = 0;
+
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// journal_commit
+//----------------------------------------------------------------------------
+static void journal_commit(sm_journal_t* journal)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start;
+
+    if (!journal->p_segment || journal->synced_offset == journal->offset)
+        return;
+
+    // One msync covers every record appended since the last commit
+    start = journal->synced_offset & ~(page - 1);
+    msync(journal->p_segment + start, journal->offset - start, MS_SYNC);
+
+    journal->synced_offset = journal->offset;
+    journal->synced_sequence = journal->sequence;
+    journal->pending = 0;
+}
+
+//----------------------------------------------------------------------------
+// journal_checksum
+//----------------------------------------------------------------------------
+static UINT32 journal_checksum(const sm_journal_record_t* record, const BYTE* p_data)
+{
+    sm_journal_record_t header = *record;
+    const BYTE* p_byte = (const BYTE*)&header;
+    UINT32 hash = 2166136261u;
+    size_t i;
+
+    header.checksum = 0;
+
+    // FNV-1a over the record header and its data
+    for (i = 0; i < sizeof(header); i++)
+        hash = (hash ^ p_byte[i]) * 16777619u;
+    for (i = 0; i < record->length; i++)
+        hash = (hash ^ p_data[i]) * 16777619u;
+
+    return hash;
+}
+
+//----------------------------------------------------------------------------
+// journal_next
+//----------------------------------------------------------------------------
+static BOOL journal_next(const BYTE* p_segment, size_t end, size_t* p_offset, sm_journal_record_t* record, const BYTE** pp_data)
+{
+    size_t offset = *p_offset;
+
+    if (offset >= end || end - offset < sizeof(sm_journal_record_t))
+        return FALSE;
+
+    memcpy(record, p_segment + offset, sizeof(sm_journal_record_t));
+    offset += sizeof(sm_journal_record_t);
+
+    // The end of the segment, or a record torn by a crash
+    if (record->sequence == 0 || end - offset < record->length)
+        return FALSE;
+    if (record->checksum != journal_checksum(record, p_segment + offset))
+        return FALSE;
+
+    *pp_data = p_segment + offset;
+    *p_offset = offset + RECORD_ALIGN(record->length);
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// journal_scan
+//----------------------------------------------------------------------------
+static size_t journal_scan(const BYTE* p_segment, size_t size, UINT64* p_sequence)
+{
+    sm_journal_segment_t header;
+    sm_journal_record_t record;
+    const BYTE* p_data;
+    size_t offset = sizeof(header);
+
+    memcpy(&header, p_segment, sizeof(header));
+    *p_sequence = header.first_sequence - 1;
+
+    while (journal_next(p_segment, size, &offset, &record, &p_data))
+        *p_sequence = record.sequence;
+
+    return offset;
+}
+
+//----------------------------------------------------------------------------
+// journal_lookup
+//----------------------------------------------------------------------------
+static UINT16 journal_lookup(const UINT16* slots, UINT32 slot_count, const void* const* table, const void* key)
+{
+    UINT32 slot = (UINT32)(((size_t)key >> 4) * 2654435761u) % slot_count;
+
+    // Slots hold id + 1, zero ends the probe sequence
+    while (slots[slot])
+    {
+        if (table[slots[slot] - 1] == key)
+            return (UINT16)(slots[slot] - 1);
+        if (++slot == slot_count)
+            slot = 0;
+    }
+
+    return SM_JOURNAL_INVALID_ID;
+}
+
+//----------------------------------------------------------------------------
+// journal_insert
+//----------------------------------------------------------------------------
+static UINT16 journal_insert(UINT16* slots, UINT32 slot_count, const void** table, UINT32* p_count, UINT32 max, const void* key)
+{
+    UINT16 id = journal_lookup(slots, slot_count, table, key);
+    UINT32 slot;
+
+    if (id != SM_JOURNAL_INVALID_ID)
+        return id;
+
+    ASSERT_TRUE(*p_count < max);
+    if (*p_count >= max)
+        return SM_JOURNAL_INVALID_ID;
+
+    id = (UINT16)(*p_count)++;
+    table[id] = key;
+
+    slot = (UINT32)(((size_t)key >> 4) * 2654435761u) % slot_count;
+    while (slots[slot])
+    {
+        if (++slot == slot_count)
+            slot = 0;
+    }
+    slots[slot] = (UINT16)(id + 1);
+
+    return id;
+}
+
+//----------------------------------------------------------------------------
+// journal_burst_flush
+//----------------------------------------------------------------------------
+static void journal_burst_flush(journal_burst_t* burst)
+{
+    if (burst->count)
+        _sm_event_batch(burst->p_machine, burst->events, burst->count);
+    burst->count = 0;
+}
+
+//----------------------------------------------------------------------------
+// journal_lock
+//----------------------------------------------------------------------------
+static BOOL journal_lock(sm_journal_t* journal)
+{
+    if (_sm_journal_dispatching == journal)
+        return FALSE;
+
+    lk_lock(journal->lock);
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// journal_unlock
+//----------------------------------------------------------------------------
+static void journal_unlock(sm_journal_t* journal, BOOL locked)
+{
+    if (locked)
+        lk_unlock(journal->lock);
+}
+
+//----------------------------------------------------------------------------
+// sm_journal_open
+//----------------------------------------------------------------------------
+BOOL sm_journal_open(sm_journal_t* journal, const char* path, size_t segment_size, UINT32 group_size)
+{
+    char segment_path[SM_JOURNAL_PATH_MAX + 16];
+    UINT32 first = 0, last = 0;
+
+    ASSERT_TRUE(journal);
+    ASSERT_TRUE(path && strlen(path) < SM_JOURNAL_PATH_MAX);
+    ASSERT_TRUE(segment_size > sizeof(sm_journal_segment_t) + sizeof(sm_journal_record_t));
+
+    memset(journal, 0, sizeof(*journal));
+    strcpy(journal->path, path);
+    journal->segment_size = segment_size;
+    journal->group_size = group_size ? group_size : 1;
+
+    if (!journal_find_segments(journal, &first, &last))
+    {
+        // A new journal starts at sequence 1
+        if (!journal_start_segment(journal, 0, 1))
+            return FALSE;
+    }
+    else
+    {
+        // Continue after the last intact record of the newest segment
+        journal_segment_path(journal, last, segment_path);
+        journal->p_segment = journal_map(segment_path, &journal->mapped_size, TRUE);
+        if (!journal->p_segment)
+            return FALSE;
+
+        journal->first_segment = first;
+        journal->segment = last;
+        journal->offset = journal_scan(journal->p_segment, journal->mapped_size, &journal->sequence);
+        journal->synced_offset = journal->offset;
+        journal->synced_sequence = journal->sequence;
+
+        // Clear a torn record so it does not hide the ones appended after it
+        if (journal->mapped_size - journal->offset >= sizeof(sm_journal_record_t))
+            memset(journal->p_segment + journal->offset, 0, sizeof(sm_journal_record_t));
+    }
+
+    journal->lock = lk_create();
+    lk_name(journal->lock, "sm_journal");
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// sm_journal_close
+//----------------------------------------------------------------------------
+void sm_journal_close(sm_journal_t* journal)
+{
+    ASSERT_TRUE(journal);
+
+    if (journal->p_segment)
+    {
+        journal_commit(journal);
+        munmap(journal->p_segment, journal->mapped_size);
+        journal->p_segment = NULL;
+    }
+
+    if (journal->lock)
+        lk_destroy(journal->lock);
+    journal->lock = NULL;
+}
+
+//----------------------------------------------------------------------------
+// sm_journal_sync
+//----------------------------------------------------------------------------
+UINT64 sm_journal_sync(sm_journal_t* journal)
+{
+    UINT64 synced;
+    BOOL locked;
+
+    ASSERT_TRUE(journal);
+
+    locked = journal_lock(journal);
+    journal_commit(journal);
+    synced = journal->synced_sequence;
+    journal_unlock(journal, locked);
+
+    return synced;
+}
+
+//----------------------------------------------------------------------------
+// sm_journal_sequence
+//----------------------------------------------------------------------------
+UINT64 sm_journal_sequence(sm_journal_t* journal)
+{
+    UINT64 sequence;
+    BOOL locked;
+
+    ASSERT_TRUE(journal);
+
+    locked = journal_lock(journal);
+    sequence = journal->sequence;
+    journal_unlock(journal, locked);
+
+    return sequence;
+}
+
+//----------------------------------------------------------------------------
+// sm_journal_replay
+//----------------------------------------------------------------------------
+UINT64 sm_journal_replay(sm_journal_t* journal, UINT64 after_sequence)
+{
+    char path[SM_JOURNAL_PATH_MAX + 16];
+    sm_journal_record_t record;
+    journal_burst_t burst;
+    sm_state_machine_t* machine;
+    const BYTE* p_segment;
+    const BYTE* p_data;
+    void* p_event_data;
+    UINT64 replayed = 0;
+    size_t offset, end;
+    UINT32 segment;
+    BOOL tracing;
+    BOOL stopped = FALSE;
+
+    ASSERT_TRUE(journal);
+
+    burst.p_machine = NULL;
+    burst.count = 0;
+
+    // Recovery runs at full speed without filling the trace rings
+    tracing = sm_trace_thread_enable(FALSE);
+
+    for (segment = journal->first_segment; segment <= journal->segment && !stopped; segment++)
+    {
+        if (segment == journal->segment)
+        {
+            p_segment = journal->p_segment;
+            end = journal->offset;
+        }
+        else
+        {
+            journal_segment_path(journal, segment, path);
+            p_segment = journal_map(path, &end, FALSE);
+            if (!p_segment)
+                continue;
+        }
+
+        offset = sizeof(sm_journal_segment_t);
+        while (journal_next(p_segment, end, &offset, &record, &p_data))
+        {
+            if (record.sequence <= after_sequence)
+                continue;
+
+            ASSERT_TRUE(record.machine < journal->machine_count);
+            ASSERT_TRUE(record.event < journal->event_count);
+            if (record.machine >= journal->machine_count || record.event >= journal->event_count)
+                continue;
+
+            p_event_data = NULL;
+            if (record.length)
+            {
+                p_event_data = sm_xalloc(record.length);
+                if (!p_event_data)
+                {
+                    // Skipping a record would replay the rest out of order,
+                    // stop here and report the records applied so far
+                    ASSERT();
+                    stopped = TRUE;
+                    break;
+                }
+                memcpy(p_event_data, p_data, record.length);
+            }
+
+            // Consecutive events of one instance run as one burst
+            machine = journal->machines[record.machine];
+            if (burst.p_machine != machine || burst.count == SM_JOURNAL_REPLAY_BURST)
+            {
+                journal_burst_flush(&burst);
+                burst.p_machine = machine;
+            }
+            burst.events[burst.count].p_event_func = journal->events[record.event]->p_event_func;
+            burst.events[burst.count].p_event_data = p_event_data;
+            burst.count++;
+
+            replayed++;
+        }
+
+        journal_burst_flush(&burst);
+
+        if (segment != journal->segment)
+            munmap((void*)p_segment, end);
+    }
+
+    sm_trace_thread_enable(tracing);
+    return replayed;
+}
+
+//----------------------------------------------------------------------------
+// sm_journal_trim
+//----------------------------------------------------------------------------
+UINT32 sm_journal_trim(sm_journal_t* journal, UINT64 sequence)
+{
+    char path[SM_JOURNAL_PATH_MAX + 16];
+    sm_journal_segment_t next;
+    UINT32 removed = 0;
+    int fd;
+    BOOL locked;
+
+    ASSERT_TRUE(journal);
+
+    locked = journal_lock(journal);
+
+    // A segment can go once the next one starts at or before the sequence
+    // after the trim point. The segment being appended to always stays.
+    while (journal->first_segment < journal->segment)
+    {
+        journal_segment_path(journal, journal->first_segment + 1, path);
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+            break;
+        if (pread(fd, &next, sizeof(next), 0) != (ssize_t)sizeof(next))
+        {
+            close(fd);
+            break;
+        }
+        close(fd);
+
+        if (next.first_sequence > sequence + 1)
+            break;
+
+        journal_segment_path(journal, journal->first_segment, path);
+        unlink(path);
+        journal->first_segment++;
+        removed++;
+    }
+
+    journal_unlock(journal, locked);
+    return removed;
+}
+
+//----------------------------------------------------------------------------
+// _sm_journal_register
+//----------------------------------------------------------------------------
+UINT16 _sm_journal_register(sm_journal_t* journal, sm_state_machine_t* self)
+{
+    UINT16 id;
+    BOOL locked;
+
+    ASSERT_TRUE(journal);
+    ASSERT_TRUE(self);
+
+    locked = journal_lock(journal);
+    id = journal_insert(journal->machine_slots, SM_JOURNAL_MACHINES_MAX * 2, (const void**)journal->machines,
+        &journal->machine_count, SM_JOURNAL_MACHINES_MAX, self);
+    journal_unlock(journal, locked);
+
+    return id;
+}
+
+//----------------------------------------------------------------------------
+// _sm_journal_register_event
+//----------------------------------------------------------------------------
+UINT16 _sm_journal_register_event(sm_journal_t* journal, const sm_event_desc_t* desc)
+{
+    UINT16 id;
+    BOOL locked;
+
+    ASSERT_TRUE(journal);
+    ASSERT_TRUE(desc);
+
+    locked = journal_lock(journal);
+    id = journal_insert(journal->event_slots, SM_JOURNAL_EVENTS_MAX * 2, (const void**)journal->events,
+        &journal->event_count, SM_JOURNAL_EVENTS_MAX, desc);
+    journal_unlock(journal, locked);
+
+    return id;
+}
+
+//----------------------------------------------------------------------------
+// _sm_journal_event
+//----------------------------------------------------------------------------
+BOOL _sm_journal_event(sm_journal_t* journal, sm_state_machine_t* self, const sm_event_desc_t* desc, void* p_event_data, size_t size)
+{
+    sm_journal_record_t record;
+    size_t needed;
+    UINT16 machine, event;
+    sm_journal_t* p_outer;
+    BOOL logged = FALSE;
+    BOOL locked;
+
+    ASSERT_TRUE(journal);
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(desc);
+    ASSERT_TRUE(p_event_data || !size);
+
+    needed = sizeof(record) + RECORD_ALIGN(size);
+
+    locked = journal_lock(journal);
+
+    machine = journal_lookup(journal->machine_slots, SM_JOURNAL_MACHINES_MAX * 2, (const void* const*)journal->machines, self);
+    event = journal_lookup(journal->event_slots, SM_JOURNAL_EVENTS_MAX * 2, (const void* const*)journal->events, desc);
+    ASSERT_TRUE(machine != SM_JOURNAL_INVALID_ID && event != SM_JOURNAL_INVALID_ID);
+    ASSERT_TRUE(sizeof(sm_journal_segment_t) + needed <= journal->segment_size);
+
+    if (machine != SM_JOURNAL_INVALID_ID && event != SM_JOURNAL_INVALID_ID &&
+        sizeof(sm_journal_segment_t) + needed <= journal->segment_size)
+    {
+        // Move on to a new segment when the record does not fit
+        if (!journal->p_segment || journal->mapped_size - journal->offset < needed)
+        {
+            if (journal->p_segment)
+            {
+                journal_commit(journal);
+                munmap(journal->p_segment, journal->mapped_size);
+                journal->p_segment = NULL;
+            }
+            if (!journal_start_segment(journal, journal->segment + 1, journal->sequence + 1))
+                ASSERT();
+        }
+
+        if (journal->p_segment)
+        {
+            record.length = (UINT32)size;
+            record.sequence = journal->sequence + 1;
+            record.machine = machine;
+            record.event = event;
+            record.reserved = 0;
+            record.checksum = journal_checksum(&record, (const BYTE*)p_event_data);
+
+            // Data first, the header makes the record visible to a scan
+            if (size)
+                memcpy(journal->p_segment + journal->offset + sizeof(record), p_event_data, size);
+            memcpy(journal->p_segment + journal->offset, &record, sizeof(record));
+
+            journal->offset += needed;
+            journal->sequence++;
+            logged = TRUE;
+
+            if (++journal->pending >= journal->group_size)
+                journal_commit(journal);
+        }
+    }
+
+    // Write ahead: the event runs once its record is in the log. It runs
+    // under the journal lock, so events reach the instances in log order.
+    if (logged)
+    {
+        p_outer = _sm_journal_dispatching;
+        _sm_journal_dispatching = journal;
+        desc->p_event_func(self, p_event_data);
+        _sm_journal_dispatching = p_outer;
+    }
+
+    journal_unlock(journal, locked);
+
+    return logged;
+}
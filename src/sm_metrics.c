@@ -0,0 +1,326 @@
+#include "sm_metrics.h"
+#include "fault.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Longest latency kept apart, anything longer lands in the last bucket
+#define MAX_TRACKED_BITS    40
+
+// Output buffer of an export, counts the bytes needed past its end
+typedef struct
+{
+    char* p_buffer;
+    size_t size;
+    size_t len;
+} metrics_out_t;
+
+static const char* const kind_names[SM_METRICS_KINDS] = {
+    "action", "guard", "entry", "exit", "event"
+};
+
+static const double export_percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+#define EXPORT_PERCENTILES  (sizeof(export_percentiles) / sizeof(export_percentiles[0]))
+
+// Every type recorded so far
+static sm_metrics_type_t* _sm_metrics_types;
+
+static UINT32 metrics_bucket(UINT64 value_ns);
+static UINT64 metrics_bucket_upper(UINT32 bucket);
+static sm_histogram_t* metrics_histograms(sm_metrics_type_t* type);
+static void metrics_print(metrics_out_t* out, const char* format, ...);
+static void metrics_snapshot(const sm_histogram_t* histogram, sm_histogram_t* p_snapshot);
+static void metrics_export_json(metrics_out_t* out);
+static void metrics_export_prometheus(metrics_out_t* out);
+
+//----------------------------------------------------------------------------
+// metrics_bucket
+//----------------------------------------------------------------------------
+static UINT32 metrics_bucket(UINT64 value_ns)
+{
+    UINT32 msb;
+    UINT32 shift;
+
+    if (value_ns < SM_METRICS_SUB_BUCKETS)
+        return (UINT32)value_ns;
+    if (value_ns >> MAX_TRACKED_BITS)
+        return SM_METRICS_BUCKETS - 1;
+
+    // The top bits below the leading one select the sub-bucket
+    msb = 63 - __builtin_clzll(value_ns);
+    shift = msb - 3;
+    return (shift + 1) * SM_METRICS_SUB_BUCKETS + (UINT32)((value_ns >> shift) & (SM_METRICS_SUB_BUCKETS - 1));
+}
+
+//----------------------------------------------------------------------------
+// metrics_bucket_upper
+//----------------------------------------------------------------------------
+static UINT64 metrics_bucket_upper(UINT32 bucket)
+{
+    UINT32 shift;
+    UINT64 lower;
+
+    if (bucket < SM_METRICS_SUB_BUCKETS)
+        return bucket;
+
+    shift = bucket / SM_METRICS_SUB_BUCKETS - 1;
+    lower = (UINT64)(SM_METRICS_SUB_BUCKETS + bucket % SM_METRICS_SUB_BUCKETS) << shift;
+    return lower + ((UINT64)1 << shift) - 1;
+}
+
+//----------------------------------------------------------------------------
+// metrics_histograms
+//----------------------------------------------------------------------------
+static sm_histogram_t* metrics_histograms(sm_metrics_type_t* type)
+{
+    sm_histogram_t* histograms;
+    sm_histogram_t* expected = NULL;
+
+    histograms = __atomic_load_n(&type->p_histograms, __ATOMIC_ACQUIRE);
+    if (histograms)
+        return histograms;
+
+    histograms = calloc((size_t)type->states_max * SM_METRICS_KINDS, sizeof(sm_histogram_t));
+    if (!histograms)
+        return NULL;
+
+    // Another thread may have won the race to allocate
+    if (!__atomic_compare_exchange_n(&type->p_histograms, &expected, histograms, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        free(histograms);
+        return expected;
+    }
+
+    // The winner makes the type visible to exports
+    type->p_next = __atomic_load_n(&_sm_metrics_types, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&_sm_metrics_types, &type->p_next, type, FALSE, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    return histograms;
+}
+
+//----------------------------------------------------------------------------
+// metrics_print
+//----------------------------------------------------------------------------
+static void metrics_print(metrics_out_t* out, const char* format, ...)
+{
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = vsnprintf(out->len < out->size ? out->p_buffer + out->len : NULL,
+        out->len < out->size ? out->size - out->len : 0, format, args);
+    va_end(args);
+
+    if (len > 0)
+        out->len += (size_t)len;
+}
+
+//----------------------------------------------------------------------------
+// metrics_snapshot
+//----------------------------------------------------------------------------
+static void metrics_snapshot(const sm_histogram_t* histogram, sm_histogram_t* p_snapshot)
+{
+    UINT32 i;
+
+    // Buckets are read one by one while recording goes on, the total is
+    // taken from the same reads to keep percentiles consistent
+    p_snapshot->count = 0;
+    for (i = 0; i < SM_METRICS_BUCKETS; i++)
+    {
+        p_snapshot->buckets[i] = __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+        p_snapshot->count += p_snapshot->buckets[i];
+    }
+    p_snapshot->sum_ns = __atomic_load_n(&histogram->sum_ns, __ATOMIC_RELAXED);
+    p_snapshot->max_ns = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+}
+
+//----------------------------------------------------------------------------
+// metrics_export_json
+//----------------------------------------------------------------------------
+static void metrics_export_json(metrics_out_t* out)
+{
+    const sm_metrics_type_t* type;
+    sm_histogram_t snapshot;
+    BOOL first_type = TRUE;
+    BOOL first;
+    UINT32 state, kind, i;
+
+    metrics_print(out, "{\"machines\":[");
+
+    for (type = __atomic_load_n(&_sm_metrics_types, __ATOMIC_ACQUIRE); type; type = type->p_next)
+    {
+        metrics_print(out, "%s{\"name\":\"%s\",\"histograms\":[", first_type ? "" : ",", type->name);
+        first_type = FALSE;
+        first = TRUE;
+
+        for (state = 0; state < type->states_max; state++)
+        {
+            for (kind = 0; kind < SM_METRICS_KINDS; kind++)
+            {
+                if (!sm_metrics_histogram(type, (BYTE)kind, (BYTE)state, &snapshot) || !snapshot.count)
+                    continue;
+
+                metrics_print(out, "%s{\"state\":%u,\"kind\":\"%s\",\"count\":%llu,\"sum_ns\":%llu,\"max_ns\":%llu",
+                    first ? "" : ",", state, kind_names[kind], snapshot.count, snapshot.sum_ns, snapshot.max_ns);
+                for (i = 0; i < EXPORT_PERCENTILES; i++)
+                    metrics_print(out, ",\"p%g_ns\":%llu", export_percentiles[i],
+                        sm_metrics_percentile(&snapshot, export_percentiles[i]));
+                metrics_print(out, "}");
+                first = FALSE;
+            }
+        }
+
+        metrics_print(out, "]}");
+    }
+
+    metrics_print(out, "]}\n");
+}
+
+//----------------------------------------------------------------------------
+// metrics_export_prometheus
+//----------------------------------------------------------------------------
+static void metrics_export_prometheus(metrics_out_t* out)
+{
+    const sm_metrics_type_t* type;
+    sm_histogram_t snapshot;
+    UINT32 state, kind, i;
+
+    metrics_print(out, "# HELP machina_latency_seconds Time spent in state machine functions.\n");
+    metrics_print(out, "# TYPE machina_latency_seconds summary\n");
+
+    for (type = __atomic_load_n(&_sm_metrics_types, __ATOMIC_ACQUIRE); type; type = type->p_next)
+    {
+        for (state = 0; state < type->states_max; state++)
+        {
+            for (kind = 0; kind < SM_METRICS_KINDS; kind++)
+            {
+                if (!sm_metrics_histogram(type, (BYTE)kind, (BYTE)state, &snapshot) || !snapshot.count)
+                    continue;
+
+                for (i = 0; i < EXPORT_PERCENTILES; i++)
+                    metrics_print(out, "machina_latency_seconds{machine=\"%s\",state=\"%u\",kind=\"%s\",quantile=\"%g\"} %.9f\n",
+                        type->name, state, kind_names[kind], export_percentiles[i] / 100.0,
+                        (double)sm_metrics_percentile(&snapshot, export_percentiles[i]) / 1e9);
+                metrics_print(out, "machina_latency_seconds_sum{machine=\"%s\",state=\"%u\",kind=\"%s\"} %.9f\n",
+                    type->name, state, kind_names[kind], (double)snapshot.sum_ns / 1e9);
+                metrics_print(out, "machina_latency_seconds_count{machine=\"%s\",state=\"%u\",kind=\"%s\"} %llu\n",
+                    type->name, state, kind_names[kind], snapshot.count);
+            }
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// _sm_metrics_now
+//----------------------------------------------------------------------------
+UINT64 _sm_metrics_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (UINT64)now.tv_sec * 1000000000ULL + (UINT64)now.tv_nsec;
+}
+
+//----------------------------------------------------------------------------
+// _sm_metrics_record
+//----------------------------------------------------------------------------
+void _sm_metrics_record(sm_metrics_type_t* type, BYTE kind, BYTE state, UINT64 elapsed_ns)
+{
+    sm_histogram_t* histogram;
+    UINT64 max_ns;
+
+    // Types compiled without SM_METRICS and ignored events are not kept
+    if (!type || state >= type->states_max || kind >= SM_METRICS_KINDS)
+        return;
+
+    histogram = metrics_histograms(type);
+    if (!histogram)
+        return;
+    histogram += (size_t)state * SM_METRICS_KINDS + kind;
+
+    // The count is summed from the buckets on snapshot
+    __atomic_fetch_add(&histogram->buckets[metrics_bucket(elapsed_ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum_ns, elapsed_ns, __ATOMIC_RELAXED);
+
+    max_ns = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    while (elapsed_ns > max_ns &&
+        !__atomic_compare_exchange_n(&histogram->max_ns, &max_ns, elapsed_ns, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+//----------------------------------------------------------------------------
+// sm_metrics_histogram
+//----------------------------------------------------------------------------
+BOOL sm_metrics_histogram(const sm_metrics_type_t* type, BYTE kind, BYTE state, sm_histogram_t* p_histogram)
+{
+    const sm_histogram_t* histograms;
+
+    ASSERT_TRUE(p_histogram);
+
+    if (!type || state >= type->states_max || kind >= SM_METRICS_KINDS)
+        return FALSE;
+
+    histograms = __atomic_load_n(&type->p_histograms, __ATOMIC_ACQUIRE);
+    if (!histograms)
+        return FALSE;
+
+    metrics_snapshot(&histograms[(size_t)state * SM_METRICS_KINDS + kind], p_histogram);
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// sm_metrics_percentile
+//----------------------------------------------------------------------------
+UINT64 sm_metrics_percentile(const sm_histogram_t* histogram, double percentile)
+{
+    UINT64 rank;
+    UINT64 seen = 0;
+    UINT32 i;
+
+    ASSERT_TRUE(histogram);
+
+    if (!histogram->count)
+        return 0;
+
+    rank = (UINT64)(percentile / 100.0 * (double)histogram->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    // Report the upper edge of the bucket, never above the largest value
+    for (i = 0; i < SM_METRICS_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+        {
+            UINT64 upper = metrics_bucket_upper(i);
+            return upper < histogram->max_ns ? upper : histogram->max_ns;
+        }
+    }
+
+    return histogram->max_ns;
+}
+
+//----------------------------------------------------------------------------
+// sm_metrics_export
+//----------------------------------------------------------------------------
+size_t sm_metrics_export(char* buffer, size_t size, BYTE format)
+{
+    metrics_out_t out;
+
+    ASSERT_TRUE(buffer || !size);
+
+    out.p_buffer = buffer;
+    out.size = size;
+    out.len = 0;
+
+    if (format == SM_METRICS_PROMETHEUS)
+        metrics_export_prometheus(&out);
+    else
+        metrics_export_json(&out);
+
+    // Like snprintf, the length needed is returned even when truncated
+    return out.len;
+}
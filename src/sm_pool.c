@@ -0,0 +1,319 @@
+#include "sm_pool.h"
+#include "fault.h"
+#include <string.h>
+
+// The SSSE3 translation is compiled for any x86 target and picked at run
+// time, so default builds use it on every CPU that has it
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #include <tmmintrin.h>
+    #define SM_POOL_SSSE3
+    #if defined(__SSSE3__)
+        #define SM_POOL_HAS_SSSE3()     TRUE
+    #else
+        #define SM_POOL_HAS_SSSE3()     __builtin_cpu_supports("ssse3")
+    #endif
+#endif
+
+// Get a pointer to the free-list link stored in a free slot
+#define SLOT_LINK(_pool_, _handle_) \
+    ((UINT32*)sm_pool_instance(_pool_, _handle_))
+
+static void pool_next_states(const BYTE* lookup, BYTE states_max, const BYTE* states, BYTE* next, UINT32 count);
+#ifdef SM_POOL_SSSE3
+static UINT32 pool_next_states_ssse3(const BYTE* lookup, const BYTE* states, BYTE* next, UINT32 count) __attribute__((target("ssse3")));
+#endif
+
+//----------------------------------------------------------------------------
+// sm_pool_create
+//----------------------------------------------------------------------------
+sm_handle_t sm_pool_create(sm_pool_t* self)
+{
+    sm_handle_t handle = SM_INVALID_HANDLE;
+
+    ASSERT_TRUE(self);
+
+    // Reuse a destroyed slot first, then carve a new one from the arrays
+    if (self->free_head != SM_INVALID_HANDLE)
+    {
+        handle = self->free_head;
+        memcpy(&self->free_head, SLOT_LINK(self, handle), sizeof(UINT32));
+    }
+    else if (self->pool_index < self->capacity)
+    {
+        handle = self->pool_index++;
+    }
+
+    if (handle == SM_INVALID_HANDLE)
+    {
+        // Out of pool slots
+        ASSERT();
+        return handle;
+    }
+
+    // New instances start in state 0 with zeroed instance data
+    memset(sm_pool_instance(self, handle), 0, self->slot_size);
+    self->p_states[handle] = 0;
+    self->in_use++;
+
+    return handle;
+}
+
+//----------------------------------------------------------------------------
+// sm_pool_destroy
+//----------------------------------------------------------------------------
+void sm_pool_destroy(sm_pool_t* self, sm_handle_t handle)
+{
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(handle < self->pool_index);
+    ASSERT_TRUE(self->p_states[handle] != SM_POOL_SLOT_FREE);
+
+    // Push the slot onto the free-list
+    self->p_states[handle] = SM_POOL_SLOT_FREE;
+    memcpy(SLOT_LINK(self, handle), &self->free_head, sizeof(UINT32));
+    self->free_head = handle;
+    self->in_use--;
+}
+
+//----------------------------------------------------------------------------
+// sm_pool_count_in_state
+//----------------------------------------------------------------------------
+UINT32 sm_pool_count_in_state(const sm_pool_t* self, BYTE state)
+{
+    const BYTE* p_states;
+    UINT32 count = 0;
+    UINT32 i;
+
+    ASSERT_TRUE(self);
+
+    // A tight scan over the dense state array the compiler can vectorize
+    p_states = self->p_states;
+    for (i = 0; i < self->pool_index; i++)
+        count += (p_states[i] == state);
+
+    return count;
+}
+
+//----------------------------------------------------------------------------
+// _sm_pool_bind
+//----------------------------------------------------------------------------
+void _sm_pool_bind(const sm_pool_t* self, sm_handle_t handle, sm_state_machine_t* machine)
+{
+    // Only the fields read by the engine need to be set
+    machine->name = self->name;
+    machine->p_instance = sm_pool_instance(self, handle);
+    machine->new_state = self->p_states[handle];
+    machine->current_state = self->p_states[handle];
+    machine->event_head = 0;
+    machine->event_count = 0;
+    machine->event_overflows = 0;
+    machine->p_state_timers = NULL;
+    machine->lock = NULL;
+    machine->p_queue = NULL;
+    machine->p_history = NULL;
+    machine->p_watches = NULL;
+    machine->p_fired = NULL;
+    machine->p_view = NULL;
+    machine->deferred_count = 0;
+}
+
+//----------------------------------------------------------------------------
+// _sm_pool_event
+//----------------------------------------------------------------------------
+void _sm_pool_event(sm_pool_t* self, sm_handle_t handle, sm_event_func_t event_func, void* p_event_data)
+{
+    sm_state_machine_t machine;
+    sm_deferred_event_t* p_deferred;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(event_func);
+    ASSERT_TRUE(handle < self->pool_index);
+    ASSERT_TRUE(self->p_states[handle] != SM_POOL_SLOT_FREE);
+
+    // Run the event on a machine bound to the slot, then store the state back
+    _sm_pool_bind(self, handle, &machine);
+    event_func(&machine, p_event_data);
+    self->p_states[handle] = machine.current_state;
+
+    // Slots have nowhere to park deferred events, drop them like ignored
+    // events once the machine goes out of scope
+    while (machine.deferred_count)
+    {
+        p_deferred = &machine.deferred[--machine.deferred_count];
+        if (p_deferred->p_event_data)
+            sm_xfree(p_deferred->p_event_data);
+    }
+}
+
+#ifdef SM_POOL_SSSE3
+//----------------------------------------------------------------------------
+// pool_next_states_ssse3
+//----------------------------------------------------------------------------
+static UINT32 pool_next_states_ssse3(const BYTE* lookup, const BYTE* states, BYTE* next, UINT32 count)
+{
+    const __m128i map = _mm_loadu_si128((const __m128i*)lookup);
+    const __m128i last = _mm_set1_epi8(15);
+    const __m128i ignored = _mm_set1_epi8((char)EVENT_IGNORED);
+    UINT32 i;
+
+    // The whole transition map fits one register, translate 16 states at a
+    // time. Free slots are out of range and come out as EVENT_IGNORED.
+    for (i = 0; i + 16 <= count; i += 16)
+    {
+        __m128i state = _mm_loadu_si128((const __m128i*)(states + i));
+        __m128i in_map = _mm_cmpeq_epi8(_mm_min_epu8(state, last), state);
+        __m128i new_state = _mm_shuffle_epi8(map, state);
+
+        new_state = _mm_or_si128(_mm_and_si128(in_map, new_state), _mm_andnot_si128(in_map, ignored));
+        _mm_storeu_si128((__m128i*)(next + i), new_state);
+    }
+
+    return i;
+}
+#endif
+
+//----------------------------------------------------------------------------
+// pool_next_states
+//----------------------------------------------------------------------------
+static void pool_next_states(const BYTE* lookup, BYTE states_max, const BYTE* states, BYTE* next, UINT32 count)
+{
+    UINT32 i = 0;
+
+#ifdef SM_POOL_SSSE3
+    if (states_max <= 16 && SM_POOL_HAS_SSSE3())
+        i = pool_next_states_ssse3(lookup, states, next, count);
+#else
+    (void)states_max;
+#endif
+
+    for (; i < count; i++)
+        next[i] = lookup[states[i]];
+}
+
+//----------------------------------------------------------------------------
+// _sm_pool_event_bulk
+//----------------------------------------------------------------------------
+UINT32 _sm_pool_event_bulk(sm_pool_t* self, const sm_handle_t* handles, UINT32 count, const sm_event_map_t* map, void* const* p_event_data)
+{
+    const sm_state_machine_const_t* self_const;
+    const BYTE* transitions;
+    sm_state_machine_t machine;
+    BYTE lookup[256];
+    BYTE gathered[SM_POOL_BULK_CHUNK];
+    BYTE next[SM_POOL_BULK_CHUNK];
+    UINT16 order[SM_POOL_BULK_CHUNK];
+    UINT16 group[256];
+    const BYTE* states;
+    sm_handle_t handle;
+    UINT32 transitioned = 0;
+    UINT32 base, chunk, placed, total, i, s;
+    void* p_data;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(map);
+
+    // Bulk events apply the transition map directly
+    transitions = map->p_transitions;
+    self_const = map->p_const;
+
+    // Every state byte maps to a next state, free slots are ignored
+    memset(lookup, EVENT_IGNORED, sizeof(lookup));
+    memcpy(lookup, transitions, self_const->states_max);
+
+    // Slots cannot park deferred events, they are ignored instead
+    for (s = 0; s < self_const->states_max; s++)
+    {
+        if (lookup[s] == EVENT_DEFERRED)
+            lookup[s] = EVENT_IGNORED;
+    }
+
+    // Resolve inherited entries once for the whole pool. Slots keep no
+    // history, so a history target enters the parent state itself.
+    if (self_const->p_hsm)
+    {
+        for (s = 0; s < self_const->states_max; s++)
+        {
+            lookup[s] = _sm_hsm_lookup(self_const, transitions, (BYTE)s);
+            if (lookup[s] == EVENT_DEFERRED)
+                lookup[s] = EVENT_IGNORED;
+            else if (lookup[s] >= SM_HSM_HISTORY && lookup[s] < SM_HSM_HISTORY + SM_HSM_STATES_MAX)
+                lookup[s] &= ~SM_HSM_HISTORY;
+        }
+    }
+
+    if (!handles)
+        count = self->pool_index;
+
+    for (base = 0; base < count; base += chunk)
+    {
+        chunk = count - base;
+        if (chunk > SM_POOL_BULK_CHUNK)
+            chunk = SM_POOL_BULK_CHUNK;
+
+        // Current states of this chunk, in place for a whole pool broadcast
+        if (handles)
+        {
+            for (i = 0; i < chunk; i++)
+            {
+                ASSERT_TRUE(handles[base + i] < self->pool_index);
+                gathered[i] = self->p_states[handles[base + i]];
+            }
+            states = gathered;
+        }
+        else
+        {
+            states = self->p_states + base;
+        }
+
+        pool_next_states(lookup, self_const->states_max, states, next, chunk);
+
+        // Count the instances moving to each state
+        memset(group, 0, self_const->states_max * sizeof(UINT16));
+        for (i = 0; i < chunk; i++)
+        {
+            if (next[i] >= self_const->states_max)
+            {
+                ASSERT_TRUE(next[i] == EVENT_IGNORED);
+                next[i] = EVENT_IGNORED;
+
+                // Ignored events only release their event data
+                if (p_event_data && p_event_data[base + i])
+                    sm_xfree(p_event_data[base + i]);
+                continue;
+            }
+            group[next[i]]++;
+        }
+
+        // Order the instances by next state
+        for (s = 0, total = 0; s < self_const->states_max; s++)
+        {
+            placed = group[s];
+            group[s] = (UINT16)total;
+            total += placed;
+        }
+        for (i = 0; i < chunk; i++)
+        {
+            if (next[i] != EVENT_IGNORED)
+                order[group[next[i]]++] = (UINT16)i;
+        }
+
+        // Run the state actions one next state group after the other
+        for (placed = 0; placed < total; placed++)
+        {
+            i = order[placed];
+            handle = handles ? handles[base + i] : base + i;
+            p_data = p_event_data ? p_event_data[base + i] : NULL;
+
+            _sm_pool_bind(self, handle, &machine);
+            _sm_internal_event(&machine, next[i], p_data);
+            if (self_const->state_map)
+                _sm_state_engine(&machine, self_const);
+            else
+                _sm_state_engine_ex(&machine, self_const);
+            self->p_states[handle] = machine.current_state;
+        }
+
+        transitioned += total;
+    }
+
+    return transitioned;
+}
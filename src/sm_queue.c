@@ -0,0 +1,241 @@
+#include "sm_queue.h"
+#include "fault.h"
+#include <string.h>
+
+// Highest level set in a SM_QUEUE_LEVELS bit wide ready mask
+static const BYTE highest_level[1 << SM_QUEUE_LEVELS] = {
+    0, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3
+};
+
+static UINT32 queue_find_coalesced(sm_event_queue_t* queue, const sm_event_desc_t* desc);
+static sm_queue_entry_t* queue_scan_level(sm_event_queue_t* queue, UINT32 priority, const sm_event_desc_t* desc);
+
+//----------------------------------------------------------------------------
+// queue_find_coalesced
+//----------------------------------------------------------------------------
+static UINT32 queue_find_coalesced(sm_event_queue_t* queue, const sm_event_desc_t* desc)
+{
+    UINT32 i;
+
+    for (i = 0; i < SM_QUEUE_COALESCE_MAX; i++)
+    {
+        if (queue->coalesce_desc[i] == desc)
+            break;
+    }
+
+    return i;
+}
+
+//----------------------------------------------------------------------------
+// queue_scan_level
+//----------------------------------------------------------------------------
+static sm_queue_entry_t* queue_scan_level(sm_event_queue_t* queue, UINT32 priority, const sm_event_desc_t* desc)
+{
+    const sm_queue_level_t* level = &queue->levels[priority];
+    sm_queue_entry_t* entries = &queue->p_entries[priority * queue->capacity];
+    UINT32 slot = level->head;
+    UINT32 i;
+
+    for (i = 0; i < level->count; i++)
+    {
+        if (entries[slot].p_desc == desc)
+            return &entries[slot];
+        if (++slot == queue->capacity)
+            slot = 0;
+    }
+
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// _sm_post
+//----------------------------------------------------------------------------
+BOOL _sm_post(sm_state_machine_t* self, const sm_event_desc_t* desc, void* p_event_data)
+{
+    sm_event_queue_t* queue;
+    sm_queue_level_t* level;
+    sm_queue_entry_t* entry;
+    void* p_pending = NULL;
+    void* p_keep = NULL;
+    UINT32 priority;
+    UINT32 slot;
+    UINT32 i;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(self->p_queue);
+    ASSERT_TRUE(desc);
+
+    queue = self->p_queue;
+    priority = SM_EVENT_PRIORITY_OF(desc->flags);
+    level = &queue->levels[priority];
+
+    if (queue->lock)
+        lk_lock(queue->lock);
+
+    level->posted++;
+
+    // A coalescable event already pending absorbs the new one
+    if (desc->flags & SM_EVENT_COALESCE)
+    {
+        entry = NULL;
+        i = queue_find_coalesced(queue, desc);
+        if (i < SM_QUEUE_COALESCE_MAX)
+            entry = &queue->p_entries[queue->coalesce_slot[i]];
+        else if (queue->coalesce_untracked)
+            entry = queue_scan_level(queue, priority, desc);
+
+        if (entry)
+        {
+            p_pending = entry->p_event_data;
+
+            // Without a merge function the latest payload wins
+            if (desc->p_merge_func)
+                p_keep = desc->p_merge_func(p_pending, p_event_data);
+            else
+                p_keep = p_event_data;
+
+            entry->p_event_data = p_keep;
+            level->coalesced++;
+
+            if (queue->lock)
+                lk_unlock(queue->lock);
+
+            // Free whichever payload the merge did not keep
+            if (p_pending && p_pending != p_keep)
+                sm_xfree(p_pending);
+            if (p_event_data && p_event_data != p_keep)
+                sm_xfree(p_event_data);
+
+            return TRUE;
+        }
+    }
+
+    // Level full, the caller keeps ownership of the event data
+    if (level->count == queue->capacity)
+    {
+        level->dropped++;
+
+        if (queue->lock)
+            lk_unlock(queue->lock);
+
+        return FALSE;
+    }
+
+    slot = level->head + level->count;
+    if (slot >= queue->capacity)
+        slot -= queue->capacity;
+    slot += priority * queue->capacity;
+
+    queue->p_entries[slot].p_desc = desc;
+    queue->p_entries[slot].p_event_data = p_event_data;
+
+    level->count++;
+    if (level->count > level->max_count)
+        level->max_count = level->count;
+    queue->ready |= 1 << priority;
+
+    // Remember where the pending entry is. Without room to track it, later
+    // posts scan the level for it.
+    if (desc->flags & SM_EVENT_COALESCE)
+    {
+        i = queue_find_coalesced(queue, NULL);
+        if (i < SM_QUEUE_COALESCE_MAX)
+        {
+            queue->coalesce_desc[i] = desc;
+            queue->coalesce_slot[i] = slot;
+        }
+        else
+        {
+            queue->coalesce_untracked++;
+        }
+    }
+
+    if (queue->lock)
+        lk_unlock(queue->lock);
+
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// _sm_queue_pop
+//----------------------------------------------------------------------------
+BOOL _sm_queue_pop(sm_event_queue_t* queue, sm_batch_event_t* event)
+{
+    sm_queue_level_t* level;
+    sm_queue_entry_t* entry;
+    UINT32 priority;
+    UINT32 slot;
+    UINT32 i;
+
+    ASSERT_TRUE(queue);
+    ASSERT_TRUE(event);
+
+    if (queue->lock)
+        lk_lock(queue->lock);
+
+    if (!queue->ready)
+    {
+        if (queue->lock)
+            lk_unlock(queue->lock);
+        return FALSE;
+    }
+
+    // Always serve the highest non-empty level first
+    priority = highest_level[queue->ready];
+    level = &queue->levels[priority];
+    slot = priority * queue->capacity + level->head;
+
+    entry = &queue->p_entries[slot];
+    event->p_event_func = entry->p_desc->p_event_func;
+    event->p_event_data = entry->p_event_data;
+
+    // The event is no longer pending, later posts queue a new entry
+    if (entry->p_desc->flags & SM_EVENT_COALESCE)
+    {
+        i = queue_find_coalesced(queue, entry->p_desc);
+        if (i < SM_QUEUE_COALESCE_MAX)
+        {
+            ASSERT_TRUE(queue->coalesce_slot[i] == slot);
+            queue->coalesce_desc[i] = NULL;
+        }
+        else
+        {
+            ASSERT_TRUE(queue->coalesce_untracked);
+            queue->coalesce_untracked--;
+        }
+    }
+
+    if (++level->head == queue->capacity)
+        level->head = 0;
+    if (--level->count == 0)
+        queue->ready &= ~(1 << priority);
+
+    if (queue->lock)
+        lk_unlock(queue->lock);
+
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// _sm_queue_stats
+//----------------------------------------------------------------------------
+void _sm_queue_stats(sm_state_machine_t* self, UINT level, sm_queue_level_t* p_stats)
+{
+    sm_event_queue_t* queue;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(self->p_queue);
+    ASSERT_TRUE(level < SM_QUEUE_LEVELS);
+    ASSERT_TRUE(p_stats);
+
+    queue = self->p_queue;
+
+    // Copy under the lock so the counters are consistent with each other
+    if (queue->lock)
+        lk_lock(queue->lock);
+
+    memcpy(p_stats, &queue->levels[level], sizeof(sm_queue_level_t));
+
+    if (queue->lock)
+        lk_unlock(queue->lock);
+}
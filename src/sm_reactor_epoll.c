@@ -0,0 +1,417 @@
+#include "sm_reactor.h"
+#include "lock_guard.h"
+#include "fault.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// A posted event waiting to be dispatched on the loop thread
+typedef struct
+{
+    sm_state_machine_t* p_machine;
+    sm_batch_event_t event;
+} sm_reactor_post_t;
+
+typedef struct
+{
+    INT epoll_fd;
+    INT wake_fd;
+    volatile BOOL stop;
+
+    // Bounded ring of posted events, guarded by lock
+    LOCK_HANDLE lock;
+    sm_reactor_post_t* p_posts;
+    UINT32 post_mask;
+    UINT32 post_head;
+    UINT32 post_tail;
+    BOOL wake_pending;
+
+    // Optional timer wheel advanced from CLOCK_MONOTONIC
+    sm_timer_wheel_t* p_wheel;
+    UINT32 tick_ms;
+    UINT64 last_tick_ms;
+} sm_reactor_t;
+
+static UINT64 reactor_now_ms(void);
+static void reactor_wake(sm_reactor_t* self);
+static UINT32 reactor_drain_posts(sm_reactor_t* self);
+static UINT32 reactor_advance_timers(sm_reactor_t* self);
+static INT reactor_timeout(sm_reactor_t* self, INT timeout_ms);
+
+//----------------------------------------------------------------------------
+// reactor_now_ms
+//----------------------------------------------------------------------------
+static UINT64 reactor_now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (UINT64)now.tv_sec * 1000 + (UINT64)now.tv_nsec / 1000000;
+}
+
+//----------------------------------------------------------------------------
+// reactor_wake
+//----------------------------------------------------------------------------
+static void reactor_wake(sm_reactor_t* self)
+{
+    UINT64 one = 1;
+
+    // Ignore EAGAIN, the counter is already non-zero and the loop will wake
+    if (write(self->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        ASSERT();
+}
+
+//----------------------------------------------------------------------------
+// reactor_drain_posts
+//----------------------------------------------------------------------------
+static UINT32 reactor_drain_posts(sm_reactor_t* self)
+{
+    sm_state_machine_t* machines[SM_REACTOR_BURST_MAX];
+    sm_batch_event_t events[SM_REACTOR_BURST_MAX];
+    sm_reactor_post_t* p_post;
+    UINT32 count;
+    UINT32 total = 0;
+    UINT32 first;
+    UINT32 i;
+
+    do
+    {
+        // Copy out a burst under the lock, dispatch it without holding it
+        lk_lock(self->lock);
+        for (count = 0; count < SM_REACTOR_BURST_MAX && self->post_head != self->post_tail; count++)
+        {
+            p_post = &self->p_posts[self->post_tail++ & self->post_mask];
+            machines[count] = p_post->p_machine;
+            events[count] = p_post->event;
+        }
+        if (self->post_head == self->post_tail)
+            self->wake_pending = FALSE;
+        lk_unlock(self->lock);
+
+        // Consecutive posts to the same instance run as one engine batch
+        for (first = 0; first < count; first = i)
+        {
+            for (i = first + 1; i < count && machines[i] == machines[first]; i++)
+                ;
+
+            if (i - first == 1)
+                events[first].p_event_func(machines[first], events[first].p_event_data);
+            else
+                _sm_event_batch(machines[first], &events[first], i - first);
+        }
+
+        total += count;
+    } while (count == SM_REACTOR_BURST_MAX);
+
+    return total;
+}
+
+//----------------------------------------------------------------------------
+// reactor_advance_timers
+//----------------------------------------------------------------------------
+static UINT32 reactor_advance_timers(sm_reactor_t* self)
+{
+    UINT64 now;
+    UINT32 ticks;
+
+    if (!self->p_wheel)
+        return 0;
+
+    now = reactor_now_ms();
+    ticks = (UINT32)((now - self->last_tick_ms) / self->tick_ms);
+    if (!ticks)
+        return 0;
+
+    self->last_tick_ms += (UINT64)ticks * self->tick_ms;
+    return sm_timer_wheel_advance(self->p_wheel, ticks);
+}
+
+//----------------------------------------------------------------------------
+// reactor_timeout
+//----------------------------------------------------------------------------
+static INT reactor_timeout(sm_reactor_t* self, INT timeout_ms)
+{
+    UINT32 ticks;
+    UINT64 due;
+    UINT64 now;
+
+    if (!self->p_wheel || !sm_timer_wheel_next_expiry(self->p_wheel, &ticks))
+        return timeout_ms;
+
+    // Sleep no longer than the next timer expiry
+    due = self->last_tick_ms + (UINT64)ticks * self->tick_ms;
+    now = reactor_now_ms();
+    if (due <= now)
+        return 0;
+    if (timeout_ms < 0 || due - now < (UINT64)timeout_ms)
+        return (INT)(due - now);
+
+    return timeout_ms;
+}
+
+//----------------------------------------------------------------------------
+// sm_reactor_create
+//----------------------------------------------------------------------------
+REACTOR_HANDLE sm_reactor_create(UINT32 post_capacity)
+{
+    sm_reactor_t* self;
+    struct epoll_event ev;
+    UINT32 capacity = 1;
+
+    // Round the ring capacity up to a power of two
+    while (capacity < post_capacity)
+        capacity <<= 1;
+
+    self = calloc(1, sizeof(sm_reactor_t));
+    if (!self)
+        return NULL;
+
+    self->p_posts = malloc(capacity * sizeof(sm_reactor_post_t));
+    self->post_mask = capacity - 1;
+    self->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    self->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    self->lock = lk_create();
+    lk_name(self->lock, "sm_reactor");
+
+    if (!self->p_posts || self->epoll_fd < 0 || self->wake_fd < 0 || !self->lock)
+    {
+        sm_reactor_destroy(self);
+        return NULL;
+    }
+
+    // The wake descriptor is the only registration without an sm_reactor_fd_t
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, self->wake_fd, &ev) < 0)
+    {
+        sm_reactor_destroy(self);
+        return NULL;
+    }
+
+    return self;
+}
+
+//----------------------------------------------------------------------------
+// sm_reactor_destroy
+//----------------------------------------------------------------------------
+void sm_reactor_destroy(REACTOR_HANDLE hReactor)
+{
+    sm_reactor_t* self = (sm_reactor_t*)hReactor;
+
+    if (!self)
+        return;
+
+    // Release event data of posts that were never dispatched
+    if (self->p_posts)
+    {
+        while (self->post_head != self->post_tail)
+            sm_xfree(self->p_posts[self->post_tail++ & self->post_mask].event.p_event_data);
+        free(self->p_posts);
+    }
+
+    if (self->epoll_fd >= 0)
+        close(self->epoll_fd);
+    if (self->wake_fd >= 0)
+        close(self->wake_fd);
+    if (self->lock)
+        lk_destroy(self->lock);
+
+    free(self);
+}
+
+//----------------------------------------------------------------------------
+// sm_reactor_add_fd
+//----------------------------------------------------------------------------
+BOOL sm_reactor_add_fd(REACTOR_HANDLE hReactor, sm_reactor_fd_t* reg, INT fd, UINT32 events,
+    sm_state_machine_t* machine, sm_event_func_t event_func)
+{
+    sm_reactor_t* self = (sm_reactor_t*)hReactor;
+    struct epoll_event ev;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(reg);
+    ASSERT_TRUE(machine);
+    ASSERT_TRUE(event_func);
+
+    reg->fd = fd;
+    reg->p_machine = machine;
+    reg->p_event_func = event_func;
+
+    ev.events = events;
+    ev.data.ptr = reg;
+    return epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+//----------------------------------------------------------------------------
+// sm_reactor_modify_fd
+//----------------------------------------------------------------------------
+BOOL sm_reactor_modify_fd(REACTOR_HANDLE hReactor, sm_reactor_fd_t* reg, UINT32 events)
+{
+    sm_reactor_t* self = (sm_reactor_t*)hReactor;
+    struct epoll_event ev;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(reg);
+
+    ev.events = events;
+    ev.data.ptr = reg;
+    return epoll_ctl(self->epoll_fd, EPOLL_CTL_MOD, reg->fd, &ev) == 0;
+}
+
+//----------------------------------------------------------------------------
+// sm_reactor_remove_fd
+//----------------------------------------------------------------------------
+BOOL sm_reactor_remove_fd(REACTOR_HANDLE hReactor, sm_reactor_fd_t* reg)
+{
+    sm_reactor_t* self = (sm_reactor_t*)hReactor;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(reg);
+
+    return epoll_ctl(self->epoll_fd, EPOLL_CTL_DEL, reg->fd, NULL) == 0;
+}
+
+//----------------------------------------------------------------------------
+// sm_reactor_set_timer_wheel
+//----------------------------------------------------------------------------
+void sm_reactor_set_timer_wheel(REACTOR_HANDLE hReactor, sm_timer_wheel_t* wheel, UINT32 tick_ms)
+{
+    sm_reactor_t* self = (sm_reactor_t*)hReactor;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(!wheel || tick_ms);
+
+    self->p_wheel = wheel;
+    self->tick_ms = tick_ms;
+    self->last_tick_ms = reactor_now_ms();
+}
+
+//----------------------------------------------------------------------------
+// sm_reactor_post
+//----------------------------------------------------------------------------
+BOOL sm_reactor_post(REACTOR_HANDLE hReactor, sm_state_machine_t* machine,
+    sm_event_func_t event_func, void* p_event_data)
+{
+    sm_reactor_t* self = (sm_reactor_t*)hReactor;
+    sm_reactor_post_t* p_post;
+    BOOL wake = FALSE;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(machine);
+    ASSERT_TRUE(event_func);
+
+    lk_lock(self->lock);
+
+    // Ring full, the caller keeps ownership of the event data
+    if (self->post_head - self->post_tail > self->post_mask)
+    {
+        lk_unlock(self->lock);
+        return FALSE;
+    }
+
+    p_post = &self->p_posts[self->post_head++ & self->post_mask];
+    p_post->p_machine = machine;
+    p_post->event.p_event_func = event_func;
+    p_post->event.p_event_data = p_event_data;
+
+    // Only the first post since the last drain needs to wake the loop
+    if (!self->wake_pending)
+    {
+        self->wake_pending = TRUE;
+        wake = TRUE;
+    }
+
+    lk_unlock(self->lock);
+
+    if (wake)
+        reactor_wake(self);
+
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// sm_reactor_run_once
+//----------------------------------------------------------------------------
+INT sm_reactor_run_once(REACTOR_HANDLE hReactor, INT timeout_ms)
+{
+    sm_reactor_t* self = (sm_reactor_t*)hReactor;
+    struct epoll_event events[SM_REACTOR_BURST_MAX];
+    sm_reactor_fd_data_t* p_data;
+    sm_reactor_fd_t* reg;
+    UINT64 counter;
+    INT dispatched = 0;
+    INT count;
+    INT i;
+
+    ASSERT_TRUE(self);
+
+    count = epoll_wait(self->epoll_fd, events, SM_REACTOR_BURST_MAX, reactor_timeout(self, timeout_ms));
+    if (count < 0 && errno != EINTR)
+        return -1;
+
+    for (i = 0; i < count; i++)
+    {
+        reg = (sm_reactor_fd_t*)events[i].data.ptr;
+
+        // Wake descriptor, the posted events are drained below
+        if (!reg)
+        {
+            if (read(self->wake_fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN)
+                ASSERT();
+            continue;
+        }
+
+        // Out of event data blocks, skip the descriptor. A level triggered
+        // descriptor is reported again by the next wait, and the posts and
+        // timers below still run.
+        p_data = sm_xalloc(sizeof(sm_reactor_fd_data_t));
+        if (!p_data)
+            continue;
+        p_data->fd = reg->fd;
+        p_data->events = events[i].events;
+        reg->p_event_func(reg->p_machine, p_data);
+        dispatched++;
+    }
+
+    dispatched += reactor_drain_posts(self);
+    dispatched += reactor_advance_timers(self);
+
+    return dispatched;
+}
+
+//----------------------------------------------------------------------------
+// sm_reactor_run
+//----------------------------------------------------------------------------
+void sm_reactor_run(REACTOR_HANDLE hReactor)
+{
+    sm_reactor_t* self = (sm_reactor_t*)hReactor;
+
+    ASSERT_TRUE(self);
+
+    // A stop issued before the loop started returns at once. Only a failing
+    // epoll_wait() ends the loop otherwise.
+    while (!self->stop)
+    {
+        if (sm_reactor_run_once(self, -1) < 0)
+            break;
+    }
+
+    // Clear the request only now so the next run starts afresh
+    self->stop = FALSE;
+}
+
+//----------------------------------------------------------------------------
+// sm_reactor_stop
+//----------------------------------------------------------------------------
+void sm_reactor_stop(REACTOR_HANDLE hReactor)
+{
+    sm_reactor_t* self = (sm_reactor_t*)hReactor;
+
+    ASSERT_TRUE(self);
+
+    self->stop = TRUE;
+    reactor_wake(self);
+}
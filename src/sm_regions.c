@@ -0,0 +1,143 @@
+#include "sm_regions.h"
+#include "fault.h"
+#include <string.h>
+
+static void regions_prepare(sm_region_event_t* event);
+
+//----------------------------------------------------------------------------
+// regions_prepare
+//----------------------------------------------------------------------------
+static void regions_prepare(sm_region_event_t* event)
+{
+    const sm_region_handler_t* handler;
+    const sm_event_map_t* map;
+    UINT32 mask = 0;
+    UINT32 i, s;
+
+    for (i = 0; i < event->count; i++)
+    {
+        handler = &event->p_handlers[i];
+        map = handler->p_map;
+        ASSERT_TRUE(map);
+        ASSERT_TRUE(handler->region < SM_REGIONS_MAX);
+
+        // Leave the region out if no state reacts to the event
+        for (s = 0; s < map->p_const->states_max; s++)
+        {
+            if (_sm_hsm_lookup(map->p_const, map->p_transitions, (BYTE)s) != EVENT_IGNORED)
+            {
+                mask |= 1u << handler->region;
+                break;
+            }
+        }
+    }
+
+    // Racing first dispatches compute the same values
+    __atomic_store_n(&event->mask, mask, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->ready, TRUE, __ATOMIC_RELEASE);
+}
+
+//----------------------------------------------------------------------------
+// _sm_regions_event
+//----------------------------------------------------------------------------
+UINT32 _sm_regions_event(sm_regions_t* self, sm_region_event_t* event, void* p_event_data, size_t size)
+{
+    const sm_region_handler_t* handler;
+    const sm_event_map_t* map;
+    sm_state_machine_t* region;
+    void* p_outer;
+    void* p_copy;
+    UINT32 dispatched = 0;
+    UINT32 i;
+    BYTE new_state;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(event);
+    ASSERT_TRUE(p_event_data || !size);
+
+    if (!__atomic_load_n(&event->ready, __ATOMIC_ACQUIRE))
+        regions_prepare(event);
+
+    if (self->lock)
+        lk_lock(self->lock);
+
+    // Every region sees the same event data, freed once below
+    p_outer = _sm_share_event_data(p_event_data);
+
+    for (i = 0; i < event->count; i++)
+    {
+        handler = &event->p_handlers[i];
+        if (!(event->mask & (1u << handler->region)))
+            continue;
+
+        ASSERT_TRUE(handler->region < self->count);
+        region = self->p_regions[handler->region];
+        ASSERT_TRUE(region->lock == NULL);
+
+        // Regions ignoring the event in their current state are skipped
+        map = handler->p_map;
+        new_state = _sm_hsm_lookup(map->p_const, map->p_transitions, region->current_state);
+        if (new_state == EVENT_IGNORED)
+            continue;
+
+        SM_TRACE_EVENT(event->name);
+
+        if (new_state == EVENT_DEFERRED)
+        {
+            // The parked event outlives this call, give it its own data
+            p_copy = NULL;
+            if (p_event_data)
+            {
+                ASSERT_TRUE(size);
+                p_copy = sm_xalloc(size);
+                if (!p_copy)
+                {
+                    ASSERT();
+                    continue;
+                }
+                memcpy(p_copy, p_event_data, size);
+            }
+            _sm_transition_event(region, map->p_const, map->p_transitions, p_copy);
+        }
+        else
+        {
+            _sm_external_event(region, map->p_const, new_state, p_event_data);
+        }
+
+        dispatched++;
+    }
+
+    _sm_share_event_data(p_outer);
+
+    if (self->lock)
+        lk_unlock(self->lock);
+
+    if (p_event_data)
+        sm_xfree(p_event_data);
+
+    return dispatched;
+}
+
+//----------------------------------------------------------------------------
+// _sm_regions_lock_create
+//----------------------------------------------------------------------------
+void _sm_regions_lock_create(sm_regions_t* self)
+{
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(self->lock == NULL);
+
+    self->lock = lk_create();
+    lk_name(self->lock, self->name);
+}
+
+//----------------------------------------------------------------------------
+// _sm_regions_lock_destroy
+//----------------------------------------------------------------------------
+void _sm_regions_lock_destroy(sm_regions_t* self)
+{
+    ASSERT_TRUE(self);
+
+    if (self->lock)
+        lk_destroy(self->lock);
+    self->lock = NULL;
+}
@@ -0,0 +1,270 @@
+#include "sm_registry.h"
+#include "fault.h"
+#include <string.h>
+
+static UINT32 registry_hash(const CHAR* name);
+static UINT16 registry_find(const sm_registry_t* registry, const UINT16* slots, UINT32 slot_count,
+    const CHAR* (*get_name)(const sm_registry_t*, UINT16, UINT32*), const CHAR* name);
+static void registry_insert(UINT16* slots, UINT32 slot_count, UINT32 hash, UINT16 id);
+static const CHAR* registry_machine_name(const sm_registry_t* registry, UINT16 id, UINT32* p_hash);
+static const CHAR* registry_event_name(const sm_registry_t* registry, UINT16 id, UINT32* p_hash);
+static BOOL registry_resolve(const sm_registry_t* registry, UINT16 machine, UINT16 event,
+    const sm_registry_machine_t** pp_machine, const sm_registry_event_t** pp_event);
+
+//----------------------------------------------------------------------------
+// registry_hash
+//----------------------------------------------------------------------------
+static UINT32 registry_hash(const CHAR* name)
+{
+    UINT32 hash = 2166136261u;
+
+    // FNV-1a
+    while (*name)
+    {
+        hash ^= (BYTE)*name++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+//----------------------------------------------------------------------------
+// registry_find
+//----------------------------------------------------------------------------
+static UINT16 registry_find(const sm_registry_t* registry, const UINT16* slots, UINT32 slot_count,
+    const CHAR* (*get_name)(const sm_registry_t*, UINT16, UINT32*), const CHAR* name)
+{
+    UINT32 hash = registry_hash(name);
+    UINT32 slot = hash % slot_count;
+    const CHAR* entry_name;
+    UINT32 entry_hash;
+    UINT16 id;
+
+    // Slots hold id + 1, zero ends the probe sequence. Names are only
+    // compared when the hashes match.
+    while (slots[slot])
+    {
+        id = (UINT16)(slots[slot] - 1);
+        entry_name = get_name(registry, id, &entry_hash);
+        if (entry_hash == hash && strcmp(entry_name, name) == 0)
+            return id;
+        if (++slot == slot_count)
+            slot = 0;
+    }
+
+    return SM_REGISTRY_INVALID_ID;
+}
+
+//----------------------------------------------------------------------------
+// registry_insert
+//----------------------------------------------------------------------------
+static void registry_insert(UINT16* slots, UINT32 slot_count, UINT32 hash, UINT16 id)
+{
+    UINT32 slot = hash % slot_count;
+
+    while (slots[slot])
+    {
+        if (++slot == slot_count)
+            slot = 0;
+    }
+    slots[slot] = (UINT16)(id + 1);
+}
+
+//----------------------------------------------------------------------------
+// registry_machine_name
+//----------------------------------------------------------------------------
+static const CHAR* registry_machine_name(const sm_registry_t* registry, UINT16 id, UINT32* p_hash)
+{
+    *p_hash = registry->machines[id].hash;
+    return registry->machines[id].p_machine->name;
+}
+
+//----------------------------------------------------------------------------
+// registry_event_name
+//----------------------------------------------------------------------------
+static const CHAR* registry_event_name(const sm_registry_t* registry, UINT16 id, UINT32* p_hash)
+{
+    *p_hash = registry->events[id].hash;
+    return registry->events[id].p_desc->name;
+}
+
+//----------------------------------------------------------------------------
+// registry_resolve
+//----------------------------------------------------------------------------
+static BOOL registry_resolve(const sm_registry_t* registry, UINT16 machine, UINT16 event,
+    const sm_registry_machine_t** pp_machine, const sm_registry_event_t** pp_event)
+{
+    const sm_registry_machine_t* p_machine;
+    const sm_registry_event_t* p_event;
+
+    // Ids may come from another process, check them rather than assert
+    if (machine >= registry->machine_count || event >= registry->event_count)
+        return FALSE;
+
+    p_machine = &registry->machines[machine];
+    p_event = &registry->events[event];
+
+    // An event of another state map would index the wrong transition map
+    if (p_event->p_const && p_machine->p_const && p_event->p_const != p_machine->p_const)
+        return FALSE;
+
+    *pp_machine = p_machine;
+    *pp_event = p_event;
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// sm_registry_init
+//----------------------------------------------------------------------------
+void sm_registry_init(sm_registry_t* registry)
+{
+    ASSERT_TRUE(registry);
+
+    memset(registry, 0, sizeof(sm_registry_t));
+}
+
+//----------------------------------------------------------------------------
+// _sm_registry_add
+//----------------------------------------------------------------------------
+UINT16 _sm_registry_add(sm_registry_t* registry, sm_state_machine_t* self, const sm_event_map_t* type_map)
+{
+    sm_registry_machine_t* p_entry;
+    UINT16 id;
+
+    ASSERT_TRUE(registry);
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(self->name);
+
+    // Names identify instances, one entry per name
+    id = sm_registry_find(registry, self->name);
+    if (id != SM_REGISTRY_INVALID_ID)
+    {
+        ASSERT_TRUE(registry->machines[id].p_machine == self);
+        return id;
+    }
+
+    ASSERT_TRUE(registry->machine_count < SM_REGISTRY_MACHINES_MAX);
+    if (registry->machine_count >= SM_REGISTRY_MACHINES_MAX)
+        return SM_REGISTRY_INVALID_ID;
+
+    id = (UINT16)registry->machine_count++;
+    p_entry = &registry->machines[id];
+    p_entry->p_machine = self;
+
+    // The event map leads to the state map of the instance type
+    p_entry->p_const = type_map ? type_map->p_const : NULL;
+    p_entry->hash = registry_hash(self->name);
+    registry_insert(registry->machine_slots, SM_REGISTRY_MACHINES_MAX * 2, p_entry->hash, id);
+
+    return id;
+}
+
+//----------------------------------------------------------------------------
+// _sm_registry_add_event
+//----------------------------------------------------------------------------
+UINT16 _sm_registry_add_event(sm_registry_t* registry, const sm_event_desc_t* desc, const sm_event_map_t* map)
+{
+    sm_registry_event_t* p_entry;
+    UINT16 id;
+
+    ASSERT_TRUE(registry);
+    ASSERT_TRUE(desc);
+    ASSERT_TRUE(desc->name);
+    ASSERT_TRUE(!map || map->p_event_func == desc->p_event_func);
+
+    id = sm_registry_find_event(registry, desc->name);
+    if (id != SM_REGISTRY_INVALID_ID)
+    {
+        ASSERT_TRUE(registry->events[id].p_desc == desc);
+        return id;
+    }
+
+    ASSERT_TRUE(registry->event_count < SM_REGISTRY_EVENTS_MAX);
+    if (registry->event_count >= SM_REGISTRY_EVENTS_MAX)
+        return SM_REGISTRY_INVALID_ID;
+
+    id = (UINT16)registry->event_count++;
+    p_entry = &registry->events[id];
+    p_entry->p_desc = desc;
+    p_entry->hash = registry_hash(desc->name);
+
+    // Events registered without a transition map leave p_const NULL and go
+    // to instances of any type
+    p_entry->p_const = map ? map->p_const : NULL;
+
+    registry_insert(registry->event_slots, SM_REGISTRY_EVENTS_MAX * 2, p_entry->hash, id);
+
+    return id;
+}
+
+//----------------------------------------------------------------------------
+// sm_registry_find
+//----------------------------------------------------------------------------
+UINT16 sm_registry_find(const sm_registry_t* registry, const CHAR* name)
+{
+    ASSERT_TRUE(registry);
+    ASSERT_TRUE(name);
+
+    return registry_find(registry, registry->machine_slots, SM_REGISTRY_MACHINES_MAX * 2, registry_machine_name, name);
+}
+
+//----------------------------------------------------------------------------
+// sm_registry_find_event
+//----------------------------------------------------------------------------
+UINT16 sm_registry_find_event(const sm_registry_t* registry, const CHAR* name)
+{
+    ASSERT_TRUE(registry);
+    ASSERT_TRUE(name);
+
+    return registry_find(registry, registry->event_slots, SM_REGISTRY_EVENTS_MAX * 2, registry_event_name, name);
+}
+
+//----------------------------------------------------------------------------
+// sm_registry_machine
+//----------------------------------------------------------------------------
+sm_state_machine_t* sm_registry_machine(const sm_registry_t* registry, UINT16 machine)
+{
+    ASSERT_TRUE(registry);
+
+    if (machine >= registry->machine_count)
+        return NULL;
+
+    return registry->machines[machine].p_machine;
+}
+
+//----------------------------------------------------------------------------
+// sm_registry_dispatch
+//----------------------------------------------------------------------------
+BOOL sm_registry_dispatch(const sm_registry_t* registry, UINT16 machine, UINT16 event, void* p_event_data)
+{
+    const sm_registry_machine_t* p_machine;
+    const sm_registry_event_t* p_event;
+
+    ASSERT_TRUE(registry);
+
+    if (!registry_resolve(registry, machine, event, &p_machine, &p_event))
+        return FALSE;
+
+    p_event->p_desc->p_event_func(p_machine->p_machine, p_event_data);
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// sm_registry_post
+//----------------------------------------------------------------------------
+BOOL sm_registry_post(const sm_registry_t* registry, UINT16 machine, UINT16 event, void* p_event_data)
+{
+    const sm_registry_machine_t* p_machine;
+    const sm_registry_event_t* p_event;
+
+    ASSERT_TRUE(registry);
+
+    if (!registry_resolve(registry, machine, event, &p_machine, &p_event))
+        return FALSE;
+
+    // Only instances defined with SM_DEFINE_QUEUED have a queue to post to
+    if (!p_machine->p_machine->p_queue)
+        return FALSE;
+
+    return _sm_post(p_machine->p_machine, p_event->p_desc, p_event_data);
+}
@@ -0,0 +1,633 @@
+#define _GNU_SOURCE
+#include "sm_shm.h"
+#include "fault.h"
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_MAGIC       0x6D73736D
+#define SHM_VERSION     1
+#define SHM_CACHE_LINE  64
+
+#define SHM_ALIGN(_value_, _align_) \
+    (((_value_) + (_align_) - 1) & ~((UINT64)(_align_) - 1))
+
+// One posted event. The sequence number tells whose turn the slot is: it
+// equals the ring position while producers may fill it and the position
+// plus one once the consumer may read it.
+typedef struct
+{
+    UINT32 seq;
+    UINT32 event_id;
+    UINT32 offset;
+    UINT32 reserved;
+} shm_slot_t;
+
+// Header at the start of the region. Producer and consumer fields sit on
+// separate cache lines.
+typedef struct
+{
+    // Written once by the creating process
+    UINT32 magic;
+    UINT32 version;
+    UINT32 size;
+    UINT32 capacity;
+    UINT32 block_size;
+    UINT32 block_count;
+    UINT32 ring_offset;
+    UINT32 pool_offset;
+
+    // Written by producers. The free list head is a block offset in the low
+    // word and a change count in the high word, so a block popped and pushed
+    // back between a read and a compare-exchange is noticed.
+    UINT32 tail __attribute__((aligned(SHM_CACHE_LINE)));
+    UINT32 pool_index;
+    UINT64 free_head;
+
+    // Written by the consumer
+    UINT32 head __attribute__((aligned(SHM_CACHE_LINE)));
+    UINT32 sleeping;
+    UINT32 wake_seq;
+
+    sm_shm_stats_t stats __attribute__((aligned(SHM_CACHE_LINE)));
+} shm_header_t;
+
+// Event function bound to an event id, local to the consumer process
+typedef struct
+{
+    sm_state_machine_t* p_machine;
+    sm_event_func_t p_event_func;
+} shm_binding_t;
+
+typedef struct
+{
+    BYTE* p_base;
+    shm_header_t* p_header;
+    shm_slot_t* p_ring;
+    UINT32 mask;
+    INT fd;
+
+    // Name of a channel this process created, unlinked on close
+    CHAR* p_name;
+
+    shm_binding_t bindings[SM_SHM_EVENTS_MAX];
+} sm_shm_t;
+
+static sm_shm_t* shm_map(INT fd, UINT32 size);
+static BOOL shm_layout_valid(const shm_header_t* header);
+static UINT32 shm_pool_pop(sm_shm_t* self);
+static void shm_pool_push(sm_shm_t* self, UINT32 offset);
+static BOOL shm_pending(sm_shm_t* self);
+static BOOL shm_block_valid(const shm_header_t* header, UINT32 offset);
+static void shm_dispatch_one(sm_shm_t* self, UINT32 event_id, UINT32 offset);
+
+//----------------------------------------------------------------------------
+// shm_map
+//----------------------------------------------------------------------------
+static sm_shm_t* shm_map(INT fd, UINT32 size)
+{
+    sm_shm_t* self;
+    void* p_base;
+
+    p_base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p_base == MAP_FAILED)
+        return NULL;
+
+    self = calloc(1, sizeof(sm_shm_t));
+    if (!self)
+    {
+        munmap(p_base, size);
+        return NULL;
+    }
+
+    self->p_base = p_base;
+    self->p_header = p_base;
+    self->fd = fd;
+    return self;
+}
+
+//----------------------------------------------------------------------------
+// shm_layout_valid
+//----------------------------------------------------------------------------
+static BOOL shm_layout_valid(const shm_header_t* header)
+{
+    UINT64 ring_end, pool_end;
+
+    // The header comes from another process; every offset derived from it
+    // must stay inside the mapping
+    if (!header->capacity || (header->capacity & (header->capacity - 1)))
+        return FALSE;
+    if (header->block_size < sizeof(UINT32) || header->block_size % 8)
+        return FALSE;
+    if (header->ring_offset < sizeof(shm_header_t) || header->ring_offset % SHM_CACHE_LINE)
+        return FALSE;
+
+    ring_end = (UINT64)header->ring_offset + (UINT64)header->capacity * sizeof(shm_slot_t);
+    pool_end = (UINT64)header->pool_offset + (UINT64)header->block_size * header->block_count;
+
+    return ring_end <= header->pool_offset && pool_end <= header->size;
+}
+
+//----------------------------------------------------------------------------
+// shm_pool_pop
+//----------------------------------------------------------------------------
+static UINT32 shm_pool_pop(sm_shm_t* self)
+{
+    shm_header_t* header = self->p_header;
+    UINT64 head, next;
+    UINT32 offset, index;
+
+    head = __atomic_load_n(&header->free_head, __ATOMIC_ACQUIRE);
+    do
+    {
+        offset = (UINT32)head;
+        if (!offset)
+            break;
+
+        // The block may be taken and reused meanwhile; the change count
+        // makes the exchange fail in that case
+        next = __atomic_load_n((UINT32*)(self->p_base + offset), __ATOMIC_RELAXED);
+        next |= ((head >> 32) + 1) << 32;
+    } while (!__atomic_compare_exchange_n(&header->free_head, &head, next, TRUE,
+        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    if (offset)
+        return offset;
+
+    // Free list empty, carve a block never used before
+    index = __atomic_load_n(&header->pool_index, __ATOMIC_RELAXED);
+    do
+    {
+        if (index >= header->block_count)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&header->pool_index, &index, index + 1, TRUE,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return header->pool_offset + index * header->block_size;
+}
+
+//----------------------------------------------------------------------------
+// shm_pool_push
+//----------------------------------------------------------------------------
+static void shm_pool_push(sm_shm_t* self, UINT32 offset)
+{
+    shm_header_t* header = self->p_header;
+    UINT64 head, next;
+
+    head = __atomic_load_n(&header->free_head, __ATOMIC_RELAXED);
+    do
+    {
+        __atomic_store_n((UINT32*)(self->p_base + offset), (UINT32)head, __ATOMIC_RELAXED);
+        next = (((head >> 32) + 1) << 32) | offset;
+    } while (!__atomic_compare_exchange_n(&header->free_head, &head, next, TRUE,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+//----------------------------------------------------------------------------
+// shm_pending
+//----------------------------------------------------------------------------
+static BOOL shm_pending(sm_shm_t* self)
+{
+    UINT32 head = self->p_header->head;
+
+    return __atomic_load_n(&self->p_ring[head & self->mask].seq, __ATOMIC_SEQ_CST) == head + 1;
+}
+
+//----------------------------------------------------------------------------
+// shm_block_valid
+//----------------------------------------------------------------------------
+static BOOL shm_block_valid(const shm_header_t* header, UINT32 offset)
+{
+    UINT64 pool_end = (UINT64)header->pool_offset + (UINT64)header->block_size * header->block_count;
+
+    // The offset comes from another process, it must name a pool block
+    return offset >= header->pool_offset && offset < pool_end &&
+        (offset - header->pool_offset) % header->block_size == 0;
+}
+
+//----------------------------------------------------------------------------
+// shm_dispatch_one
+//----------------------------------------------------------------------------
+static void shm_dispatch_one(sm_shm_t* self, UINT32 event_id, UINT32 offset)
+{
+    shm_binding_t* binding = NULL;
+    sm_state_machine_t* machine;
+    void* p_event_data;
+    void* p_outer;
+    UINT i;
+
+    // A bad offset is neither dispatched nor freed, the block it claims to
+    // be may belong to somebody else
+    if (offset && !shm_block_valid(self->p_header, offset))
+    {
+        __atomic_fetch_add(&self->p_header->stats.invalid, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    p_event_data = offset ? self->p_base + offset : NULL;
+
+    if (event_id < SM_SHM_EVENTS_MAX)
+        binding = &self->bindings[event_id];
+
+    if (!binding || !binding->p_event_func)
+    {
+        __atomic_fetch_add(&self->p_header->stats.unbound, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        // The block goes back to the pool, not to the engine's allocator
+        machine = binding->p_machine;
+        p_outer = _sm_share_event_data(p_event_data);
+        binding->p_event_func(machine, p_event_data);
+        _sm_share_event_data(p_outer);
+
+        // A deferred event would outlive its block
+        for (i = 0; p_event_data && i < machine->deferred_count; i++)
+            ASSERT_TRUE(machine->deferred[i].p_event_data != p_event_data);
+
+        __atomic_fetch_add(&self->p_header->stats.dispatched, 1, __ATOMIC_RELAXED);
+    }
+
+    if (p_event_data)
+        sm_shm_free(self, p_event_data);
+}
+
+//----------------------------------------------------------------------------
+// sm_shm_create
+//----------------------------------------------------------------------------
+SHM_HANDLE sm_shm_create(const CHAR* name, UINT32 capacity, UINT32 block_size, UINT32 block_count)
+{
+    sm_shm_t* self;
+    shm_header_t* header;
+    UINT64 ring_offset, pool_offset, size;
+    UINT32 ring_capacity = 1;
+    UINT32 i;
+    INT fd;
+
+    ASSERT_TRUE(capacity);
+
+    // Round the ring capacity up to a power of two and blocks up to 8 bytes
+    while (ring_capacity < capacity)
+        ring_capacity <<= 1;
+    block_size = (UINT32)SHM_ALIGN(block_size ? block_size : sizeof(UINT32), 8);
+
+    ring_offset = SHM_ALIGN(sizeof(shm_header_t), SHM_CACHE_LINE);
+    pool_offset = SHM_ALIGN(ring_offset + (UINT64)ring_capacity * sizeof(shm_slot_t), SHM_CACHE_LINE);
+    size = pool_offset + (UINT64)block_size * block_count;
+
+    // Blocks are addressed by 32-bit offsets
+    if (size > 0xFFFFFFFFull)
+        return NULL;
+
+    // A live channel of the same name is never taken over, shm_open() fails
+    // with EEXIST instead
+    if (name)
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    else
+        fd = memfd_create("sm_shm", MFD_CLOEXEC);
+
+    if (fd < 0)
+        return NULL;
+
+    if (ftruncate(fd, (off_t)size) < 0 || !(self = shm_map(fd, (UINT32)size)))
+    {
+        close(fd);
+        if (name)
+            shm_unlink(name);
+        return NULL;
+    }
+
+    header = self->p_header;
+    header->version = SHM_VERSION;
+    header->size = (UINT32)size;
+    header->capacity = ring_capacity;
+    header->block_size = block_size;
+    header->block_count = block_count;
+    header->ring_offset = (UINT32)ring_offset;
+    header->pool_offset = (UINT32)pool_offset;
+
+    self->p_ring = (shm_slot_t*)(self->p_base + ring_offset);
+    self->mask = ring_capacity - 1;
+    for (i = 0; i < ring_capacity; i++)
+        self->p_ring[i].seq = i;
+
+    if (name)
+    {
+        self->p_name = strdup(name);
+        if (!self->p_name)
+        {
+            sm_shm_close(self);
+            shm_unlink(name);
+            return NULL;
+        }
+    }
+
+    // Other processes check the magic number last
+    __atomic_store_n(&header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+    return self;
+}
+
+//----------------------------------------------------------------------------
+// sm_shm_open
+//----------------------------------------------------------------------------
+SHM_HANDLE sm_shm_open(const CHAR* name)
+{
+    SHM_HANDLE hShm;
+    INT fd;
+
+    ASSERT_TRUE(name);
+
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return NULL;
+
+    hShm = sm_shm_attach(fd);
+    if (!hShm)
+        close(fd);
+
+    return hShm;
+}
+
+//----------------------------------------------------------------------------
+// sm_shm_attach
+//----------------------------------------------------------------------------
+SHM_HANDLE sm_shm_attach(INT fd)
+{
+    sm_shm_t* self;
+    shm_header_t* header;
+    struct stat st;
+
+    // Takes ownership of fd once attached
+    if (fstat(fd, &st) < 0 || (UINT64)st.st_size < sizeof(shm_header_t) ||
+        (UINT64)st.st_size > 0xFFFFFFFFull)
+        return NULL;
+
+    self = shm_map(fd, (UINT32)st.st_size);
+    if (!self)
+        return NULL;
+
+    header = self->p_header;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+        header->version != SHM_VERSION || header->size != (UINT32)st.st_size ||
+        !shm_layout_valid(header))
+    {
+        munmap(self->p_base, (size_t)st.st_size);
+        free(self);
+        return NULL;
+    }
+
+    self->p_ring = (shm_slot_t*)(self->p_base + header->ring_offset);
+    self->mask = header->capacity - 1;
+    return self;
+}
+
+//----------------------------------------------------------------------------
+// sm_shm_close
+//----------------------------------------------------------------------------
+void sm_shm_close(SHM_HANDLE hShm)
+{
+    sm_shm_t* self = (sm_shm_t*)hShm;
+
+    if (!self)
+        return;
+
+    // Events still in the ring stay there for a consumer attaching later
+    munmap(self->p_base, self->p_header->size);
+    close(self->fd);
+
+    if (self->p_name)
+    {
+        shm_unlink(self->p_name);
+        free(self->p_name);
+    }
+
+    free(self);
+}
+
+//----------------------------------------------------------------------------
+// sm_shm_fd
+//----------------------------------------------------------------------------
+INT sm_shm_fd(SHM_HANDLE hShm)
+{
+    sm_shm_t* self = (sm_shm_t*)hShm;
+
+    ASSERT_TRUE(self);
+    return self->fd;
+}
+
+//----------------------------------------------------------------------------
+// sm_shm_alloc
+//----------------------------------------------------------------------------
+void* sm_shm_alloc(SHM_HANDLE hShm, size_t size)
+{
+    sm_shm_t* self = (sm_shm_t*)hShm;
+    UINT32 offset;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(size <= self->p_header->block_size);
+
+    // Pool exhausted, the producer may retry once the consumer catches up
+    offset = shm_pool_pop(self);
+    if (!offset)
+        return NULL;
+
+    __atomic_fetch_add(&self->p_header->stats.blocks_used, 1, __ATOMIC_RELAXED);
+    return self->p_base + offset;
+}
+
+//----------------------------------------------------------------------------
+// sm_shm_free
+//----------------------------------------------------------------------------
+void sm_shm_free(SHM_HANDLE hShm, void* p_block)
+{
+    sm_shm_t* self = (sm_shm_t*)hShm;
+    shm_header_t* header;
+    UINT64 offset;
+
+    ASSERT_TRUE(self);
+
+    if (!p_block)
+        return;
+
+    header = self->p_header;
+    offset = (UINT64)((BYTE*)p_block - self->p_base);
+    ASSERT_TRUE(offset >= header->pool_offset && offset < header->size);
+    ASSERT_TRUE((offset - header->pool_offset) % header->block_size == 0);
+
+    shm_pool_push(self, (UINT32)offset);
+    __atomic_fetch_sub(&header->stats.blocks_used, 1, __ATOMIC_RELAXED);
+}
+
+//----------------------------------------------------------------------------
+// sm_shm_post
+//----------------------------------------------------------------------------
+BOOL sm_shm_post(SHM_HANDLE hShm, UINT32 event_id, void* p_event_data)
+{
+    sm_shm_t* self = (sm_shm_t*)hShm;
+    shm_header_t* header;
+    shm_slot_t* slot;
+    UINT32 offset = 0;
+    UINT32 pos, seq;
+
+    ASSERT_TRUE(self);
+
+    header = self->p_header;
+    if (p_event_data)
+    {
+        offset = (UINT32)((BYTE*)p_event_data - self->p_base);
+        ASSERT_TRUE(offset >= header->pool_offset && offset < header->size);
+    }
+
+    // Claim the slot at the tail, unless the consumer has not read it yet
+    pos = __atomic_load_n(&header->tail, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        slot = &self->p_ring[pos & self->mask];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == pos)
+        {
+            if (__atomic_compare_exchange_n(&header->tail, &pos, pos + 1, TRUE,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if ((INT32)(seq - pos) < 0)
+        {
+            // Ring full, the caller keeps ownership of the event data
+            __atomic_fetch_add(&header->stats.dropped, 1, __ATOMIC_RELAXED);
+            return FALSE;
+        }
+        else
+        {
+            pos = __atomic_load_n(&header->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->event_id = event_id;
+    slot->offset = offset;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&header->stats.posted, 1, __ATOMIC_RELAXED);
+
+    // Only enter the kernel when the consumer sleeps
+    if (__atomic_load_n(&header->sleeping, __ATOMIC_SEQ_CST))
+    {
+        __atomic_fetch_add(&header->wake_seq, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &header->wake_seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+        __atomic_fetch_add(&header->stats.wakeups, 1, __ATOMIC_RELAXED);
+    }
+
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// sm_shm_bind
+//----------------------------------------------------------------------------
+BOOL sm_shm_bind(SHM_HANDLE hShm, UINT32 event_id, sm_state_machine_t* machine, sm_event_func_t event_func)
+{
+    sm_shm_t* self = (sm_shm_t*)hShm;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(!event_func || machine);
+
+    if (event_id >= SM_SHM_EVENTS_MAX)
+        return FALSE;
+
+    self->bindings[event_id].p_machine = machine;
+    self->bindings[event_id].p_event_func = event_func;
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// sm_shm_dispatch
+//----------------------------------------------------------------------------
+UINT32 sm_shm_dispatch(SHM_HANDLE hShm)
+{
+    sm_shm_t* self = (sm_shm_t*)hShm;
+    shm_header_t* header;
+    shm_slot_t* slot;
+    UINT32 event_id, offset;
+    UINT32 count;
+
+    ASSERT_TRUE(self);
+
+    header = self->p_header;
+    for (count = 0; count < SM_SHM_BURST_MAX; count++)
+    {
+        slot = &self->p_ring[header->head & self->mask];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != header->head + 1)
+            break;
+
+        event_id = slot->event_id;
+        offset = slot->offset;
+
+        // Hand the slot back to producers before running the event
+        __atomic_store_n(&slot->seq, header->head + self->mask + 1, __ATOMIC_RELEASE);
+        header->head++;
+
+        shm_dispatch_one(self, event_id, offset);
+    }
+
+    return count;
+}
+
+//----------------------------------------------------------------------------
+// sm_shm_wait
+//----------------------------------------------------------------------------
+BOOL sm_shm_wait(SHM_HANDLE hShm, INT timeout_ms)
+{
+    sm_shm_t* self = (sm_shm_t*)hShm;
+    shm_header_t* header;
+    struct timespec timeout;
+    UINT32 seq;
+
+    ASSERT_TRUE(self);
+
+    header = self->p_header;
+    seq = __atomic_load_n(&header->wake_seq, __ATOMIC_SEQ_CST);
+    if (shm_pending(self))
+        return TRUE;
+    if (timeout_ms == 0)
+        return FALSE;
+
+    // Announce the sleep, then look again so a post racing with it is seen
+    // either here or by the producer
+    __atomic_store_n(&header->sleeping, TRUE, __ATOMIC_SEQ_CST);
+    if (!shm_pending(self))
+    {
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        syscall(SYS_futex, &header->wake_seq, FUTEX_WAIT, seq,
+            timeout_ms < 0 ? NULL : &timeout, NULL, 0);
+    }
+    __atomic_store_n(&header->sleeping, FALSE, __ATOMIC_SEQ_CST);
+
+    return shm_pending(self);
+}
+
+//----------------------------------------------------------------------------
+// sm_shm_stats
+//----------------------------------------------------------------------------
+void sm_shm_stats(SHM_HANDLE hShm, sm_shm_stats_t* p_stats)
+{
+    sm_shm_t* self = (sm_shm_t*)hShm;
+    sm_shm_stats_t* stats;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(p_stats);
+
+    stats = &self->p_header->stats;
+    p_stats->posted = __atomic_load_n(&stats->posted, __ATOMIC_RELAXED);
+    p_stats->dropped = __atomic_load_n(&stats->dropped, __ATOMIC_RELAXED);
+    p_stats->dispatched = __atomic_load_n(&stats->dispatched, __ATOMIC_RELAXED);
+    p_stats->unbound = __atomic_load_n(&stats->unbound, __ATOMIC_RELAXED);
+    p_stats->invalid = __atomic_load_n(&stats->invalid, __ATOMIC_RELAXED);
+    p_stats->wakeups = __atomic_load_n(&stats->wakeups, __ATOMIC_RELAXED);
+    p_stats->blocks_used = __atomic_load_n(&stats->blocks_used, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,624 @@
+#include "sm_snapshot.h"
+#include "sm_timer.h"
+#include "fault.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Pool record data: this header, the state array, then the slot data of
+// every live slot. Slots are fixed_size bytes each, or prefixed with a
+// UINT16 length when fixed_size is 0.
+typedef struct
+{
+    UINT32 pool_index;
+    UINT32 fixed_size;
+} snapshot_pool_t;
+
+// A record as found while walking a snapshot
+typedef struct
+{
+    sm_snapshot_record_t header;
+    const CHAR* name;
+    const BYTE* p_data;
+} snapshot_entry_t;
+
+static UINT32 snapshot_checksum(const BYTE* p_data, size_t size);
+static BYTE* snapshot_reserve(sm_snapshot_writer_t* writer, size_t size);
+static BYTE* snapshot_begin_record(sm_snapshot_writer_t* writer, BYTE kind, BYTE state, const CHAR* name, size_t max_data);
+static void snapshot_end_record(sm_snapshot_writer_t* writer, BYTE* p_record, size_t data_len);
+static BOOL snapshot_next(const BYTE* p_snapshot, size_t end, size_t* p_offset, snapshot_entry_t* entry);
+static BOOL snapshot_name_equal(const snapshot_entry_t* entry, const CHAR* name);
+static void snapshot_load(void* p_instance, const sm_serializer_t* serializer, size_t instance_size, const BYTE* p_data, size_t len);
+static BOOL snapshot_pool_fits(const snapshot_entry_t* entry, const snapshot_pool_t* pool_header);
+
+//----------------------------------------------------------------------------
+// snapshot_checksum
+//----------------------------------------------------------------------------
+static UINT32 snapshot_checksum(const BYTE* p_data, size_t size)
+{
+    UINT32 hash = 2166136261u;
+    size_t i;
+
+    // FNV-1a
+    for (i = 0; i < size; i++)
+    {
+        hash ^= p_data[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+//----------------------------------------------------------------------------
+// snapshot_reserve
+//----------------------------------------------------------------------------
+static BYTE* snapshot_reserve(sm_snapshot_writer_t* writer, size_t size)
+{
+    BYTE* p_space;
+
+    if (writer->overflow || writer->size - writer->len < size)
+    {
+        writer->overflow = TRUE;
+        return NULL;
+    }
+
+    p_space = writer->p_buffer + writer->len;
+    writer->len += size;
+    return p_space;
+}
+
+//----------------------------------------------------------------------------
+// snapshot_begin_record
+//----------------------------------------------------------------------------
+static BYTE* snapshot_begin_record(sm_snapshot_writer_t* writer, BYTE kind, BYTE state, const CHAR* name, size_t max_data)
+{
+    sm_snapshot_record_t record;
+    size_t name_len = name ? strlen(name) : 0;
+    BYTE* p_record;
+
+    ASSERT_TRUE(name_len <= 0xFFFF);
+
+    // Check for room for the largest data up front so the data can be
+    // written in place
+    if (writer->overflow || writer->size - writer->len < sizeof(record) + name_len + max_data)
+    {
+        writer->overflow = TRUE;
+        return NULL;
+    }
+
+    p_record = snapshot_reserve(writer, sizeof(record) + name_len);
+
+    record.data_len = 0;
+    record.name_len = (UINT16)name_len;
+    record.kind = kind;
+    record.state = state;
+    memcpy(p_record, &record, sizeof(record));
+    if (name_len)
+        memcpy(p_record + sizeof(record), name, name_len);
+
+    return p_record;
+}
+
+//----------------------------------------------------------------------------
+// snapshot_end_record
+//----------------------------------------------------------------------------
+static void snapshot_end_record(sm_snapshot_writer_t* writer, BYTE* p_record, size_t data_len)
+{
+    UINT32 len = (UINT32)data_len;
+
+    memcpy(p_record + offsetof(sm_snapshot_record_t, data_len), &len, sizeof(len));
+    writer->len += data_len;
+    writer->count++;
+}
+
+//----------------------------------------------------------------------------
+// snapshot_next
+//----------------------------------------------------------------------------
+static BOOL snapshot_next(const BYTE* p_snapshot, size_t end, size_t* p_offset, snapshot_entry_t* entry)
+{
+    size_t offset = *p_offset;
+
+    if (offset >= end || end - offset < sizeof(sm_snapshot_record_t))
+        return FALSE;
+
+    memcpy(&entry->header, p_snapshot + offset, sizeof(sm_snapshot_record_t));
+    offset += sizeof(sm_snapshot_record_t);
+
+    if (end - offset < (size_t)entry->header.name_len + entry->header.data_len)
+        return FALSE;
+
+    entry->name = (const CHAR*)(p_snapshot + offset);
+    entry->p_data = p_snapshot + offset + entry->header.name_len;
+    *p_offset = offset + entry->header.name_len + entry->header.data_len;
+
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// snapshot_name_equal
+//----------------------------------------------------------------------------
+static BOOL snapshot_name_equal(const snapshot_entry_t* entry, const CHAR* name)
+{
+    if (!name)
+        return entry->header.name_len == 0;
+
+    return strlen(name) == entry->header.name_len &&
+        memcmp(name, entry->name, entry->header.name_len) == 0;
+}
+
+//----------------------------------------------------------------------------
+// snapshot_load
+//----------------------------------------------------------------------------
+static void snapshot_load(void* p_instance, const sm_serializer_t* serializer, size_t instance_size, const BYTE* p_data, size_t len)
+{
+    if (serializer && serializer->p_load_func)
+    {
+        BOOL loaded = serializer->p_load_func(p_instance, p_data, len);
+        ASSERT_TRUE(loaded);
+        return;
+    }
+
+    ASSERT_TRUE(len <= instance_size);
+    memcpy(p_instance, p_data, len < instance_size ? len : instance_size);
+}
+
+//----------------------------------------------------------------------------
+// snapshot_pool_fits
+//----------------------------------------------------------------------------
+static BOOL snapshot_pool_fits(const snapshot_entry_t* entry, const snapshot_pool_t* pool_header)
+{
+    const BYTE* p_states;
+    size_t len = sizeof(snapshot_pool_t);
+    size_t data_len = entry->header.data_len;
+    UINT16 slot_len;
+    UINT32 handle;
+
+    // Walk the record as the restore will, checking the remaining length
+    // ahead of every read
+    if (data_len - len < pool_header->pool_index)
+        return FALSE;
+    p_states = entry->p_data + len;
+    len += pool_header->pool_index;
+
+    for (handle = 0; handle < pool_header->pool_index; handle++)
+    {
+        if (p_states[handle] == SM_POOL_SLOT_FREE)
+            continue;
+
+        if (pool_header->fixed_size)
+        {
+            if (data_len - len < pool_header->fixed_size)
+                return FALSE;
+            len += pool_header->fixed_size;
+        }
+        else
+        {
+            if (data_len - len < sizeof(slot_len))
+                return FALSE;
+            memcpy(&slot_len, entry->p_data + len, sizeof(slot_len));
+            len += sizeof(slot_len);
+            if (data_len - len < slot_len)
+                return FALSE;
+            len += slot_len;
+        }
+    }
+
+    return len == data_len;
+}
+
+//----------------------------------------------------------------------------
+// sm_snapshot_begin
+//----------------------------------------------------------------------------
+void sm_snapshot_begin(sm_snapshot_writer_t* writer, BYTE* p_buffer, size_t size)
+{
+    ASSERT_TRUE(writer);
+    ASSERT_TRUE(p_buffer || !size);
+
+    writer->p_buffer = p_buffer;
+    writer->size = size;
+    writer->len = 0;
+    writer->count = 0;
+    writer->overflow = FALSE;
+
+    // The header is filled in by sm_snapshot_end()
+    if (snapshot_reserve(writer, sizeof(sm_snapshot_header_t)))
+        memset(p_buffer, 0, sizeof(sm_snapshot_header_t));
+}
+
+//----------------------------------------------------------------------------
+// sm_snapshot_save
+//----------------------------------------------------------------------------
+BOOL sm_snapshot_save(sm_snapshot_writer_t* writer, sm_state_machine_t* machine, const sm_serializer_t* serializer)
+{
+    size_t max_data = serializer ? serializer->max_size : 0;
+    size_t data_len = 0;
+    BYTE* p_record;
+    BYTE* p_data;
+
+    ASSERT_TRUE(writer);
+    ASSERT_TRUE(machine);
+
+    // Save the state and instance data as one consistent pair
+    if (machine->lock)
+        lk_lock(machine->lock);
+
+    p_record = snapshot_begin_record(writer, SM_SNAPSHOT_INSTANCE, machine->current_state, machine->name, max_data);
+    if (p_record)
+    {
+        p_data = writer->p_buffer + writer->len;
+
+        if (serializer && serializer->p_save_func)
+            data_len = serializer->p_save_func(machine->p_instance, p_data);
+        else if (max_data)
+        {
+            memcpy(p_data, machine->p_instance, max_data);
+            data_len = max_data;
+        }
+
+        ASSERT_TRUE(data_len <= max_data);
+        snapshot_end_record(writer, p_record, data_len);
+    }
+
+    if (machine->lock)
+        lk_unlock(machine->lock);
+
+    return p_record != NULL;
+}
+
+//----------------------------------------------------------------------------
+// sm_snapshot_save_pool
+//----------------------------------------------------------------------------
+BOOL sm_snapshot_save_pool(sm_snapshot_writer_t* writer, const sm_pool_t* pool, const sm_serializer_t* serializer)
+{
+    snapshot_pool_t pool_header;
+    BOOL fixed = !serializer || !serializer->p_save_func;
+    size_t slot_max = serializer ? serializer->max_size : pool->slot_size;
+    size_t max_data;
+    BYTE* p_record;
+    BYTE* p_data;
+    UINT16 slot_len;
+    size_t len;
+    UINT32 handle;
+
+    ASSERT_TRUE(writer);
+    ASSERT_TRUE(pool);
+    ASSERT_TRUE(slot_max <= pool->slot_size);
+    ASSERT_TRUE(fixed || slot_max <= 0xFFFF);
+
+    pool_header.pool_index = pool->pool_index;
+    pool_header.fixed_size = fixed ? (UINT32)slot_max : 0;
+
+    max_data = sizeof(pool_header) + pool->pool_index + (size_t)pool->in_use * (slot_max + (fixed ? 0 : sizeof(UINT16)));
+    p_record = snapshot_begin_record(writer, SM_SNAPSHOT_POOL, 0, pool->name, max_data);
+    if (!p_record)
+        return FALSE;
+
+    // The state array goes in as one block
+    p_data = writer->p_buffer + writer->len;
+    memcpy(p_data, &pool_header, sizeof(pool_header));
+    len = sizeof(pool_header);
+    memcpy(p_data + len, pool->p_states, pool->pool_index);
+    len += pool->pool_index;
+
+    for (handle = 0; handle < pool->pool_index; handle++)
+    {
+        if (pool->p_states[handle] == SM_POOL_SLOT_FREE)
+            continue;
+
+        if (fixed)
+        {
+            memcpy(p_data + len, sm_pool_instance(pool, handle), slot_max);
+            len += slot_max;
+        }
+        else
+        {
+            slot_len = (UINT16)serializer->p_save_func(sm_pool_instance(pool, handle), p_data + len + sizeof(UINT16));
+            ASSERT_TRUE(slot_len <= slot_max);
+            memcpy(p_data + len, &slot_len, sizeof(slot_len));
+            len += sizeof(UINT16) + slot_len;
+        }
+    }
+
+    snapshot_end_record(writer, p_record, len);
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// sm_snapshot_end
+//----------------------------------------------------------------------------
+size_t sm_snapshot_end(sm_snapshot_writer_t* writer)
+{
+    sm_snapshot_header_t header;
+
+    ASSERT_TRUE(writer);
+
+    if (writer->overflow || writer->len > 0xFFFFFFFF)
+        return 0;
+
+    header.magic = SM_SNAPSHOT_MAGIC;
+    header.version = SM_SNAPSHOT_VERSION;
+    header.reserved = 0;
+    header.count = writer->count;
+    header.size = (UINT32)writer->len;
+    header.checksum = snapshot_checksum(writer->p_buffer + sizeof(header), writer->len - sizeof(header));
+
+    // The records are complete before the header makes them valid
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(writer->p_buffer, &header, sizeof(header));
+
+    return writer->len;
+}
+
+//----------------------------------------------------------------------------
+// sm_snapshot_valid
+//----------------------------------------------------------------------------
+BOOL sm_snapshot_valid(const BYTE* p_snapshot, size_t size)
+{
+    sm_snapshot_header_t header;
+    snapshot_entry_t entry;
+    size_t offset = sizeof(header);
+    UINT32 count = 0;
+
+    if (!p_snapshot || size < sizeof(header))
+        return FALSE;
+
+    memcpy(&header, p_snapshot, sizeof(header));
+    if (header.magic != SM_SNAPSHOT_MAGIC || header.version != SM_SNAPSHOT_VERSION)
+        return FALSE;
+    if (header.size < sizeof(header) || header.size > size)
+        return FALSE;
+    if (header.checksum != snapshot_checksum(p_snapshot + sizeof(header), header.size - sizeof(header)))
+        return FALSE;
+
+    // Every record must fit and the count must add up
+    while (snapshot_next(p_snapshot, header.size, &offset, &entry))
+        count++;
+
+    return count == header.count && offset == header.size;
+}
+
+//----------------------------------------------------------------------------
+// sm_snapshot_restore
+//----------------------------------------------------------------------------
+UINT32 sm_snapshot_restore(const BYTE* p_snapshot, size_t size, const sm_snapshot_binding_t* bindings, UINT32 count)
+{
+    const sm_snapshot_binding_t* binding;
+    sm_state_machine_t* machine;
+    sm_internal_event_t* p_pending;
+    sm_deferred_event_t* p_deferred;
+    snapshot_entry_t entry;
+    size_t offset = sizeof(sm_snapshot_header_t);
+    size_t end;
+    UINT32 restored = 0;
+    UINT32 next = 0;
+    UINT32 i;
+
+    ASSERT_TRUE(bindings || !count);
+
+    if (!sm_snapshot_valid(p_snapshot, size))
+        return 0;
+    end = ((const sm_snapshot_header_t*)p_snapshot)->size;
+
+    while (snapshot_next(p_snapshot, end, &offset, &entry))
+    {
+        if (entry.header.kind != SM_SNAPSHOT_INSTANCE)
+            continue;
+
+        // Bindings usually come in the order instances were saved in, try
+        // the one after the last match before searching them all
+        binding = NULL;
+        for (i = 0; i < count; i++)
+        {
+            UINT32 candidate = next + i < count ? next + i : next + i - count;
+            if (snapshot_name_equal(&entry, bindings[candidate].p_machine->name))
+            {
+                binding = &bindings[candidate];
+                next = candidate + 1 < count ? candidate + 1 : 0;
+                break;
+            }
+        }
+        if (!binding)
+            continue;
+
+        // A state beyond the state map would index past it on the next event
+        ASSERT_TRUE(binding->p_type_map);
+        if (!binding->p_type_map || entry.header.state >= binding->p_type_map->p_const->states_max)
+            continue;
+
+        machine = binding->p_machine;
+        if (machine->lock)
+            lk_lock(machine->lock);
+
+        // The restored state replaces whatever the instance was doing
+        if (machine->p_state_timers)
+            _sm_timer_cancel_state(machine);
+        while (machine->event_count)
+        {
+            p_pending = &machine->events[machine->event_head];
+            if (p_pending->p_event_data)
+                sm_xfree(p_pending->p_event_data);
+            if (++machine->event_head == SM_INTERNAL_EVENT_MAX)
+                machine->event_head = 0;
+            machine->event_count--;
+        }
+        machine->event_head = 0;
+        while (machine->deferred_count)
+        {
+            p_deferred = &machine->deferred[--machine->deferred_count];
+            if (p_deferred->p_event_data)
+                sm_xfree(p_deferred->p_event_data);
+        }
+        if (machine->p_history)
+            memset(machine->p_history, 0, SM_HSM_STATES_MAX);
+        machine->current_state = entry.header.state;
+        machine->new_state = entry.header.state;
+
+        if (entry.header.data_len)
+        {
+            snapshot_load(machine->p_instance, binding->p_serializer,
+                binding->p_serializer ? binding->p_serializer->max_size : 0,
+                entry.p_data, entry.header.data_len);
+        }
+
+        if (machine->p_view)
+            _sm_view_publish(machine);
+
+        if (machine->lock)
+            lk_unlock(machine->lock);
+
+        restored++;
+    }
+
+    return restored;
+}
+
+//----------------------------------------------------------------------------
+// sm_snapshot_restore_pool
+//----------------------------------------------------------------------------
+UINT32 sm_snapshot_restore_pool(const BYTE* p_snapshot, size_t size, sm_pool_t* pool, const sm_serializer_t* serializer)
+{
+    snapshot_pool_t pool_header;
+    snapshot_entry_t entry;
+    const BYTE* p_data;
+    size_t offset = sizeof(sm_snapshot_header_t);
+    size_t end;
+    size_t len;
+    BOOL found = FALSE;
+    UINT16 slot_len;
+    UINT32 handle;
+
+    ASSERT_TRUE(pool);
+
+    if (!sm_snapshot_valid(p_snapshot, size))
+        return 0;
+    end = ((const sm_snapshot_header_t*)p_snapshot)->size;
+
+    while (!found && snapshot_next(p_snapshot, end, &offset, &entry))
+        found = entry.header.kind == SM_SNAPSHOT_POOL && snapshot_name_equal(&entry, pool->name);
+    if (!found)
+        return 0;
+
+    // Every read below is checked against the record length first, so a
+    // short record leaves the pool as it was
+    if (entry.header.data_len < sizeof(pool_header))
+        return 0;
+    memcpy(&pool_header, entry.p_data, sizeof(pool_header));
+    ASSERT_TRUE(pool_header.pool_index <= pool->capacity);
+    ASSERT_TRUE(pool_header.fixed_size <= pool->slot_size);
+    if (pool_header.pool_index > pool->capacity || pool_header.fixed_size > pool->slot_size)
+        return 0;
+    if (!snapshot_pool_fits(&entry, &pool_header))
+        return 0;
+
+    // The state array comes back in one copy
+    p_data = entry.p_data + sizeof(pool_header);
+    memcpy(pool->p_states, p_data, pool_header.pool_index);
+    len = sizeof(pool_header) + pool_header.pool_index;
+
+    pool->pool_index = pool_header.pool_index;
+    pool->free_head = SM_INVALID_HANDLE;
+    pool->in_use = 0;
+
+    // Reload live slots and relink free ones, lowest handle first out
+    for (handle = 0; handle < pool->pool_index; handle++)
+    {
+        if (pool->p_states[handle] == SM_POOL_SLOT_FREE)
+            continue;
+
+        memset(sm_pool_instance(pool, handle), 0, pool->slot_size);
+        if (pool_header.fixed_size)
+        {
+            snapshot_load(sm_pool_instance(pool, handle), serializer, pool->slot_size, entry.p_data + len, pool_header.fixed_size);
+            len += pool_header.fixed_size;
+        }
+        else
+        {
+            memcpy(&slot_len, entry.p_data + len, sizeof(slot_len));
+            snapshot_load(sm_pool_instance(pool, handle), serializer, pool->slot_size, entry.p_data + len + sizeof(slot_len), slot_len);
+            len += sizeof(slot_len) + slot_len;
+        }
+        pool->in_use++;
+    }
+
+    for (handle = pool->pool_index; handle-- > 0; )
+    {
+        if (pool->p_states[handle] == SM_POOL_SLOT_FREE)
+        {
+            memcpy(sm_pool_instance(pool, handle), &pool->free_head, sizeof(UINT32));
+            pool->free_head = handle;
+        }
+    }
+
+    return pool->in_use;
+}
+
+//----------------------------------------------------------------------------
+// sm_snapshot_file_create
+//----------------------------------------------------------------------------
+BYTE* sm_snapshot_file_create(const char* path, size_t size)
+{
+    void* p_map;
+    int fd;
+
+    ASSERT_TRUE(path);
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return NULL;
+
+    if (ftruncate(fd, (off_t)size) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    p_map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return p_map == MAP_FAILED ? NULL : (BYTE*)p_map;
+}
+
+//----------------------------------------------------------------------------
+// sm_snapshot_file_open
+//----------------------------------------------------------------------------
+const BYTE* sm_snapshot_file_open(const char* path, size_t* p_size)
+{
+    struct stat info;
+    void* p_map;
+    int fd;
+
+    ASSERT_TRUE(path);
+    ASSERT_TRUE(p_size);
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(sm_snapshot_header_t))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    p_map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p_map == MAP_FAILED)
+        return NULL;
+
+    *p_size = (size_t)info.st_size;
+    return (const BYTE*)p_map;
+}
+
+//----------------------------------------------------------------------------
+// sm_snapshot_file_close
+//----------------------------------------------------------------------------
+void sm_snapshot_file_close(const BYTE* p_map, size_t size)
+{
+    ASSERT_TRUE(p_map);
+
+    // Written snapshots reach the disk before the mapping goes away
+    msync((void*)p_map, size, MS_SYNC);
+    munmap((void*)p_map, size);
+}
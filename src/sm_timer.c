@@ -0,0 +1,299 @@
+#include "sm_timer.h"
+#include "fault.h"
+
+// Get the slot index of _tick_ on upper level _level_
+#define LEVEL_INDEX(_tick_, _level_) \
+    (((_tick_) >> (SM_TIMER_ROOT_BITS + (_level_) * SM_TIMER_LEVEL_BITS)) & SM_TIMER_LEVEL_MASK)
+
+static void timer_link(sm_timer_t** pp_head, sm_timer_t* timer);
+static void timer_unlink(sm_timer_t* timer);
+static void timer_unlink_state(sm_timer_t* timer);
+static void timer_add(sm_timer_wheel_t* self, sm_timer_t* timer);
+static UINT32 timer_cascade(sm_timer_wheel_t* self, UINT32 level, UINT32 index);
+
+//----------------------------------------------------------------------------
+// timer_link
+//----------------------------------------------------------------------------
+static void timer_link(sm_timer_t** pp_head, sm_timer_t* timer)
+{
+    // Push the timer at the head of the slot list
+    timer->p_next = *pp_head;
+    if (timer->p_next)
+        timer->p_next->pp_prev = &timer->p_next;
+    timer->pp_prev = pp_head;
+    *pp_head = timer;
+}
+
+//----------------------------------------------------------------------------
+// timer_unlink
+//----------------------------------------------------------------------------
+static void timer_unlink(sm_timer_t* timer)
+{
+    *timer->pp_prev = timer->p_next;
+    if (timer->p_next)
+        timer->p_next->pp_prev = timer->pp_prev;
+    timer->p_next = NULL;
+    timer->pp_prev = NULL;
+}
+
+//----------------------------------------------------------------------------
+// timer_unlink_state
+//----------------------------------------------------------------------------
+static void timer_unlink_state(sm_timer_t* timer)
+{
+    if (!timer->pp_state_prev)
+        return;
+
+    *timer->pp_state_prev = timer->p_state_next;
+    if (timer->p_state_next)
+        timer->p_state_next->pp_state_prev = timer->pp_state_prev;
+    timer->p_state_next = NULL;
+    timer->pp_state_prev = NULL;
+}
+
+//----------------------------------------------------------------------------
+// timer_add
+//----------------------------------------------------------------------------
+static void timer_add(sm_timer_wheel_t* self, sm_timer_t* timer)
+{
+    UINT32 expires = timer->expires;
+    UINT32 delta = expires - self->current_tick;
+    sm_timer_t** pp_slot;
+
+    // Pick the lowest level whose range covers the remaining delay
+    if ((INT32)delta < 0)
+        pp_slot = &self->root[self->current_tick & SM_TIMER_ROOT_MASK];
+    else if (delta < (1UL << SM_TIMER_ROOT_BITS))
+        pp_slot = &self->root[expires & SM_TIMER_ROOT_MASK];
+    else if (delta < (1UL << (SM_TIMER_ROOT_BITS + SM_TIMER_LEVEL_BITS)))
+        pp_slot = &self->levels[0][LEVEL_INDEX(expires, 0)];
+    else if (delta < (1UL << (SM_TIMER_ROOT_BITS + 2 * SM_TIMER_LEVEL_BITS)))
+        pp_slot = &self->levels[1][LEVEL_INDEX(expires, 1)];
+    else if (delta < (1UL << (SM_TIMER_ROOT_BITS + 3 * SM_TIMER_LEVEL_BITS)))
+        pp_slot = &self->levels[2][LEVEL_INDEX(expires, 2)];
+    else
+        pp_slot = &self->levels[3][LEVEL_INDEX(expires, 3)];
+
+    timer_link(pp_slot, timer);
+}
+
+//----------------------------------------------------------------------------
+// timer_cascade
+//----------------------------------------------------------------------------
+static UINT32 timer_cascade(sm_timer_wheel_t* self, UINT32 level, UINT32 index)
+{
+    sm_timer_t* p_list = self->levels[level][index];
+    sm_timer_t* timer;
+
+    // Move every timer of the slot down to a finer level
+    self->levels[level][index] = NULL;
+    if (p_list)
+        p_list->pp_prev = &p_list;
+
+    while ((timer = p_list) != NULL)
+    {
+        timer_unlink(timer);
+        timer_add(self, timer);
+    }
+
+    return index;
+}
+
+//----------------------------------------------------------------------------
+// sm_timer_wheel_init
+//----------------------------------------------------------------------------
+void sm_timer_wheel_init(sm_timer_wheel_t* self, UINT32 now_tick)
+{
+    UINT32 i, j;
+
+    ASSERT_TRUE(self);
+
+    self->current_tick = now_tick;
+    self->pending = 0;
+
+    for (i = 0; i < SM_TIMER_ROOT_SLOTS; i++)
+        self->root[i] = NULL;
+
+    for (i = 0; i < SM_TIMER_LEVELS; i++)
+        for (j = 0; j < SM_TIMER_LEVEL_SLOTS; j++)
+            self->levels[i][j] = NULL;
+}
+
+//----------------------------------------------------------------------------
+// sm_timer_wheel_advance
+//----------------------------------------------------------------------------
+UINT32 sm_timer_wheel_advance(sm_timer_wheel_t* self, UINT32 ticks)
+{
+    UINT32 fired = 0;
+    UINT32 index;
+    UINT32 level;
+    sm_timer_t* p_expired;
+    sm_timer_t* timer;
+
+    ASSERT_TRUE(self);
+
+    while (ticks--)
+    {
+        index = self->current_tick & SM_TIMER_ROOT_MASK;
+
+        // Root level wrapped, pull the next slot of each upper level down
+        if (index == 0)
+        {
+            for (level = 0; level < SM_TIMER_LEVELS; level++)
+            {
+                if (timer_cascade(self, level, LEVEL_INDEX(self->current_tick, level)) != 0)
+                    break;
+            }
+        }
+
+        self->current_tick++;
+
+        // Detach the expired slot so event functions may start or cancel
+        // timers, including the ones still waiting in p_expired
+        p_expired = self->root[index];
+        self->root[index] = NULL;
+        if (p_expired)
+            p_expired->pp_prev = &p_expired;
+
+        while ((timer = p_expired) != NULL)
+        {
+            timer_unlink(timer);
+
+            if (timer->period)
+            {
+                // Periodic timers are rescheduled before the event runs
+                timer->expires += timer->period;
+                timer_add(self, timer);
+            }
+            else
+            {
+                timer_unlink_state(timer);
+                self->pending--;
+            }
+
+            fired++;
+            timer->p_event_func(timer->p_machine, NULL);
+        }
+    }
+
+    return fired;
+}
+
+//----------------------------------------------------------------------------
+// sm_timer_wheel_next_expiry
+//----------------------------------------------------------------------------
+BOOL sm_timer_wheel_next_expiry(const sm_timer_wheel_t* self, UINT32* p_ticks)
+{
+    UINT32 index;
+    UINT32 i;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(p_ticks);
+
+    if (!self->pending)
+        return FALSE;
+
+    // Look for the nearest root slot up to the next cascade. Upper levels
+    // are never due before that, so it is a safe upper bound to sleep for.
+    index = self->current_tick & SM_TIMER_ROOT_MASK;
+    for (i = 0; index + i < SM_TIMER_ROOT_SLOTS; i++)
+    {
+        if (self->root[index + i])
+            break;
+    }
+
+    *p_ticks = i + 1;
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// sm_timer_init
+//----------------------------------------------------------------------------
+void sm_timer_init(sm_timer_t* timer)
+{
+    ASSERT_TRUE(timer);
+
+    timer->p_next = NULL;
+    timer->pp_prev = NULL;
+    timer->p_state_next = NULL;
+    timer->pp_state_prev = NULL;
+    timer->p_wheel = NULL;
+}
+
+//----------------------------------------------------------------------------
+// sm_timer_start
+//----------------------------------------------------------------------------
+void sm_timer_start(sm_timer_wheel_t* self, sm_timer_t* timer, sm_state_machine_t* machine,
+    sm_event_func_t event_func, UINT32 delay, UINT32 period)
+{
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(timer);
+    ASSERT_TRUE(machine);
+    ASSERT_TRUE(event_func);
+    ASSERT_TRUE(delay <= SM_TIMER_DELAY_MAX);
+    ASSERT_TRUE(period <= SM_TIMER_DELAY_MAX);
+
+    // A longer delay would wrap to an expiry in the past, fire at the
+    // latest tick still ahead instead
+    if (delay > SM_TIMER_DELAY_MAX)
+        delay = SM_TIMER_DELAY_MAX;
+    if (period > SM_TIMER_DELAY_MAX)
+        period = SM_TIMER_DELAY_MAX;
+
+    // Restarting a running timer reschedules it
+    if (timer->pp_prev)
+        sm_timer_cancel(timer);
+
+    timer->p_wheel = self;
+    timer->p_machine = machine;
+    timer->p_event_func = event_func;
+    timer->period = period;
+    timer->p_state_next = NULL;
+    timer->pp_state_prev = NULL;
+
+    // A zero delay fires on the next tick
+    timer->expires = self->current_tick + (delay ? delay - 1 : 0);
+
+    timer_add(self, timer);
+    self->pending++;
+}
+
+//----------------------------------------------------------------------------
+// sm_timer_start_state
+//----------------------------------------------------------------------------
+void sm_timer_start_state(sm_timer_wheel_t* self, sm_timer_t* timer, sm_state_machine_t* machine,
+    sm_event_func_t event_func, UINT32 delay, UINT32 period)
+{
+    sm_timer_start(self, timer, machine, event_func, delay, period);
+
+    // Bind the timer to the current state so the engine cancels it on exit
+    timer->p_state_next = machine->p_state_timers;
+    if (timer->p_state_next)
+        timer->p_state_next->pp_state_prev = &timer->p_state_next;
+    timer->pp_state_prev = &machine->p_state_timers;
+    machine->p_state_timers = timer;
+}
+
+//----------------------------------------------------------------------------
+// sm_timer_cancel
+//----------------------------------------------------------------------------
+void sm_timer_cancel(sm_timer_t* timer)
+{
+    ASSERT_TRUE(timer);
+
+    if (!timer->pp_prev)
+        return;
+
+    timer_unlink(timer);
+    timer_unlink_state(timer);
+    timer->p_wheel->pending--;
+}
+
+//----------------------------------------------------------------------------
+// _sm_timer_cancel_state
+//----------------------------------------------------------------------------
+void _sm_timer_cancel_state(sm_state_machine_t* machine)
+{
+    while (machine->p_state_timers)
+        sm_timer_cancel(machine->p_state_timers);
+}
@@ -0,0 +1,281 @@
+#include "sm_trace.h"
+#include "fault.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+    #define SM_TRACE_TSC
+#endif
+
+// One transition as held in memory. Names point to string literals.
+typedef struct
+{
+    UINT64 timestamp;
+    const CHAR* machine;
+    const CHAR* event;
+    BYTE kind;
+    BYTE from_state;
+    BYTE to_state;
+    BYTE guard;
+    UINT32 thread;
+} sm_trace_entry_t;
+
+// The ring of one thread. reserved moves ahead of committed while an entry
+// is written, so a dump can tell which entries were overwritten under it.
+typedef struct sm_trace_ring_t
+{
+    struct sm_trace_ring_t* p_next;
+    int owned;
+    UINT64 reserved;
+    UINT64 committed;
+    sm_trace_entry_t entries[SM_TRACE_DEPTH];
+} sm_trace_ring_t;
+
+static sm_trace_ring_t* _sm_trace_rings;
+static UINT32 _sm_trace_threads;
+static pthread_once_t _sm_trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t _sm_trace_key;
+static UINT64 _sm_trace_ticks0;
+static UINT64 _sm_trace_ns0;
+
+static SM_THREAD_LOCAL sm_trace_ring_t* _sm_trace_ring;
+static SM_THREAD_LOCAL UINT32 _sm_trace_thread;
+static SM_THREAD_LOCAL const CHAR* _sm_trace_event_name;
+static SM_THREAD_LOCAL BOOL _sm_trace_paused;
+
+static UINT64 trace_ticks(void);
+static UINT64 trace_clock_ns(void);
+static void trace_init(void);
+static void trace_release(void* p_ring);
+static sm_trace_ring_t* trace_acquire(void);
+static BYTE trace_name_len(const CHAR* name);
+
+//----------------------------------------------------------------------------
+// trace_ticks
+//----------------------------------------------------------------------------
+static UINT64 trace_ticks(void)
+{
+#ifdef SM_TRACE_TSC
+    return __rdtsc();
+#else
+    return trace_clock_ns();
+#endif
+}
+
+//----------------------------------------------------------------------------
+// trace_clock_ns
+//----------------------------------------------------------------------------
+static UINT64 trace_clock_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (UINT64)now.tv_sec * 1000000000ULL + (UINT64)now.tv_nsec;
+}
+
+//----------------------------------------------------------------------------
+// trace_init
+//----------------------------------------------------------------------------
+static void trace_init(void)
+{
+    C_ASSERT((SM_TRACE_DEPTH & (SM_TRACE_DEPTH - 1)) == 0);
+
+    // Rings are handed back when their thread exits
+    pthread_key_create(&_sm_trace_key, trace_release);
+
+    // Reference point to convert ticks to nanoseconds on dump
+    _sm_trace_ticks0 = trace_ticks();
+    _sm_trace_ns0 = trace_clock_ns();
+}
+
+//----------------------------------------------------------------------------
+// trace_release
+//----------------------------------------------------------------------------
+static void trace_release(void* p_ring)
+{
+    sm_trace_ring_t* ring = (sm_trace_ring_t*)p_ring;
+
+    // Keep the records, the next thread to start tracing takes the ring over
+    __atomic_store_n(&ring->owned, 0, __ATOMIC_RELEASE);
+}
+
+//----------------------------------------------------------------------------
+// trace_acquire
+//----------------------------------------------------------------------------
+static sm_trace_ring_t* trace_acquire(void)
+{
+    sm_trace_ring_t* ring;
+    int expected;
+
+    pthread_once(&_sm_trace_once, trace_init);
+
+    // Take over the ring of a thread that exited, if any
+    for (ring = __atomic_load_n(&_sm_trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->p_next)
+    {
+        expected = 0;
+        if (__atomic_compare_exchange_n(&ring->owned, &expected, 1, FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (!ring)
+    {
+        ring = calloc(1, sizeof(sm_trace_ring_t));
+        if (!ring)
+            return NULL;
+        ring->owned = 1;
+
+        // Rings are never unlinked, so the list is push only
+        ring->p_next = __atomic_load_n(&_sm_trace_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&_sm_trace_rings, &ring->p_next, ring, FALSE, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    pthread_setspecific(_sm_trace_key, ring);
+    _sm_trace_thread = __atomic_fetch_add(&_sm_trace_threads, 1, __ATOMIC_RELAXED);
+    _sm_trace_ring = ring;
+
+    return ring;
+}
+
+//----------------------------------------------------------------------------
+// trace_name_len
+//----------------------------------------------------------------------------
+static BYTE trace_name_len(const CHAR* name)
+{
+    size_t len;
+
+    if (!name)
+        return 0;
+
+    len = strlen(name);
+    return (BYTE)(len > 0xFF ? 0xFF : len);
+}
+
+//----------------------------------------------------------------------------
+// _sm_trace_event
+//----------------------------------------------------------------------------
+void _sm_trace_event(const CHAR* event_name)
+{
+    _sm_trace_event_name = event_name;
+}
+
+//----------------------------------------------------------------------------
+// _sm_trace_record
+//----------------------------------------------------------------------------
+void _sm_trace_record(const sm_state_machine_t* self, BYTE kind, BYTE from_state, BYTE to_state, BYTE guard)
+{
+    sm_trace_ring_t* ring = _sm_trace_ring;
+    sm_trace_entry_t* entry;
+    UINT64 index;
+
+    if (_sm_trace_paused)
+        return;
+
+    if (!ring)
+    {
+        ring = trace_acquire();
+        if (!ring)
+            return;
+    }
+
+    // Only this thread writes the ring, publish the slot before filling it
+    index = ring->reserved;
+    __atomic_store_n(&ring->reserved, index + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    entry = &ring->entries[index & (SM_TRACE_DEPTH - 1)];
+    entry->timestamp = trace_ticks();
+    entry->machine = self->name;
+    entry->event = _sm_trace_event_name;
+    entry->kind = kind;
+    entry->from_state = from_state;
+    entry->to_state = to_state;
+    entry->guard = guard;
+    entry->thread = _sm_trace_thread;
+
+    __atomic_store_n(&ring->committed, index + 1, __ATOMIC_RELEASE);
+}
+
+//----------------------------------------------------------------------------
+// sm_trace_thread_enable
+//----------------------------------------------------------------------------
+BOOL sm_trace_thread_enable(BOOL enable)
+{
+    BOOL enabled = !_sm_trace_paused;
+
+    _sm_trace_paused = !enable;
+    return enabled;
+}
+
+//----------------------------------------------------------------------------
+// sm_trace_dump
+//----------------------------------------------------------------------------
+UINT32 sm_trace_dump(FILE* fp)
+{
+    sm_trace_file_header_t header;
+    sm_trace_file_record_t record;
+    sm_trace_entry_t entry;
+    sm_trace_ring_t* ring;
+    UINT64 committed, index;
+    UINT32 written = 0;
+    double ns_per_tick = 1.0;
+    UINT64 ticks, ns;
+
+    ASSERT_TRUE(fp);
+
+    memcpy(header.magic, SM_TRACE_FILE_MAGIC, sizeof(header.magic));
+    header.version = SM_TRACE_FILE_VERSION;
+    header.thread_count = (UINT16)__atomic_load_n(&_sm_trace_threads, __ATOMIC_RELAXED);
+    if (fwrite(&header, sizeof(header), 1, fp) != 1)
+        return 0;
+
+    ring = __atomic_load_n(&_sm_trace_rings, __ATOMIC_ACQUIRE);
+    if (!ring)
+        return 0;
+
+    // Calibrate the tick rate over the time since tracing started
+    ticks = trace_ticks();
+    ns = trace_clock_ns();
+    if (ticks > _sm_trace_ticks0 && ns > _sm_trace_ns0)
+        ns_per_tick = (double)(ns - _sm_trace_ns0) / (double)(ticks - _sm_trace_ticks0);
+
+    for (; ring; ring = ring->p_next)
+    {
+        committed = __atomic_load_n(&ring->committed, __ATOMIC_ACQUIRE);
+        index = committed > SM_TRACE_DEPTH ? committed - SM_TRACE_DEPTH : 0;
+
+        for (; index < committed; index++)
+        {
+            memcpy(&entry, &ring->entries[index & (SM_TRACE_DEPTH - 1)], sizeof(entry));
+
+            // Skip entries the owner thread started overwriting meanwhile
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&ring->reserved, __ATOMIC_RELAXED) > index + SM_TRACE_DEPTH)
+                continue;
+
+            record.timestamp_ns = _sm_trace_ns0 + (UINT64)((double)(INT64)(entry.timestamp - _sm_trace_ticks0) * ns_per_tick);
+            record.thread = entry.thread;
+            record.kind = entry.kind;
+            record.from_state = entry.from_state;
+            record.to_state = entry.to_state;
+            record.guard = entry.guard;
+            record.machine_len = trace_name_len(entry.machine);
+            record.event_len = trace_name_len(entry.event);
+            record.reserved = 0;
+
+            if (fwrite(&record, sizeof(record), 1, fp) != 1)
+                return written;
+            if (record.machine_len && fwrite(entry.machine, 1, record.machine_len, fp) != record.machine_len)
+                return written;
+            if (record.event_len && fwrite(entry.event, 1, record.event_len, fp) != record.event_len)
+                return written;
+
+            written++;
+        }
+    }
+
+    return written;
+}
@@ -0,0 +1,110 @@
+#include "sm_view.h"
+#include "lock_guard.h"
+#include "fault.h"
+#include <string.h>
+
+//----------------------------------------------------------------------------
+// sm_view_init
+//----------------------------------------------------------------------------
+void sm_view_init(sm_view_t* view, void* p_data, UINT32 size, sm_view_func_t func)
+{
+    ASSERT_TRUE(view);
+    ASSERT_TRUE(p_data || !size);
+
+    view->sequence = 0;
+    view->state = 0;
+    view->size = size;
+    view->p_func = func;
+    view->p_data = p_data;
+}
+
+//----------------------------------------------------------------------------
+// _sm_view_attach
+//----------------------------------------------------------------------------
+void _sm_view_attach(sm_state_machine_t* self, sm_view_t* view)
+{
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(view);
+    ASSERT_TRUE(view->p_data || !view->size);
+
+    if (self->lock)
+        lk_lock(self->lock);
+
+    // Readers see the current state before the first event
+    self->p_view = view;
+    _sm_view_publish(self);
+
+    if (self->lock)
+        lk_unlock(self->lock);
+}
+
+//----------------------------------------------------------------------------
+// _sm_view_detach
+//----------------------------------------------------------------------------
+void _sm_view_detach(sm_state_machine_t* self)
+{
+    ASSERT_TRUE(self);
+
+    if (self->lock)
+        lk_lock(self->lock);
+
+    self->p_view = NULL;
+
+    if (self->lock)
+        lk_unlock(self->lock);
+}
+
+//----------------------------------------------------------------------------
+// _sm_view_publish
+//----------------------------------------------------------------------------
+void _sm_view_publish(sm_state_machine_t* self)
+{
+    sm_view_t* view = self->p_view;
+    UINT32 sequence = view->sequence;
+
+    // The engine is the only writer, under the instance lock if any. The
+    // odd count is visible before any of the copy is rewritten.
+    __atomic_store_n(&view->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&view->state, self->current_state, __ATOMIC_RELAXED);
+    if (view->p_func)
+        view->p_func(self->p_instance, view->p_data);
+
+    __atomic_store_n(&view->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+//----------------------------------------------------------------------------
+// _sm_view_read
+//----------------------------------------------------------------------------
+UINT32 _sm_view_read(const sm_view_t* view, BYTE* p_state, void* p_data)
+{
+    UINT32 sequence;
+    BYTE state;
+
+    ASSERT_TRUE(view);
+
+    for (;;)
+    {
+        sequence = __atomic_load_n(&view->sequence, __ATOMIC_ACQUIRE);
+        if (!(sequence & 1))
+        {
+            state = __atomic_load_n(&view->state, __ATOMIC_RELAXED);
+            if (p_data && view->size)
+                memcpy(p_data, view->p_data, view->size);
+
+            // Keep the copy above ahead of the second look at the counter
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&view->sequence, __ATOMIC_RELAXED) == sequence)
+                break;
+        }
+
+        // A publish is under way, it only takes the engine a moment
+        LK_CPU_RELAX();
+    }
+
+    if (p_state)
+        *p_state = state;
+
+    return sequence / 2;
+}
@@ -0,0 +1,106 @@
+#include "sm_watch.h"
+#include "lock_guard.h"
+#include "fault.h"
+
+//----------------------------------------------------------------------------
+// _sm_watch
+//----------------------------------------------------------------------------
+void _sm_watch(sm_state_machine_t* self, sm_watch_t* watch)
+{
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(watch);
+    ASSERT_TRUE(watch->p_func);
+
+    if (self->lock)
+        lk_lock(self->lock);
+
+    watch->p_next = self->p_watches;
+    self->p_watches = watch;
+
+    if (self->lock)
+        lk_unlock(self->lock);
+}
+
+//----------------------------------------------------------------------------
+// _sm_watch_cancel
+//----------------------------------------------------------------------------
+BOOL _sm_watch_cancel(sm_state_machine_t* self, sm_watch_t* watch)
+{
+    sm_watch_t** pp_watch;
+    BOOL found = FALSE;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(watch);
+
+    if (self->lock)
+        lk_lock(self->lock);
+
+    for (pp_watch = &self->p_watches; *pp_watch; pp_watch = &(*pp_watch)->p_next)
+    {
+        if (*pp_watch == watch)
+        {
+            *pp_watch = watch->p_next;
+            found = TRUE;
+            break;
+        }
+    }
+
+    if (self->lock)
+        lk_unlock(self->lock);
+
+    return found;
+}
+
+//----------------------------------------------------------------------------
+// _sm_watch_match
+//----------------------------------------------------------------------------
+void _sm_watch_match(sm_state_machine_t* self, BYTE from, BYTE to)
+{
+    sm_watch_t** pp_watch = &self->p_watches;
+    sm_watch_t* watch;
+
+    // Called by the engine with the lock held. Matches move to the fired
+    // list, newest first.
+    while ((watch = *pp_watch) != NULL)
+    {
+        if ((watch->from != SM_WATCH_ANY && watch->from != from) ||
+            (watch->to != SM_WATCH_ANY && watch->to != to))
+        {
+            pp_watch = &watch->p_next;
+            continue;
+        }
+
+        *pp_watch = watch->p_next;
+        watch->fired_from = from;
+        watch->fired_to = to;
+        watch->p_next = self->p_fired;
+        self->p_fired = watch;
+    }
+}
+
+//----------------------------------------------------------------------------
+// _sm_watch_fire
+//----------------------------------------------------------------------------
+void _sm_watch_fire(sm_watch_t* p_fired)
+{
+    sm_watch_t* p_ordered = NULL;
+    sm_watch_t* watch;
+
+    // Fire in the order the transitions happened
+    while (p_fired)
+    {
+        watch = p_fired;
+        p_fired = watch->p_next;
+        watch->p_next = p_ordered;
+        p_ordered = watch;
+    }
+
+    // The callback may register the watch again, so read the link first
+    while (p_ordered)
+    {
+        watch = p_ordered;
+        p_ordered = watch->p_next;
+        watch->p_next = NULL;
+        watch->p_func(watch, watch->fired_from, watch->fired_to);
+    }
+}
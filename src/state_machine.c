@@ -1,152 +1,749 @@
 #include "fault.h"
 #include "state_machine.h"
+#include "sm_timer.h"
+#include "sm_queue.h"
+#include <string.h>
+#include "sm_trace.h"
+#include "sm_metrics.h"
 
-// Generates an external event. Called once per external event 
-// to start the state machine executing
-void _sm_external_event(sm_state_machine_t* self, const sm_state_machine_const_t* self_const, BYTE new_state, void* p_event_data)
+// Checks made on every transition in debug builds only. Release builds rely
+// on sm_check_map() and keep a single bounds check per transition.
+#ifdef NDEBUG
+    #define SM_ENGINE_ASSERT(_condition_)   ((void)0)
+#else
+    #define SM_ENGINE_ASSERT(_condition_)   ASSERT_TRUE(_condition_)
+#endif
+
+#if defined(__GNUC__)
+    #define SM_UNLIKELY(_condition_)    __builtin_expect(!!(_condition_), 0)
+#else
+    #define SM_UNLIKELY(_condition_)    (_condition_)
+#endif
+
+// A burst of events dispatched under one lock acquisition and one engine run
+typedef struct sm_batch_t
+{
+    sm_state_machine_t* p_machine;
+    const sm_state_machine_const_t* p_const;
+    const sm_batch_event_t* p_events;
+    sm_event_queue_t* p_queue;
+    UINT count;
+    UINT next;
+    void* p_free[SM_BATCH_FREE_MAX];
+    UINT free_count;
+} sm_batch_t;
+
+// The batch being dispatched by the calling thread, if any
+static SM_THREAD_LOCAL sm_batch_t* _sm_active_batch;
+
+// Event data shared by several instances, freed by whoever shared it
+static SM_THREAD_LOCAL void* _sm_shared_event_data;
+
+// The locked instance whose engine the calling thread runs, if any
+static SM_THREAD_LOCAL sm_state_machine_t* _sm_engine_owner;
+
+static BYTE sm_lookup_transition(const sm_state_machine_t* self, const sm_state_machine_const_t* self_const, const BYTE* transitions);
+static void sm_run_transition(sm_state_machine_t* self, const sm_state_machine_const_t* self_const, BYTE new_state, void* p_event_data);
+static void sm_run_engine(sm_state_machine_t* self, const sm_state_machine_const_t* self_const);
+static void sm_free_event_data(sm_state_machine_t* self, void* p_event_data);
+static BOOL sm_batch_pull(sm_state_machine_t* self);
+static void sm_batch_run(sm_state_machine_t* self, sm_batch_t* batch);
+static void sm_batch_flush(sm_batch_t* batch);
+static void* sm_pop_internal_event(sm_state_machine_t* self);
+static void sm_defer_event(sm_state_machine_t* self, const BYTE* transitions, void* p_event_data);
+static BOOL sm_deferred_pull(sm_state_machine_t* self, const sm_state_machine_const_t* self_const);
+static struct sm_watch_t* sm_take_fired(sm_state_machine_t* self);
+static void sm_check_map(const sm_state_machine_const_t* self_const);
+static void sm_bad_state(sm_state_machine_t* self, void* p_event_data);
+
+// Runs the engine matching the type of state map defined
+static void sm_run_engine(sm_state_machine_t* self, const sm_state_machine_const_t* self_const)
+{
+    if (self_const->state_map)
+        _sm_state_engine(self, self_const);
+    else
+        _sm_state_engine_ex(self, self_const);
+}
+
+// Takes the watches matched by the engine off the instance, to be fired
+// once the caller has released the lock
+static struct sm_watch_t* sm_take_fired(sm_state_machine_t* self)
 {
+    struct sm_watch_t* p_fired = self->p_fired;
+
+    if (p_fired)
+        self->p_fired = NULL;
+    return p_fired;
+}
+
+// Looks up the transition of the current state, taking inherited entries
+// from the ancestors of a hierarchical state
+static BYTE sm_lookup_transition(const sm_state_machine_t* self, const sm_state_machine_const_t* self_const, const BYTE* transitions)
+{
+    BYTE new_state = transitions[self->current_state];
+
+    if (new_state == EVENT_INHERITED)
+        new_state = _sm_hsm_lookup(self_const, transitions, self->current_state);
+
+    return new_state;
+}
+
+// Dispatches an event whose transition is already resolved. The caller 
+// holds the instance lock, if any.
+static void sm_run_transition(sm_state_machine_t* self, const sm_state_machine_const_t* self_const, BYTE new_state, void* p_event_data)
+{
+    sm_batch_t* batch = _sm_active_batch;
+
+    SM_TRACE_RECORD(self, SM_TRACE_KIND_EVENT, self->current_state, new_state, SM_TRACE_NO_GUARD);
+
+    // Only events with a transition map can be parked
+    ASSERT_TRUE(new_state != EVENT_DEFERRED);
+
     // If we are supposed to ignore this event
-    if (new_state == EVENT_IGNORED) 
+    if (new_state == EVENT_IGNORED || new_state == EVENT_DEFERRED) 
     {
         // Just delete the event data, if any
         if (p_event_data)
-            sm_xfree(p_event_data);
+            sm_free_event_data(self, p_event_data);
+    }
+    else if (batch && batch->p_machine == self)
+    {
+        // Inside a burst the engine picks the event up when it pulls
+        ASSERT_TRUE(batch->p_const == NULL || batch->p_const == self_const);
+        batch->p_const = self_const;
+        _sm_internal_event(self, new_state, p_event_data);
+    }
+    else if (_sm_engine_owner == self)
+    {
+        // A state action sent the event to its own instance, the running
+        // engine picks it up after the action returns
+        _sm_internal_event(self, new_state, p_event_data);
     }
     else 
     {
-        // TODO - capture software lock here for thread-safety if necessary
+        sm_state_machine_t* p_outer = _sm_engine_owner;
 
         // Generate the event 
         _sm_internal_event(self, new_state, p_event_data);
 
-        // Execute state machine based on type of state map defined
-        if (self_const->state_map)
-            _sm_state_engine(self, self_const);
+        // Execute state machine based on type of state map defined. The
+        // lock is not recursive, so actions sending events to their own
+        // instance must not take it again.
+        if (self->lock)
+            _sm_engine_owner = self;
+        sm_run_engine(self, self_const);
+        _sm_engine_owner = p_outer;
+    }
+}
+
+// Frees event data once a state is done with it. A burst holds the blocks
+// back and returns them to the allocator in one go.
+static void sm_free_event_data(sm_state_machine_t* self, void* p_event_data)
+{
+    sm_batch_t* batch = _sm_active_batch;
+
+    if (p_event_data == _sm_shared_event_data)
+        return;
+
+    if (batch && batch->p_machine == self)
+    {
+        if (batch->free_count == SM_BATCH_FREE_MAX)
+            sm_batch_flush(batch);
+        batch->p_free[batch->free_count++] = p_event_data;
+    }
+    else
+    {
+        sm_xfree(p_event_data);
+    }
+}
+
+// Feeds burst events to the instance until one of them generates a 
+// transition. Returns FALSE once the burst is used up.
+static BOOL sm_batch_pull(sm_state_machine_t* self)
+{
+    sm_batch_t* batch = _sm_active_batch;
+    sm_batch_event_t event;
+
+    if (!batch || batch->p_machine != self)
+        return FALSE;
+
+    while (!self->event_count)
+    {
+        // A queue drain pulls until the queue is empty
+        if (batch->p_queue)
+        {
+            if (!_sm_queue_pop(batch->p_queue, &event))
+                break;
+        }
         else
-            _sm_state_engine_ex(self, self_const);
+        {
+            if (batch->next == batch->count)
+                break;
+            event = batch->p_events[batch->next];
+        }
 
-        // TODO - release software lock here 
+        batch->next++;
+        event.p_event_func(self, event.p_event_data);
     }
+
+    return self->event_count != 0;
 }
 
-// Generates an internal event. Called from within a state 
-// function to transition to a new state
-void _sm_internal_event(sm_state_machine_t* self, BYTE new_state, void* p_event_data)
+// Runs a burst under the instance lock and a single engine run
+static void sm_batch_run(sm_state_machine_t* self, sm_batch_t* batch)
 {
+    sm_batch_t* p_outer = _sm_active_batch;
+    struct sm_watch_t* p_fired;
+
+    batch->p_machine = self;
+    batch->p_const = NULL;
+    batch->next = 0;
+    batch->free_count = 0;
+
+    if (self->lock)
+        lk_lock(self->lock);
+
+    _sm_active_batch = batch;
+
+    // Feed events until one transitions, then the engine pulls the rest
+    if (sm_batch_pull(self))
+        sm_run_engine(self, batch->p_const);
+
+    _sm_active_batch = p_outer;
+
+    p_fired = sm_take_fired(self);
+
+    if (self->lock)
+        lk_unlock(self->lock);
+
+    sm_batch_flush(batch);
+
+    if (p_fired)
+        _sm_watch_fire(p_fired);
+}
+
+// Returns the event data held back by a burst to the allocator
+static void sm_batch_flush(sm_batch_t* batch)
+{
+    UINT i;
+
+    for (i = 0; i < batch->free_count; i++)
+        sm_xfree(batch->p_free[i]);
+    batch->free_count = 0;
+}
+
+// Generates an external event. Called once per external event 
+// to start the state machine executing
+void _sm_external_event(sm_state_machine_t* self, const sm_state_machine_const_t* self_const, BYTE new_state, void* p_event_data)
+{
+    sm_batch_t* batch = _sm_active_batch;
+    struct sm_watch_t* p_fired;
+    SM_METRICS_START(start);
+
+    // Within a burst on this instance the lock is already held
+    if (batch && batch->p_machine == self)
+    {
+        sm_run_transition(self, self_const, new_state, p_event_data);
+        return;
+    }
+
+    // Sent by a state action of this instance, the lock is already held
+    if (_sm_engine_owner == self)
+    {
+        sm_run_transition(self, self_const, new_state, p_event_data);
+        return;
+    }
+
+    if (self->lock)
+        lk_lock(self->lock);
+
+    sm_run_transition(self, self_const, new_state, p_event_data);
+
+    p_fired = sm_take_fired(self);
+
+    if (self->lock)
+        lk_unlock(self->lock);
+
+    if (p_fired)
+        _sm_watch_fire(p_fired);
+
+    SM_METRICS_RECORD(self_const->p_metrics, SM_METRICS_EVENT, new_state, start);
+}
+
+// Generates an external event from an event function transition map. 
+// The transition is looked up under the instance lock so concurrent 
+// events always see the current state.
+void _sm_transition_event(sm_state_machine_t* self, const sm_state_machine_const_t* self_const, const BYTE* transitions, void* p_event_data)
+{
+    sm_batch_t* batch = _sm_active_batch;
+    struct sm_watch_t* p_fired;
+    BYTE new_state;
+    SM_METRICS_START(start);
+
+    // Within a burst on this instance the lock is already held
+    if (batch && batch->p_machine == self)
+    {
+        new_state = sm_lookup_transition(self, self_const, transitions);
+        if (new_state == EVENT_DEFERRED)
+            sm_defer_event(self, transitions, p_event_data);
+        else
+            sm_run_transition(self, self_const, new_state, p_event_data);
+        return;
+    }
+
+    // Sent by a state action of this instance, the lock is already held
+    if (_sm_engine_owner == self)
+    {
+        new_state = sm_lookup_transition(self, self_const, transitions);
+        if (new_state == EVENT_DEFERRED)
+            sm_defer_event(self, transitions, p_event_data);
+        else
+            sm_run_transition(self, self_const, new_state, p_event_data);
+        return;
+    }
+
+    if (self->lock)
+        lk_lock(self->lock);
+
+    new_state = sm_lookup_transition(self, self_const, transitions);
+    if (new_state == EVENT_DEFERRED)
+        sm_defer_event(self, transitions, p_event_data);
+    else
+        sm_run_transition(self, self_const, new_state, p_event_data);
+
+    p_fired = sm_take_fired(self);
+
+    if (self->lock)
+        lk_unlock(self->lock);
+
+    if (p_fired)
+        _sm_watch_fire(p_fired);
+
+    SM_METRICS_RECORD(self_const->p_metrics, SM_METRICS_EVENT, new_state, start);
+}
+
+// Dispatches a burst of events to one instance under a single lock 
+// acquisition and a single run of the state engine. Event data freed by
+// the engine is returned to the allocator at the end of the burst.
+void _sm_event_batch(sm_state_machine_t* self, const sm_batch_event_t* events, UINT count)
+{
+    sm_batch_t batch;
+
     ASSERT_TRUE(self);
+    ASSERT_TRUE(events || !count);
 
-    self->p_event_data = p_event_data;
-    self->event_generated = TRUE;
-    self->new_state = new_state;
+    batch.p_events = events;
+    batch.p_queue = NULL;
+    batch.count = count;
+    sm_batch_run(self, &batch);
 }
 
-// The state engine executes the state machine states
-void _sm_state_engine(sm_state_machine_t* self, const sm_state_machine_const_t* self_const)
+// Drains the event queue of an instance in a single engine run. Returns 
+// the number of events dispatched.
+UINT _sm_dispatch(sm_state_machine_t* self)
 {
-    void* pDataTemp = NULL;
+    sm_batch_t batch;
 
     ASSERT_TRUE(self);
-    ASSERT_TRUE(self_const);
+    ASSERT_TRUE(self->p_queue);
+
+    batch.p_events = NULL;
+    batch.p_queue = self->p_queue;
+    batch.count = 0;
+    sm_batch_run(self, &batch);
 
-    // While events are being generated keep executing states
-    while (self->event_generated)
+    return batch.next;
+}
+
+// Marks event data as shared by several instances so the engines leave
+// freeing it to the caller. Returns the data shared before.
+void* _sm_share_event_data(void* p_event_data)
+{
+    void* p_outer = _sm_shared_event_data;
+
+    _sm_shared_event_data = p_event_data;
+    return p_outer;
+}
+
+// Reports how the library was built, as callers may be built differently
+BOOL sm_debug_build(void)
+{
+#ifdef NDEBUG
+    return FALSE;
+#else
+    return TRUE;
+#endif
+}
+
+// Creates the software locks serializing events on an instance and 
+// posts to its event queue
+void _sm_lock_create(sm_state_machine_t* self)
+{
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(self->lock == NULL);
+
+    self->lock = lk_create();
+    lk_name(self->lock, self->name);
+    if (self->p_queue)
     {
-        // Error check that the new state is valid before proceeding
-        ASSERT_TRUE(self->new_state < self_const->states_max);
+        self->p_queue->lock = lk_create();
+        lk_name(self->p_queue->lock, self->name);
+    }
+}
 
-        // Get the pointers from the state map
-        sm_state_func_t state = self_const->state_map[self->new_state].p_state_func;
+// Destroys the software locks of an instance
+void _sm_lock_destroy(sm_state_machine_t* self)
+{
+    ASSERT_TRUE(self);
+
+    if (self->lock)
+        lk_destroy(self->lock);
+    self->lock = NULL;
+
+    if (self->p_queue && self->p_queue->lock)
+    {
+        lk_destroy(self->p_queue->lock);
+        self->p_queue->lock = NULL;
+    }
+}
 
-        // Copy of event data pointer
-        pDataTemp = self->p_event_data;
+// Generates an internal event. Called from within a state, guard, entry
+// or exit function to transition to a new state. Events are queued in the
+// instance ring and executed in order once the current action returns.
+void _sm_internal_event(sm_state_machine_t* self, BYTE new_state, void* p_event_data)
+{
+    UINT slot;
 
-        // Event data used up, reset the pointer
-        self->p_event_data = NULL;
+    SM_ENGINE_ASSERT(self);
 
-        // Event used up, reset the flag
-        self->event_generated = FALSE;
+    // Ring full, drop the event and its data rather than overwrite one
+    if (SM_UNLIKELY(self->event_count == SM_INTERNAL_EVENT_MAX))
+    {
+        self->event_overflows++;
+        if (p_event_data)
+            sm_free_event_data(self, p_event_data);
+        ASSERT();
+        return;
+    }
 
-        // Switch to the new current state
-        self->current_state = self->new_state;
+    slot = self->event_head + self->event_count;
+    if (slot >= SM_INTERNAL_EVENT_MAX)
+        slot -= SM_INTERNAL_EVENT_MAX;
 
-        // Execute the state action passing in event data
-        ASSERT_TRUE(state != NULL);
-        state(self, pDataTemp);
+    self->events[slot].new_state = new_state;
+    self->events[slot].p_event_data = p_event_data;
+    self->event_count++;
+}
 
-        // If event data was used, then delete it
-        if (pDataTemp)
+// Parks an event deferred by the current state. The caller holds the
+// instance lock, if any.
+static void sm_defer_event(sm_state_machine_t* self, const BYTE* transitions, void* p_event_data)
+{
+    sm_deferred_event_t* event;
+
+    SM_TRACE_RECORD(self, SM_TRACE_KIND_EVENT, self->current_state, EVENT_DEFERRED, SM_TRACE_NO_GUARD);
+
+    // List full, drop the event and its data like an internal event
+    if (self->deferred_count == SM_DEFERRED_EVENT_MAX)
+    {
+        self->event_overflows++;
+        if (p_event_data)
+            sm_free_event_data(self, p_event_data);
+        ASSERT();
+        return;
+    }
+
+    event = &self->deferred[self->deferred_count++];
+    event->p_transitions = transitions;
+    event->p_event_data = p_event_data;
+    event->state = self->current_state;
+}
+
+// Looks up the parked events again once the instance has left the state
+// that deferred them, oldest first. Returns TRUE when one of them generated
+// an internal event, after taking it off the list.
+static BOOL sm_deferred_pull(sm_state_machine_t* self, const sm_state_machine_const_t* self_const)
+{
+    sm_deferred_event_t* event;
+    void* p_event_data;
+    BYTE new_state;
+    UINT i = 0;
+
+    while (i < self->deferred_count)
+    {
+        event = &self->deferred[i];
+        if (event->state == self->current_state)
+        {
+            i++;
+            continue;
+        }
+
+        // Still deferred in the new state, park it there
+        new_state = sm_lookup_transition(self, self_const, event->p_transitions);
+        if (new_state == EVENT_DEFERRED)
         {
-            sm_xfree(pDataTemp);
-            pDataTemp = NULL;
+            event->state = self->current_state;
+            i++;
+            continue;
         }
+
+        p_event_data = event->p_event_data;
+        self->deferred_count--;
+        memmove(event, event + 1, (self->deferred_count - i) * sizeof(sm_deferred_event_t));
+
+        SM_TRACE_RECORD(self, SM_TRACE_KIND_EVENT, self->current_state, new_state, SM_TRACE_NO_GUARD);
+
+        if (new_state == EVENT_IGNORED)
+        {
+            if (p_event_data)
+                sm_free_event_data(self, p_event_data);
+            continue;
+        }
+
+        _sm_internal_event(self, new_state, p_event_data);
+        return TRUE;
     }
+
+    return FALSE;
 }
 
-// The state engine executes the extended state machine states
-void _sm_state_engine_ex(sm_state_machine_t* self, const sm_state_machine_const_t* self_const)
+// Takes the oldest internal event off the ring. Sets new_state and returns
+// the event data.
+static void* sm_pop_internal_event(sm_state_machine_t* self)
 {
-    BOOL guardResult = TRUE;
-    void* pDataTemp = NULL;
+    sm_internal_event_t* event = &self->events[self->event_head];
 
-    ASSERT_TRUE(self);
-    ASSERT_TRUE(self_const);
+    self->new_state = event->new_state;
+
+    if (++self->event_head == SM_INTERNAL_EVENT_MAX)
+        self->event_head = 0;
+    self->event_count--;
 
-    // While events are being generated keep executing states
-    while (self->event_generated)
+    return event->p_event_data;
+}
+
+// Checks the invariants of a state map the engines rely on. Runs on the
+// first engine run of each state machine type, so the engine loops only
+// keep the bounds check of each new state.
+static void sm_check_map(const sm_state_machine_const_t* self_const)
+{
+    UINT s;
+
+    ASSERT_TRUE(self_const->states_max != 0 && self_const->states_max < EVENT_DEFERRED);
+    ASSERT_TRUE((self_const->state_map == NULL) != (self_const->state_map_ex == NULL));
+    ASSERT_TRUE(self_const->p_hsm == NULL || self_const->states_max <= SM_HSM_STATES_MAX);
+
+    for (s = 0; s < self_const->states_max; s++)
     {
-        // Error check that the new state is valid before proceeding
-        ASSERT_TRUE(self->new_state < self_const->states_max);
+        if (self_const->state_map)
+            ASSERT_TRUE(self_const->state_map[s].p_state_func != NULL);
+        else
+            ASSERT_TRUE(self_const->state_map_ex[s].p_state_func != NULL);
+    }
 
-        // Get the pointers from the extended state map
-        sm_state_func_t state = self_const->state_map_ex[self->new_state].p_state_func;
-        sm_guard_func_t guard = self_const->state_map_ex[self->new_state].p_guard_func;
-        sm_entry_func_t entry = self_const->state_map_ex[self->new_state].p_entry_func;
-        sm_exit_func_t exit = self_const->state_map_ex[self->current_state].p_exit_func;
+    if (self_const->p_checked)
+        __atomic_store_n(self_const->p_checked, TRUE, __ATOMIC_RELEASE);
+}
+
+// Drops an internal event targeting a state outside the state map
+static void sm_bad_state(sm_state_machine_t* self, void* p_event_data)
+{
+    ASSERT();
+    if (p_event_data)
+        sm_free_event_data(self, p_event_data);
+}
 
-        // Copy of event data pointer
-        pDataTemp = self->p_event_data;
+// The state engine executes the state machine states
+void _sm_state_engine(sm_state_machine_t* self, const sm_state_machine_const_t* self_const)
+{
+    const sm_state_t* state_map;
+    sm_state_func_t state;
+    void* pDataTemp;
+    BYTE states_max;
+    BYTE new_state;
+    BYTE from;
 
-        // Event data used up, reset the pointer
-        self->p_event_data = NULL;
+    SM_ENGINE_ASSERT(self);
+    SM_ENGINE_ASSERT(self_const);
 
-        // Event used up, reset the flag
-        self->event_generated = FALSE;
+    if (SM_UNLIKELY(!self_const->p_checked || !__atomic_load_n(self_const->p_checked, __ATOMIC_ACQUIRE)))
+        sm_check_map(self_const);
 
-        // Execute the guard condition
-        if (guard != NULL)
-            guardResult = guard(self, pDataTemp);
+    // Keep the map in locals, state actions may write anywhere
+    state_map = self_const->state_map;
+    states_max = self_const->states_max;
 
-        // If the guard condition succeeds
-        if (guardResult == TRUE)
+    // While events are being generated keep executing states. Internal
+    // event chains run in the inner loop; once the ring is empty, events
+    // parked by the previous state go before newer external events.
+    do
+    {
+        while (self->event_count)
         {
-            // Transitioning to a new state?
-            if (self->new_state != self->current_state)
+            // Take the next event off the ring
+            pDataTemp = sm_pop_internal_event(self);
+            new_state = self->new_state;
+
+            // Error check that the new state is valid before proceeding
+            if (SM_UNLIKELY(new_state >= states_max))
             {
-                // Execute the state exit action on current state before switching to new state
-                if (exit != NULL)
-                    exit(self);
+                sm_bad_state(self, pDataTemp);
+                continue;
+            }
 
-                // Execute the state entry action on the new state
-                if (entry != NULL)
-                    entry(self, pDataTemp);
+            SM_TRACE_RECORD(self, SM_TRACE_KIND_STATE, self->current_state, new_state, SM_TRACE_NO_GUARD);
 
-                // Ensure exit/entry actions didn't call sm_internal_event by accident 
-                ASSERT_TRUE(self->event_generated == FALSE);
-            }
+            // Get the pointers from the state map
+            state = state_map[new_state].p_state_func;
+            SM_ENGINE_ASSERT(state != NULL);
+
+            // Leaving the current state cancels the timers bound to it
+            from = self->current_state;
+            if (self->p_state_timers && new_state != from)
+                _sm_timer_cancel_state(self);
 
             // Switch to the new current state
-            self->current_state = self->new_state;
+            self->current_state = new_state;
 
             // Execute the state action passing in event data
-            ASSERT_TRUE(state != NULL);
-            state(self, pDataTemp);
+            {
+                SM_METRICS_START(action_start);
+                state(self, pDataTemp);
+                SM_METRICS_RECORD(self_const->p_metrics, SM_METRICS_ACTION, new_state, action_start);
+            }
+
+            // Collect the watches waiting for this transition
+            if (self->p_watches)
+                _sm_watch_match(self, from, new_state);
+
+            // Let readers of the view see the new state
+            if (self->p_view)
+                _sm_view_publish(self);
+
+            // If event data was used, then delete it
+            if (pDataTemp)
+                sm_free_event_data(self, pDataTemp);
         }
+    } while ((self->deferred_count && sm_deferred_pull(self, self_const)) || sm_batch_pull(self));
+}
+
+// The state engine executes the extended state machine states
+void _sm_state_engine_ex(sm_state_machine_t* self, const sm_state_machine_const_t* self_const)
+{
+    const sm_state_ex_t* state_map_ex;
+    const sm_state_ex_t* p_state;
+    sm_exit_func_t exit;
+    BOOL guardResult;
+    void* pDataTemp;
+    BYTE states_max;
+    BYTE new_state;
+    BYTE from;
+
+    SM_ENGINE_ASSERT(self);
+    SM_ENGINE_ASSERT(self_const);
+
+    if (SM_UNLIKELY(!self_const->p_checked || !__atomic_load_n(self_const->p_checked, __ATOMIC_ACQUIRE)))
+        sm_check_map(self_const);
 
-        // If event data was used, then delete it
-        if (pDataTemp)
+    // Keep the map in locals, state actions may write anywhere
+    state_map_ex = self_const->state_map_ex;
+    states_max = self_const->states_max;
+
+    // While events are being generated keep executing states. Internal
+    // event chains run in the inner loop; once the ring is empty, events
+    // parked by the previous state go before newer external events.
+    do
+    {
+        while (self->event_count)
         {
-            sm_xfree(pDataTemp);
-            pDataTemp = NULL;
+            // Take the next event off the ring
+            pDataTemp = sm_pop_internal_event(self);
+
+            // A history target enters the substate last active under it
+            if (self_const->p_hsm)
+                self->new_state = _sm_hsm_target(self, self->new_state);
+            new_state = self->new_state;
+
+            // Error check that the new state is valid before proceeding
+            if (SM_UNLIKELY(new_state >= states_max))
+            {
+                sm_bad_state(self, pDataTemp);
+                continue;
+            }
+
+            // Get the entry of the new state from the extended state map
+            p_state = &state_map_ex[new_state];
+            SM_ENGINE_ASSERT(p_state->p_state_func != NULL);
+
+            // Execute the guard condition
+            guardResult = TRUE;
+            if (p_state->p_guard_func != NULL)
+            {
+                SM_METRICS_START(guard_start);
+                guardResult = p_state->p_guard_func(self, pDataTemp);
+                SM_METRICS_RECORD(self_const->p_metrics, SM_METRICS_GUARD, new_state, guard_start);
+            }
+
+            SM_TRACE_RECORD(self, SM_TRACE_KIND_STATE, self->current_state, new_state, (BYTE)guardResult);
+
+            // If the guard condition succeeds
+            if (guardResult == TRUE)
+            {
+                from = self->current_state;
+
+                // Transitioning to a new state?
+                if (new_state != from && self_const->p_hsm)
+                {
+                    // Exit and enter the states between the two along the tree
+                    _sm_hsm_transition(self, self_const, pDataTemp);
+                }
+                else if (new_state != from)
+                {
+                    // Execute the state exit action on current state before switching to new state
+                    exit = state_map_ex[from].p_exit_func;
+                    if (exit != NULL)
+                    {
+                        SM_METRICS_START(exit_start);
+                        exit(self);
+                        SM_METRICS_RECORD(self_const->p_metrics, SM_METRICS_EXIT, from, exit_start);
+                    }
+
+                    // Cancel the timers bound to the state being exited
+                    if (self->p_state_timers)
+                        _sm_timer_cancel_state(self);
+
+                    // Execute the state entry action on the new state. Internal
+                    // events raised by exit or entry actions run after the state.
+                    if (p_state->p_entry_func != NULL)
+                    {
+                        SM_METRICS_START(entry_start);
+                        p_state->p_entry_func(self, pDataTemp);
+                        SM_METRICS_RECORD(self_const->p_metrics, SM_METRICS_ENTRY, new_state, entry_start);
+                    }
+                }
+
+                // Switch to the new current state
+                self->current_state = new_state;
+
+                // Execute the state action passing in event data
+                {
+                    SM_METRICS_START(action_start);
+                    p_state->p_state_func(self, pDataTemp);
+                    SM_METRICS_RECORD(self_const->p_metrics, SM_METRICS_ACTION, new_state, action_start);
+                }
+
+                // Collect the watches waiting for this transition
+                if (self->p_watches)
+                    _sm_watch_match(self, from, new_state);
+
+                // Let readers of the view see the new state
+                if (self->p_view)
+                    _sm_view_publish(self);
+            }
+
+            // If event data was used, then delete it
+            if (pDataTemp)
+                sm_free_event_data(self, pDataTemp);
         }
-    }
+    } while ((self->deferred_count && sm_deferred_pull(self, self_const)) || sm_batch_pull(self));
 }
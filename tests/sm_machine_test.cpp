@@ -0,0 +1,238 @@
+// Checks the C++ layer: machine<> sends events with payloads moved into
+// engine blocks or handed over as event_ptr, make_event() comes back empty
+// once the allocator runs dry, and coroutines wait on transitions with
+// wait_state(), wait_transition() and post_and_wait(), resuming on the
+// thread whose event caused the transition.
+//
+// $ sm_machine_test
+// sm_machine_test: 7 checks passed
+
+#include "sm_machine.hpp"
+#include "sm_await.hpp"
+#include "fb_allocator.h"
+#include <coroutine>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+// Enough to take every block of the smallest sm_xalloc() pool
+#define HELD_MAX    64
+
+struct test_t
+{
+    INT value;
+    UINT32 starts;
+};
+
+struct test_data_t
+{
+    INT value;
+};
+
+enum States
+{
+    ST_IDLE,
+    ST_RUNNING,
+    ST_MAX_STATES
+};
+
+STATE_DECLARE(Idle, no_event_data_t)
+STATE_DECLARE(Running, test_data_t)
+
+BEGIN_STATE_MAP(Test)
+    STATE_MAP_ENTRY(ST_Idle)
+    STATE_MAP_ENTRY(ST_Running)
+END_STATE_MAP(Test)
+
+EVENT_DEFINE(tst_start, test_data_t)
+{
+    BEGIN_TRANSITION_MAP                        // - Current State -
+        TRANSITION_MAP_ENTRY(ST_RUNNING)        // ST_Idle
+        TRANSITION_MAP_ENTRY(ST_RUNNING)        // ST_Running
+    END_TRANSITION_MAP(Test, p_event_data)
+}
+
+EVENT_DEFINE(tst_stop, no_event_data_t)
+{
+    BEGIN_TRANSITION_MAP                        // - Current State -
+        TRANSITION_MAP_ENTRY(EVENT_IGNORED)     // ST_Idle
+        TRANSITION_MAP_ENTRY(ST_IDLE)           // ST_Running
+    END_TRANSITION_MAP(Test, p_event_data)
+}
+
+STATE_DEFINE(Idle, no_event_data_t)
+{
+    (void)self;
+    (void)p_event_data;
+}
+
+STATE_DEFINE(Running, test_data_t)
+{
+    test_t* p_instance = (test_t*)self->p_instance;
+
+    p_instance->value = p_event_data ? p_event_data->value : -1;
+    p_instance->starts++;
+}
+
+// Coroutine that runs eagerly and leaves nothing behind once it returns
+struct task
+{
+    struct promise_type
+    {
+        task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept {}
+    };
+};
+
+static UINT32 errors;
+static UINT32 checks;
+
+// Progress of the coroutine under test
+static UINT32 step;
+static std::thread::id resumed_on;
+
+// Faults raised by the allocator running dry, and by anything else
+static UINT32 alloc_faults;
+static UINT32 other_faults;
+
+//----------------------------------------------------------------------------
+// fault_handler
+//----------------------------------------------------------------------------
+extern "C" void fault_handler(const char* file, unsigned short line)
+{
+    // Debug builds assert when a pool runs dry, which this test does on
+    // purpose. Any other assertion fails the test.
+    (void)line;
+    if (std::strstr(file, "fb_allocator.c") || std::strstr(file, "sm_machine.hpp"))
+        alloc_faults++;
+    else
+        other_faults++;
+}
+
+//----------------------------------------------------------------------------
+// test_check
+//----------------------------------------------------------------------------
+static void test_check(bool ok, const char* what)
+{
+    checks++;
+    if (!ok)
+    {
+        std::fprintf(stderr, "sm_machine_test: %s\n", what);
+        errors++;
+    }
+}
+
+//----------------------------------------------------------------------------
+// test_waiter
+//----------------------------------------------------------------------------
+static task test_waiter(sm_state_machine_t& obj)
+{
+    machina::transition t;
+
+    // Already idle, completes without suspending
+    t = co_await machina::wait_state(obj, ST_IDLE);
+    step = 1;
+    if (t.to != ST_IDLE)
+        errors++;
+
+    // The transition happens inside the event, before the suspension
+    machina::event_ptr<test_data_t> data = machina::make_event<test_data_t>(42);
+    t = co_await machina::post_and_wait(obj, tst_start, data.release(), ST_RUNNING);
+    step = 2;
+    if (t.from != ST_IDLE || t.to != ST_RUNNING)
+        errors++;
+
+    // Resumed by the thread sending the stop event
+    t = co_await machina::wait_transition(obj, ST_RUNNING, ST_IDLE);
+    step = 3;
+    resumed_on = std::this_thread::get_id();
+    if (t.from != ST_RUNNING || t.to != ST_IDLE)
+        errors++;
+}
+
+//----------------------------------------------------------------------------
+// test_send
+//----------------------------------------------------------------------------
+static void test_send(machina::machine<test_t>& machine)
+{
+    machine.send(tst_start, test_data_t{ 7 });
+    test_check(machine.current_state() == ST_RUNNING && machine.instance().value == 7,
+        "payload sent by value not delivered");
+
+    machina::event_ptr<test_data_t> data = machina::make_event<test_data_t>(9);
+    data->value += 1;
+    machine.send(tst_start, std::move(data));
+    test_check(!data && machine.instance().value == 10, "event_ptr payload not delivered");
+
+    machine.send(tst_stop);
+    test_check(machine.current_state() == ST_IDLE, "event without data not delivered");
+}
+
+//----------------------------------------------------------------------------
+// test_exhausted
+//----------------------------------------------------------------------------
+static void test_exhausted(machina::machine<test_t>& machine)
+{
+    std::vector<machina::event_ptr<test_data_t>> held;
+    UINT32 starts = machine.instance().starts;
+
+    // Take every block, the last make_event() comes back empty
+    while (held.size() < HELD_MAX)
+    {
+        held.push_back(machina::make_event<test_data_t>(0));
+        if (!held.back())
+            break;
+    }
+    test_check(held.size() < HELD_MAX && !held.back(), "make_event() did not run dry");
+
+    // Dropped rather than sent without its data
+    machine.send(tst_start, test_data_t{ 1 });
+    test_check(machine.instance().starts == starts && machine.current_state() == ST_IDLE,
+        "event sent without a block");
+
+    // The event_ptr destructors hand the blocks back
+    held.clear();
+    machine.send(tst_start, test_data_t{ 2 });
+    machine.send(tst_stop);
+    test_check(machine.instance().starts == starts + 1, "blocks not returned");
+}
+
+int main()
+{
+    test_t instance{};
+
+    alloc_init();
+
+    {
+        machina::machine<test_t> machine("TestSM", instance, true);
+
+        test_send(machine);
+        test_exhausted(machine);
+
+        test_waiter(*machine.get());
+        if (step != 2 || machine.current_state() != ST_RUNNING || instance.value != 42)
+            errors++;
+
+        // The stop event comes from another thread, which resumes the
+        // coroutine before its send returns
+        std::thread sender([&machine] { machine.send(tst_stop); });
+        std::thread::id sender_id = sender.get_id();
+        sender.join();
+        test_check(step == 3 && resumed_on == sender_id, "coroutine not resumed by the sender");
+    }
+
+    alloc_term();
+
+    if (errors || other_faults)
+    {
+        std::fprintf(stderr, "sm_machine_test: failed, %u errors, %u faults\n", errors, other_faults);
+        return 1;
+    }
+
+    std::printf("sm_machine_test: %u checks passed\n", checks);
+    return 0;
+}
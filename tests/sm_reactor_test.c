@@ -0,0 +1,200 @@
+// Checks the reactor loop. Producer threads post events while the loop
+// runs with every event data block taken, so a ready descriptor cannot get
+// its sm_reactor_fd_data_t. The loop must keep draining posts rather than
+// give up. Once the posts are in, the blocks are released and the
+// descriptor is dispatched, which stops the loop.
+//
+// $ sm_reactor_test
+// sm_reactor_test: 40000 posts from 4 producers, 713205 allocator faults
+
+#include "sm_reactor.h"
+#include "fb_allocator.h"
+#include "fault.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PRODUCERS           4
+#define POSTS_PER_PRODUCER  10000
+#define POSTS_TOTAL         (PRODUCERS * POSTS_PER_PRODUCER)
+
+// Enough to take every block of the smallest sm_xalloc() pool
+#define HELD_MAX            64
+
+typedef struct
+{
+    UINT32 received;
+} counter_t;
+
+static REACTOR_HANDLE reactor;
+static sm_state_machine_t machines[PRODUCERS];
+static counter_t counters[PRODUCERS];
+static UINT32 received;
+static UINT32 out_of_order;
+
+static sm_state_machine_t fd_machine;
+static sm_reactor_fd_t fd_reg;
+static UINT32 fd_events;
+
+static void* held[HELD_MAX];
+static UINT32 held_count;
+
+// Faults raised by the allocator running dry, and by anything else
+static UINT32 alloc_faults;
+static UINT32 other_faults;
+
+//----------------------------------------------------------------------------
+// fault_handler
+//----------------------------------------------------------------------------
+void fault_handler(const char* file, unsigned short line)
+{
+    // Debug builds assert when a pool runs dry, which this test does on
+    // purpose. Any other assertion fails the test.
+    (void)line;
+    if (strstr(file, "fb_allocator.c"))
+        alloc_faults++;
+    else
+        other_faults++;
+}
+
+//----------------------------------------------------------------------------
+// test_release_blocks
+//----------------------------------------------------------------------------
+static void test_release_blocks(void)
+{
+    while (held_count)
+        sm_xfree(held[--held_count]);
+}
+
+//----------------------------------------------------------------------------
+// test_posted
+//----------------------------------------------------------------------------
+static void test_posted(sm_state_machine_t* self, void* p_event_data)
+{
+    counter_t* counter = (counter_t*)self->p_instance;
+
+    (void)p_event_data;
+
+    counter->received++;
+
+    // Every post is in, let the descriptor through
+    if (++received == POSTS_TOTAL)
+        test_release_blocks();
+}
+
+//----------------------------------------------------------------------------
+// test_readable
+//----------------------------------------------------------------------------
+static void test_readable(sm_state_machine_t* self, void* p_event_data)
+{
+    sm_reactor_fd_data_t* data = (sm_reactor_fd_data_t*)p_event_data;
+    UINT64 counter;
+
+    (void)self;
+
+    if (read(data->fd, &counter, sizeof(counter)) < 0)
+        other_faults++;
+
+    // The blocks are only back once every post was dispatched
+    if (received != POSTS_TOTAL)
+        out_of_order++;
+
+    fd_events++;
+    sm_xfree(data);
+    sm_reactor_stop(reactor);
+}
+
+//----------------------------------------------------------------------------
+// producer_thread
+//----------------------------------------------------------------------------
+static void* producer_thread(void* p_arg)
+{
+    sm_state_machine_t* machine = (sm_state_machine_t*)p_arg;
+    UINT32 i;
+
+    for (i = 0; i < POSTS_PER_PRODUCER; i++)
+    {
+        // A full ring leaves the event with the producer, post it again
+        while (!sm_reactor_post(reactor, machine, test_posted, NULL))
+            sched_yield();
+    }
+
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t handles[PRODUCERS];
+    UINT64 one = 1;
+    UINT32 i;
+    INT fd;
+    BOOL failed = FALSE;
+
+    alloc_init();
+
+    reactor = sm_reactor_create(256);
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!reactor || fd < 0 || !sm_reactor_add_fd(reactor, &fd_reg, fd, EPOLLIN, &fd_machine, test_readable))
+    {
+        fprintf(stderr, "sm_reactor_test: cannot create reactor\n");
+        return 1;
+    }
+
+    // Take every block the descriptor event data would come from, then make
+    // the descriptor ready
+    while (held_count < HELD_MAX && (held[held_count] = sm_xalloc(sizeof(sm_reactor_fd_data_t))) != NULL)
+        held_count++;
+    if (held_count == HELD_MAX)
+    {
+        fprintf(stderr, "sm_reactor_test: event data pool larger than expected\n");
+        return 1;
+    }
+    if (write(fd, &one, sizeof(one)) < 0)
+        return 1;
+
+    // The descriptor is skipped, the loop carries on
+    if (sm_reactor_run_once(reactor, 0) < 0 || fd_events)
+    {
+        fprintf(stderr, "sm_reactor_test: loop failed while out of event data\n");
+        return 1;
+    }
+
+    for (i = 0; i < PRODUCERS; i++)
+    {
+        machines[i].p_instance = &counters[i];
+        if (pthread_create(&handles[i], NULL, producer_thread, &machines[i]) != 0)
+        {
+            fprintf(stderr, "sm_reactor_test: cannot start producer %u\n", i);
+            return 1;
+        }
+    }
+
+    // Returns once the descriptor got through
+    sm_reactor_run(reactor);
+
+    for (i = 0; i < PRODUCERS; i++)
+    {
+        pthread_join(handles[i], NULL);
+        failed |= counters[i].received != POSTS_PER_PRODUCER;
+    }
+
+    sm_reactor_destroy(reactor);
+    close(fd);
+    test_release_blocks();
+    alloc_term();
+
+    if (failed || received != POSTS_TOTAL || fd_events != 1 || out_of_order || other_faults)
+    {
+        fprintf(stderr, "sm_reactor_test: failed, %u of %u posts, %u descriptor events, "
+            "%u early, %u faults\n", received, (UINT32)POSTS_TOTAL, fd_events, out_of_order, other_faults);
+        return 1;
+    }
+
+    printf("sm_reactor_test: %u posts from %u producers, %u allocator faults\n",
+        (UINT32)POSTS_TOTAL, (UINT32)PRODUCERS, alloc_faults);
+    return 0;
+}
@@ -0,0 +1,226 @@
+// Checks the lock free paths of the sm_shm channel: several producer
+// threads, each through its own mapping of the channel, allocate blocks and
+// post events while the consumer dispatches them. Every event must arrive
+// exactly once and in the order its producer posted it, and every block
+// must be back in the pool at the end. A post naming no pool block must be
+// dropped without reaching the event function.
+//
+// $ sm_shm_test
+// sm_shm_test: 400000 events from 4 producers, 0 blocks in use
+
+#include "sm_shm.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PRODUCERS           4
+#define EVENTS_PER_PRODUCER 100000
+#define EVENTS_TOTAL        (PRODUCERS * EVENTS_PER_PRODUCER)
+
+// A small ring and pool keep producers running into a full ring and an
+// empty free list
+#define RING_CAPACITY       64
+#define POOL_BLOCKS         32
+
+#define EVENT_ID            7
+
+typedef struct
+{
+    UINT32 producer;
+    UINT32 seq;
+} test_data_t;
+
+typedef struct
+{
+    INT fd;
+    UINT32 producer;
+    BOOL failed;
+} producer_t;
+
+static sm_state_machine_t consumer_obj;
+static UINT32 next_seq[PRODUCERS];
+static UINT32 received;
+static UINT32 errors;
+
+// Producers done posting, whether they posted everything or not
+static UINT32 finished;
+
+//----------------------------------------------------------------------------
+// test_event
+//----------------------------------------------------------------------------
+static void test_event(sm_state_machine_t* self, void* p_event_data)
+{
+    test_data_t* data = (test_data_t*)p_event_data;
+
+    (void)self;
+
+    if (!data || data->producer >= PRODUCERS || data->seq != next_seq[data->producer])
+    {
+        errors++;
+        return;
+    }
+
+    next_seq[data->producer]++;
+    received++;
+}
+
+//----------------------------------------------------------------------------
+// producer_thread
+//----------------------------------------------------------------------------
+static void* producer_thread(void* p_arg)
+{
+    producer_t* p_producer = (producer_t*)p_arg;
+    SHM_HANDLE chan;
+    test_data_t* data;
+    UINT32 i;
+
+    // Each producer maps the channel at its own address, like a process would
+    chan = sm_shm_attach(dup(p_producer->fd));
+    if (!chan)
+    {
+        p_producer->failed = TRUE;
+        __atomic_fetch_add(&finished, 1, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    for (i = 0; i < EVENTS_PER_PRODUCER; i++)
+    {
+        while (!(data = sm_shm_alloc(chan, sizeof(test_data_t))))
+            sched_yield();
+
+        data->producer = p_producer->producer;
+        data->seq = i;
+
+        // A full ring leaves the block with the producer, post it again
+        while (!sm_shm_post(chan, EVENT_ID, data))
+            sched_yield();
+    }
+
+    sm_shm_close(chan);
+    __atomic_fetch_add(&finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// test_exclusive_create
+//----------------------------------------------------------------------------
+static BOOL test_exclusive_create(void)
+{
+    CHAR name[64];
+    SHM_HANDLE chan, other;
+    BOOL ok;
+
+    snprintf(name, sizeof(name), "/sm_shm_test.%d", (int)getpid());
+
+    chan = sm_shm_create(name, RING_CAPACITY, sizeof(test_data_t), POOL_BLOCKS);
+    if (!chan)
+        return FALSE;
+
+    // A live channel is not taken over
+    errno = 0;
+    other = sm_shm_create(name, RING_CAPACITY, sizeof(test_data_t), POOL_BLOCKS);
+    ok = !other && errno == EEXIST;
+
+    sm_shm_close(other);
+    sm_shm_close(chan);
+    return ok;
+}
+
+//----------------------------------------------------------------------------
+// test_invalid_offset
+//----------------------------------------------------------------------------
+static BOOL test_invalid_offset(SHM_HANDLE chan)
+{
+    UINT32 before = received + errors;
+    BYTE* block;
+
+    block = sm_shm_alloc(chan, sizeof(test_data_t));
+    if (!block)
+        return FALSE;
+
+    // Inside the pool but not at the start of a block
+    if (!sm_shm_post(chan, EVENT_ID, block + 4))
+        return FALSE;
+    sm_shm_dispatch(chan);
+
+    // The block was neither seen by the event function nor freed
+    sm_shm_free(chan, block);
+    return received + errors == before;
+}
+
+int main(void)
+{
+    pthread_t handles[PRODUCERS];
+    producer_t producers[PRODUCERS];
+    sm_shm_stats_t stats;
+    SHM_HANDLE chan;
+    UINT32 i;
+    BOOL failed = FALSE;
+    BOOL invalid_dropped;
+
+    if (!test_exclusive_create())
+    {
+        fprintf(stderr, "sm_shm_test: second create of a live channel did not fail with EEXIST\n");
+        return 1;
+    }
+
+    chan = sm_shm_create(NULL, RING_CAPACITY, sizeof(test_data_t), POOL_BLOCKS);
+    if (!chan)
+    {
+        fprintf(stderr, "sm_shm_test: cannot create channel\n");
+        return 1;
+    }
+    sm_shm_bind(chan, EVENT_ID, &consumer_obj, test_event);
+
+    for (i = 0; i < PRODUCERS; i++)
+    {
+        producers[i].fd = sm_shm_fd(chan);
+        producers[i].producer = i;
+        producers[i].failed = FALSE;
+        if (pthread_create(&handles[i], NULL, producer_thread, &producers[i]) != 0)
+        {
+            fprintf(stderr, "sm_shm_test: cannot start producer %u\n", i);
+            return 1;
+        }
+    }
+
+    // A producer that could not attach posts nothing, so stop once every
+    // producer is done and the ring is drained
+    while (received + errors < EVENTS_TOTAL)
+    {
+        BOOL done = __atomic_load_n(&finished, __ATOMIC_ACQUIRE) == PRODUCERS;
+
+        if (sm_shm_wait(chan, 100))
+            sm_shm_dispatch(chan);
+        else if (done)
+            break;
+    }
+
+    for (i = 0; i < PRODUCERS; i++)
+    {
+        pthread_join(handles[i], NULL);
+        failed |= producers[i].failed;
+    }
+
+    invalid_dropped = test_invalid_offset(chan);
+
+    sm_shm_stats(chan, &stats);
+    sm_shm_close(chan);
+
+    // The bad post is counted as posted and invalid, not dispatched
+    if (failed || !invalid_dropped || errors || stats.posted != EVENTS_TOTAL + 1 ||
+        stats.dispatched != EVENTS_TOTAL || stats.unbound || stats.invalid != 1 || stats.blocks_used)
+    {
+        fprintf(stderr, "sm_shm_test: failed, attach %s, %u out of order, posted %u, dispatched %u, "
+            "unbound %u, invalid %u, %u blocks in use\n", failed ? "failed" : "ok", errors, stats.posted,
+            stats.dispatched, stats.unbound, stats.invalid, stats.blocks_used);
+        return 1;
+    }
+
+    printf("sm_shm_test: %u events from %u producers, %u blocks in use\n",
+        (UINT32)EVENTS_TOTAL, (UINT32)PRODUCERS, stats.blocks_used);
+    return 0;
+}
@@ -0,0 +1,181 @@
+// Checks the timer wheel against a naive model. Timers with delays spread
+// over every level of the wheel are started, restarted and cancelled at
+// random while the wheel runs across the 2^32 tick wrap. Every timer must
+// fire exactly on the tick the model expects, and never otherwise.
+//
+// $ sm_timer_test
+// sm_timer_test: 134217728 ticks, 8924578 timers fired
+
+#include "sm_timer.h"
+#include <stdio.h>
+
+#define TIMERS          256
+
+// The run starts this many ticks before the wrap and lasts twice as long,
+// long enough for the longest delays to come down from the top level
+#define TICKS_BEFORE    (1u << 26)
+#define TICKS_TOTAL     (2u * TICKS_BEFORE)
+#define START_TICK      (0u - TICKS_BEFORE)
+
+// Longest number of ticks advanced between two rounds of changes
+#define STEP_MAX        4096
+
+typedef struct
+{
+    BOOL active;
+    UINT64 due;
+    UINT32 period;
+} model_t;
+
+static sm_timer_wheel_t wheel;
+static sm_timer_t timers[TIMERS];
+static sm_state_machine_t machines[TIMERS];
+static model_t models[TIMERS];
+static UINT64 fired;
+static UINT32 errors;
+static UINT32 seed = 0x2545F491;
+
+//----------------------------------------------------------------------------
+// test_random
+//----------------------------------------------------------------------------
+static UINT32 test_random(void)
+{
+    // xorshift32, the same sequence on every run
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+//----------------------------------------------------------------------------
+// test_delay
+//----------------------------------------------------------------------------
+static UINT32 test_delay(void)
+{
+    UINT32 pick = test_random() % 100;
+
+    // Mostly short delays, some reaching each upper level
+    if (pick < 50)
+        return test_random() % (1u << 8);
+    if (pick < 80)
+        return test_random() % (1u << 16);
+    if (pick < 95)
+        return test_random() % (1u << 22);
+    return test_random() % TICKS_BEFORE;
+}
+
+//----------------------------------------------------------------------------
+// test_now
+//----------------------------------------------------------------------------
+static UINT64 test_now(void)
+{
+    return (UINT32)(wheel.current_tick - START_TICK);
+}
+
+//----------------------------------------------------------------------------
+// test_fire
+//----------------------------------------------------------------------------
+static void test_fire(sm_state_machine_t* self, void* p_event_data)
+{
+    model_t* model = (model_t*)self->p_instance;
+
+    (void)p_event_data;
+
+    if (!model->active || model->due != test_now())
+    {
+        errors++;
+        return;
+    }
+
+    if (model->period)
+        model->due += model->period;
+    else
+        model->active = FALSE;
+    fired++;
+}
+
+//----------------------------------------------------------------------------
+// test_start
+//----------------------------------------------------------------------------
+static void test_start(UINT32 i)
+{
+    UINT32 delay = test_delay();
+    UINT32 period = test_random() % 4 ? 0 : 1 + test_random() % 5000;
+
+    sm_timer_start(&wheel, &timers[i], &machines[i], test_fire, delay, period);
+
+    // A zero delay fires on the next tick
+    models[i].active = TRUE;
+    models[i].due = test_now() + (delay ? delay : 1);
+    models[i].period = period;
+}
+
+//----------------------------------------------------------------------------
+// test_check
+//----------------------------------------------------------------------------
+static void test_check(void)
+{
+    UINT32 active = 0;
+    UINT32 i;
+
+    for (i = 0; i < TIMERS; i++)
+    {
+        if (models[i].active != sm_timer_is_active(&timers[i]))
+            errors++;
+        if (!models[i].active)
+            continue;
+
+        // A timer due by now should have fired
+        if (models[i].due <= test_now())
+            errors++;
+        active++;
+    }
+
+    if (active != sm_timer_wheel_pending(&wheel))
+        errors++;
+}
+
+int main(void)
+{
+    UINT32 i, step;
+
+    sm_timer_wheel_init(&wheel, START_TICK);
+    for (i = 0; i < TIMERS; i++)
+        machines[i].p_instance = &models[i];
+
+    while (test_now() < TICKS_TOTAL && !errors)
+    {
+        // Start, restart or cancel a few timers
+        for (i = test_random() % 8; i > 0; i--)
+        {
+            UINT32 index = test_random() % TIMERS;
+
+            if (test_random() % 4)
+            {
+                test_start(index);
+            }
+            else
+            {
+                sm_timer_cancel(&timers[index]);
+                models[index].active = FALSE;
+            }
+        }
+
+        step = 1 + test_random() % STEP_MAX;
+        if (step > TICKS_TOTAL - test_now())
+            step = (UINT32)(TICKS_TOTAL - test_now());
+        sm_timer_wheel_advance(&wheel, step);
+
+        test_check();
+    }
+
+    if (errors)
+    {
+        fprintf(stderr, "sm_timer_test: failed at tick %llu of %u, %u timers off the model\n",
+            (unsigned long long)test_now(), TICKS_TOTAL, errors);
+        return 1;
+    }
+
+    printf("sm_timer_test: %u ticks, %llu timers fired\n", TICKS_TOTAL, (unsigned long long)fired);
+    return 0;
+}
@@ -0,0 +1,138 @@
+// Decodes a transition trace written by sm_trace_dump() into a listing
+// ordered by time, one transition per line.
+//
+// $ sm_trace_decode machina.trace
+//        0.000 us  T0  Motor1SM  mtr_set_speed  event  0 -> 2
+//        0.412 us  T0  Motor1SM  mtr_set_speed  state  0 -> 2
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sm_trace.h"
+
+typedef struct
+{
+    sm_trace_file_record_t record;
+    char machine[256];
+    char event[256];
+    size_t order;
+} trace_line_t;
+
+static int compare_lines(const void* p_a, const void* p_b)
+{
+    const trace_line_t* a = (const trace_line_t*)p_a;
+    const trace_line_t* b = (const trace_line_t*)p_b;
+
+    if (a->record.timestamp_ns != b->record.timestamp_ns)
+        return a->record.timestamp_ns < b->record.timestamp_ns ? -1 : 1;
+    if (a->record.thread != b->record.thread)
+        return a->record.thread < b->record.thread ? -1 : 1;
+    return a->order < b->order ? -1 : (a->order > b->order);
+}
+
+static const char* state_name(BYTE state, char* buffer, size_t size)
+{
+    if (state == EVENT_DEFERRED)
+        return "deferred";
+    if (state == EVENT_IGNORED)
+        return "ignored";
+    if (state == CANNOT_HAPPEN)
+        return "cannot-happen";
+
+    snprintf(buffer, size, "%u", state);
+    return buffer;
+}
+
+int main(int argc, char* argv[])
+{
+    sm_trace_file_header_t header;
+    trace_line_t* lines = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    char from[16];
+    char to[16];
+    FILE* fp;
+    size_t i;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+        return 2;
+    }
+
+    fp = fopen(argv[1], "rb");
+    if (!fp)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, SM_TRACE_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SM_TRACE_FILE_VERSION)
+    {
+        fprintf(stderr, "%s: not a version %u trace dump\n", argv[1], SM_TRACE_FILE_VERSION);
+        fclose(fp);
+        return 1;
+    }
+
+    for (;;)
+    {
+        trace_line_t line;
+
+        if (fread(&line.record, sizeof(line.record), 1, fp) != 1)
+            break;
+        if (fread(line.machine, 1, line.record.machine_len, fp) != line.record.machine_len ||
+            fread(line.event, 1, line.record.event_len, fp) != line.record.event_len)
+        {
+            fprintf(stderr, "%s: truncated record\n", argv[1]);
+            break;
+        }
+        line.machine[line.record.machine_len] = '\0';
+        line.event[line.record.event_len] = '\0';
+        line.order = count;
+
+        if (count == capacity)
+        {
+            trace_line_t* grown;
+
+            capacity = capacity ? capacity * 2 : 1024;
+            grown = realloc(lines, capacity * sizeof(trace_line_t));
+            if (!grown)
+            {
+                fprintf(stderr, "out of memory\n");
+                free(lines);
+                fclose(fp);
+                return 1;
+            }
+            lines = grown;
+        }
+        lines[count++] = line;
+    }
+
+    fclose(fp);
+
+    // Threads are dumped one after the other, interleave them by time
+    qsort(lines, count, sizeof(trace_line_t), compare_lines);
+
+    for (i = 0; i < count; i++)
+    {
+        const sm_trace_file_record_t* record = &lines[i].record;
+
+        printf("%14.3f us  T%u  %s  %s  %s  %s -> %s",
+            (double)(record->timestamp_ns - lines[0].record.timestamp_ns) / 1000.0,
+            record->thread,
+            lines[i].machine,
+            lines[i].event[0] ? lines[i].event : "-",
+            record->kind == SM_TRACE_KIND_EVENT ? "event" : "state",
+            state_name(record->from_state, from, sizeof(from)),
+            state_name(record->to_state, to, sizeof(to)));
+
+        if (record->guard != SM_TRACE_NO_GUARD)
+            printf("  guard %s", record->guard ? "passed" : "failed");
+        printf("\n");
+    }
+
+    free(lines);
+    return 0;
+}